@@ -59,6 +59,7 @@
 #include "files.h"
 #include "io.h"
 #include "audio_conversion.h"
+#include "simd.h"
 
 static pthread_t playing_thread = 0;  /* tid of play thread */
 static int play_thread_running = 0;
@@ -91,9 +92,9 @@ static pthread_mutex_t request_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 /* Playlists. */
 static struct plist playlist;
-static struct plist shuffled_plist;
 static struct plist queue;
 static struct plist *curr_plist; /* currently used playlist */
+static int curr_plist_random = 0; /* is it played in the random order? */
 static pthread_mutex_t plist_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 /* Is the audio device opened? */
@@ -105,9 +106,18 @@ static struct sound_params driver_sound_params = { 0, 0, 0 };
 /* Sound parameters requested by the decoder. */
 static struct sound_params req_sound_params = { 0, 0, 0 };
 
+/* Parameters of the sound in the output buffer.  These are the driver's
+ * parameters unless FloatPipeline is set, in which case the sound is kept
+ * in float and converted to the driver's format just before playing. */
+static struct sound_params pcm_sound_params = { 0, 0, 0 };
+
 static struct audio_conversion sound_conv;
 static int need_audio_conversion = 0;
 
+/* Conversion from pcm_sound_params to driver_sound_params. */
+static struct audio_conversion out_conv;
+static int need_out_conversion = 0;
+
 /* URL of the last played stream. Used to fake pause/unpause of internet
  * streams. Protected by curr_playing_mtx. */
 static char *last_stream_url = NULL;
@@ -286,6 +296,43 @@ int sfmt_Bps (const long format)
 	return Bps;
 }
 
+/* Free the deleted items of the list if there are many of them, keeping
+ * curr_playing valid.  Must be called with curr_playing_mtx and plist_mtx
+ * locked. */
+static void reclaim_deleted (struct plist *plist)
+{
+	if (plist == curr_plist)
+		curr_playing = plist_reclaim (plist, curr_playing);
+	else
+		plist_reclaim (plist, -1);
+}
+
+/* Get the next, previous or last item of the currently used playlist in
+ * the order it is played.  Must be called with plist_mtx locked. */
+static int curr_plist_next (const int num)
+{
+	if (curr_plist_random)
+		return plist_next_random (curr_plist, num);
+
+	return plist_next (curr_plist, num);
+}
+
+static int curr_plist_prev (const int num)
+{
+	if (curr_plist_random)
+		return plist_prev_random (curr_plist, num);
+
+	return plist_prev (curr_plist, num);
+}
+
+static int curr_plist_last ()
+{
+	if (curr_plist_random)
+		return plist_last_random (curr_plist);
+
+	return plist_last (curr_plist);
+}
+
 /* Move to the next file depending on the options set, the user
  * request and whether or not there are files in the queue. */
 static void go_to_another_file ()
@@ -307,10 +354,12 @@ static void go_to_another_file ()
 			before_queue_fname = xstrdup (curr_playing_fname);
 
 		curr_plist = &queue;
+		curr_plist_random = 0;
 		curr_playing = plist_next (&queue, -1);
 
 		server_queue_pop (queue.items[curr_playing].file);
 		plist_delete (&queue, curr_playing);
+		reclaim_deleted (&queue);
 	}
 	else {
 		/* If we just finished playing files from the queue and the
@@ -322,21 +371,14 @@ static void go_to_another_file ()
 			before_queue_fname = NULL;
 		}
 
-		if (shuffle) {
-			curr_plist = &shuffled_plist;
-
-			if (plist_count(&playlist)
-					&& !plist_count(&shuffled_plist)) {
-				plist_cat (&shuffled_plist, &playlist);
-				plist_shuffle (&shuffled_plist);
+		curr_plist = &playlist;
+		curr_plist_random = shuffle;
 
-				if (curr_playing_fname)
-					plist_swap_first_fname (&shuffled_plist,
-							curr_playing_fname);
-			}
-		}
-		else
-			curr_plist = &playlist;
+		if (shuffle && !plist_has_random_order (&playlist))
+			plist_set_random_order (&playlist, curr_playing_fname
+					? plist_find_fname (&playlist,
+						curr_playing_fname)
+					: -1);
 
 		curr_playing_curr_pos = plist_find_fname (curr_plist,
 				curr_playing_fname);
@@ -354,16 +396,16 @@ static void go_to_another_file ()
 
 			if (curr_playing_curr_pos == -1
 					|| started_playing_in_queue) {
-				curr_playing = plist_prev (curr_plist, -1);
+				curr_playing = curr_plist_prev (-1);
 				started_playing_in_queue = 0;
 			}
 			else
-				curr_playing = plist_prev (curr_plist,
+				curr_playing = curr_plist_prev (
 						curr_playing_curr_pos);
 
 			if (curr_playing == -1) {
 				if (options_get_bool("Repeat"))
-					curr_playing = plist_last (curr_plist);
+					curr_playing = curr_plist_last ();
 				logit ("Beginning of the list.");
 			}
 			else
@@ -374,20 +416,17 @@ static void go_to_another_file ()
 
 			if (curr_playing_curr_pos == -1
 					|| started_playing_in_queue) {
-				curr_playing = plist_next (curr_plist, -1);
+				curr_playing = curr_plist_next (-1);
 				started_playing_in_queue = 0;
 			}
 			else
-				curr_playing = plist_next (curr_plist,
+				curr_playing = curr_plist_next (
 						curr_playing_curr_pos);
 
 			if (curr_playing == -1 && options_get_bool("Repeat")) {
-				if (shuffle) {
-					plist_clear (&shuffled_plist);
-					plist_cat (&shuffled_plist, &playlist);
-					plist_shuffle (&shuffled_plist);
-				}
-				curr_playing = plist_next (curr_plist, -1);
+				if (shuffle)
+					plist_set_random_order (&playlist, -1);
+				curr_playing = curr_plist_next (-1);
 				logit ("Going back to the first item.");
 			}
 			else if (curr_playing == -1)
@@ -439,7 +478,7 @@ static void *play_thread (void *unused ATTR_UNUSED)
 
 			out_buf_time_set (out_buf, 0.0);
 
-			next = plist_next (curr_plist, curr_playing);
+			next = curr_plist_next (curr_playing);
 			next_file = next != -1 ? plist_get_file (curr_plist, next) : NULL;
 			UNLOCK (plist_mtx);
 			UNLOCK (curr_playing_mtx);
@@ -543,32 +582,34 @@ void audio_play (const char *fname)
 	 * playing file from the queue. */
 	if (plist_count(&queue) && !(*fname)) {
 		curr_plist = &queue;
+		curr_plist_random = 0;
 		curr_playing = plist_next (&queue, -1);
 
 		/* remove the file from queue */
 		server_queue_pop (queue.items[curr_playing].file);
 		plist_delete (curr_plist, curr_playing);
+		reclaim_deleted (curr_plist);
 
 		started_playing_in_queue = 1;
 	}
 	else if (options_get_bool("Shuffle")) {
-		plist_clear (&shuffled_plist);
-		plist_cat (&shuffled_plist, &playlist);
-		plist_shuffle (&shuffled_plist);
-		plist_swap_first_fname (&shuffled_plist, fname);
-
-		curr_plist = &shuffled_plist;
+		curr_plist = &playlist;
+		curr_plist_random = 1;
 
-		if (*fname)
+		if (*fname) {
 			curr_playing = plist_find_fname (curr_plist, fname);
+			plist_set_random_order (curr_plist, curr_playing);
+		}
 		else if (plist_count(curr_plist)) {
-			curr_playing = plist_next (curr_plist, -1);
+			plist_set_random_order (curr_plist, -1);
+			curr_playing = curr_plist_next (-1);
 		}
 		else
 			curr_playing = -1;
 	}
 	else {
 		curr_plist = &playlist;
+		curr_plist_random = 0;
 
 		if (*fname)
 			curr_playing = plist_find_fname (curr_plist, fname);
@@ -725,15 +766,34 @@ int audio_open (struct sound_params *sound_params)
 		char fmt_name[SFMT_STR_MAX] LOGIT_ONLY;
 
 		driver_sound_params.rate = hw.get_rate ();
-		if (driver_sound_params.fmt != req_sound_params.fmt
-				|| driver_sound_params.channels
+
+		pcm_sound_params = driver_sound_params;
+		if (options_get_bool ("FloatPipeline")
+				&& (driver_sound_params.fmt & SFMT_MASK_FORMAT)
+				!= SFMT_FLOAT) {
+			pcm_sound_params.fmt = SFMT_FLOAT;
+			if (!audio_conv_new (&out_conv, &pcm_sound_params,
+					&driver_sound_params)) {
+				hw.close ();
+				reset_sound_params (&req_sound_params);
+				return 0;
+			}
+			need_out_conversion = 1;
+		}
+
+		if (pcm_sound_params.fmt != req_sound_params.fmt
+				|| pcm_sound_params.channels
 				!= req_sound_params.channels
 				|| (!sample_rate_compat(
 						req_sound_params.rate,
-						driver_sound_params.rate))) {
+						pcm_sound_params.rate))) {
 			logit ("Conversion of the sound is needed.");
 			if (!audio_conv_new (&sound_conv, &req_sound_params,
-					&driver_sound_params)) {
+					&pcm_sound_params)) {
+				if (need_out_conversion) {
+					audio_conv_destroy (&out_conv);
+					need_out_conversion = 0;
+				}
 				hw.close ();
 				reset_sound_params (&req_sound_params);
 				return 0;
@@ -750,6 +810,8 @@ int audio_open (struct sound_params *sound_params)
 				sfmt_str(driver_sound_params.fmt, fmt_name, sizeof(fmt_name)),
 				driver_sound_params.channels,
 				driver_sound_params.rate);
+		if (need_out_conversion)
+			logit ("Processing the sound as float");
 	}
 
 	return res;
@@ -759,7 +821,7 @@ int audio_send_buf (const char *buf, const size_t size)
 {
 	size_t out_data_len = size;
 	int res;
-	char *converted = NULL;
+	const char *converted = NULL;
 
 	if (need_audio_conversion)
 		converted = audio_conv (&sound_conv, buf, size, &out_data_len);
@@ -771,9 +833,6 @@ int audio_send_buf (const char *buf, const size_t size)
 	else
 		res = 0;
 
-	if (converted)
-		free (converted);
-
 	return res;
 }
 
@@ -793,43 +852,79 @@ int audio_get_bps ()
 	return driver_sound_params.rate * audio_get_bpf ();
 }
 
+/* Get the bytes per frame value of the sound in the output buffer, which
+ * differs from audio_get_bpf() when FloatPipeline is in effect.
+ * May return 0 if the audio device is closed. */
+int audio_get_pcm_bpf ()
+{
+	return pcm_sound_params.channels
+		* (pcm_sound_params.fmt ? sfmt_Bps(pcm_sound_params.fmt) : 0);
+}
+
+/* Get the bytes per second value of the sound in the output buffer.
+ * May return 0 if the audio device is closed. */
+int audio_get_pcm_bps ()
+{
+	return pcm_sound_params.rate * audio_get_pcm_bpf ();
+}
+
 int audio_get_buf_fill ()
 {
 	return hw.get_buff_fill ();
 }
 
-int audio_send_pcm (const char *buf, const size_t size)
+/* A processing stage applied to the PCM data going to the audio device. */
+struct pcm_filter
 {
-	char *softmixed = NULL;
-	char *equalized = NULL;
+	const char *name;
+	int (*is_active) ();
+	void (*process) (char *buf, size_t size,
+			const struct sound_params *sound_params);
+};
 
-	if (equalizer_is_active ())
-	{
-		equalized = xmalloc (size);
-		memcpy (equalized, buf, size);
+static int softmixer_is_needed ()
+{
+	return softmixer_is_active () || softmixer_is_mono ();
+}
 
-		equalizer_process_buffer (equalized, size, &driver_sound_params);
+/* The filters in the order they are applied. */
+static const struct pcm_filter pcm_filters[] = {
+	{ "equalizer", equalizer_is_active, equalizer_process_buffer },
+	{ "softmixer", softmixer_is_needed, softmixer_process_buffer }
+};
+
+/* Run the PCM data from the output buffer through the active filters in
+ * place and convert it to the driver's format.  Return the data to be
+ * played and put its size in play_size.  This is called by the output
+ * buffer thread which may be running with realtime priority, so nothing
+ * here may allocate memory in the normal case. */
+const char *audio_process_pcm (char *buf, const size_t size,
+		size_t *play_size)
+{
+	size_t ix;
+	const char *converted;
 
-		buf = equalized;
+	for (ix = 0; ix < ARRAY_SIZE(pcm_filters); ix += 1) {
+		if (pcm_filters[ix].is_active ()) {
+			debug ("Applying %s", pcm_filters[ix].name);
+			pcm_filters[ix].process (buf, size, &pcm_sound_params);
+		}
 	}
 
-	if (softmixer_is_active () || softmixer_is_mono ())
-	{
-		if (equalized)
-		{
-			softmixed = equalized;
-		}
-		else
-		{
-			softmixed = xmalloc (size);
-			memcpy (softmixed, buf, size);
-		}
+	*play_size = size;
+	if (!need_out_conversion)
+		return buf;
 
-		softmixer_process_buffer (softmixed, size, &driver_sound_params);
+	converted = audio_conv (&out_conv, buf, size, play_size);
+	if (!converted)
+		*play_size = 0;
 
-		buf = softmixed;
-	}
+	return converted;
+}
 
+/* Play the PCM data, already processed by audio_process_pcm(). */
+int audio_send_pcm (const char *buf, const size_t size)
+{
 	int played;
 
 	played = hw.play (buf, size);
@@ -837,12 +932,6 @@ int audio_send_pcm (const char *buf, const size_t size)
 	if (played < 0)
 		fatal ("Audio output error!");
 
-	if (softmixed && !equalized)
-		free (softmixed);
-
-	if (equalized)
-		free (equalized);
-
 	return played;
 }
 
@@ -857,11 +946,16 @@ void audio_close ()
 	if (audio_opened) {
 		reset_sound_params (&req_sound_params);
 		reset_sound_params (&driver_sound_params);
+		reset_sound_params (&pcm_sound_params);
 		hw.close ();
 		if (need_audio_conversion) {
 			audio_conv_destroy (&sound_conv);
 			need_audio_conversion = 0;
 		}
+		if (need_out_conversion) {
+			audio_conv_destroy (&out_conv);
+			need_out_conversion = 0;
+		}
 		audio_opened = 0;
 	}
 }
@@ -961,11 +1055,11 @@ void audio_initialize ()
 
 	out_buf = out_buf_new (options_get_int("OutputBuffer") * 1024);
 
+	simd_init ();
 	softmixer_init();
 	equalizer_init();
 
 	plist_init (&playlist);
-	plist_init (&shuffled_plist);
 	plist_init (&queue);
 	player_init ();
 }
@@ -980,7 +1074,6 @@ void audio_exit ()
 	out_buf_free (out_buf);
 	out_buf = NULL;
 	plist_free (&playlist);
-	plist_free (&shuffled_plist);
 	plist_free (&queue);
 	player_cleanup ();
 	rc = pthread_mutex_destroy (&curr_playing_mtx);
@@ -1041,7 +1134,6 @@ int audio_get_prev_state ()
 void audio_plist_add (const char *file)
 {
 	LOCK (plist_mtx);
-	plist_clear (&shuffled_plist);
 	if (plist_find_fname(&playlist, file) == -1)
 		plist_add (&playlist, file);
 	else
@@ -1062,7 +1154,6 @@ void audio_queue_add (const char *file)
 void audio_plist_clear ()
 {
 	LOCK (plist_mtx);
-	plist_clear (&shuffled_plist);
 	plist_clear (&playlist);
 	UNLOCK (plist_mtx);
 }
@@ -1111,26 +1202,30 @@ void audio_plist_delete (const char *file)
 {
 	int num;
 
+	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
 	num = plist_find_fname (&playlist, file);
-	if (num != -1)
+	if (num != -1) {
 		plist_delete (&playlist, num);
-
-	num = plist_find_fname (&shuffled_plist, file);
-	if (num != -1)
-		plist_delete (&shuffled_plist, num);
+		reclaim_deleted (&playlist);
+	}
 	UNLOCK (plist_mtx);
+	UNLOCK (curr_playing_mtx);
 }
 
 void audio_queue_delete (const char *file)
 {
 	int num;
 
+	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
 	num = plist_find_fname (&queue, file);
-	if (num != -1)
+	if (num != -1) {
 		plist_delete (&queue, num);
+		reclaim_deleted (&queue);
+	}
 	UNLOCK (plist_mtx);
+	UNLOCK (curr_playing_mtx);
 }
 
 /* Get the time of a file if the file is on the playlist and
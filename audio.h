@@ -233,10 +233,14 @@ void audio_jump_to (const int sec);
 
 int audio_open (struct sound_params *sound_params);
 int audio_send_buf (const char *buf, const size_t size);
+const char *audio_process_pcm (char *buf, const size_t size,
+		size_t *play_size);
 int audio_send_pcm (const char *buf, const size_t size);
 void audio_reset ();
 int audio_get_bpf ();
 int audio_get_bps ();
+int audio_get_pcm_bpf ();
+int audio_get_pcm_bps ();
 int audio_get_buf_fill ();
 void audio_close ();
 int audio_get_time ();
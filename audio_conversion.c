@@ -43,6 +43,136 @@
 #include "log.h"
 #include "options.h"
 #include "compat.h"
+#include "simd.h"
+
+/* Single sample conversions between fixed point formats and float.  The
+ * buffer conversion loops and the fused kernels below are built from these
+ * so that all paths produce identical results. */
+
+static inline unsigned char float_to_u8_sample (const float in)
+{
+	float f = in * INT32_MAX;
+
+	if (f >= INT32_MAX)
+		return UINT8_MAX;
+	if (f <= INT32_MIN)
+		return 0;
+#ifdef HAVE_LRINTF
+	return (unsigned int)((lrintf(f) >> 24) - INT8_MIN);
+#else
+	return (unsigned int)(((int)f >> 24) - INT8_MIN);
+#endif
+}
+
+static inline int8_t float_to_s8_sample (const float in)
+{
+	float f = in * INT32_MAX;
+
+	if (f >= INT32_MAX)
+		return INT8_MAX;
+	if (f <= INT32_MIN)
+		return INT8_MIN;
+#ifdef HAVE_LRINTF
+	return lrintf(f) >> 24;
+#else
+	return (int)f >> 24;
+#endif
+}
+
+static inline uint16_t float_to_u16_sample (const float in)
+{
+	float f = in * INT32_MAX;
+
+	if (f >= INT32_MAX)
+		return UINT16_MAX;
+	if (f <= INT32_MIN)
+		return 0;
+#ifdef HAVE_LRINTF
+	return (unsigned int)((lrintf(f) >> 16) - INT16_MIN);
+#else
+	return (unsigned int)(((int)f >> 16) - INT16_MIN);
+#endif
+}
+
+static inline int16_t float_to_s16_sample (const float in)
+{
+	float f = in * INT32_MAX;
+
+	if (f >= INT32_MAX)
+		return INT16_MAX;
+	if (f <= INT32_MIN)
+		return INT16_MIN;
+#ifdef HAVE_LRINTF
+	return lrintf(f) >> 16;
+#else
+	return (int)f >> 16;
+#endif
+}
+
+/* maximum and minimum values of 32-bit samples */
+#define U32_MAX	((1U << 24) - 1)
+#define S32_MAX	((1 << 23) - 1)
+#define S32_MIN	(-(1 << 23))
+
+static inline uint32_t float_to_u32_sample (const float in)
+{
+	float f = in * S32_MAX;
+
+	if (f >= S32_MAX)
+		return U32_MAX << 8;
+	if (f <= S32_MIN)
+		return 0;
+#ifdef HAVE_LRINTF
+	return (uint32_t)(lrintf(f) - S32_MIN) << 8;
+#else
+	return (uint32_t)((int32_t)f - S32_MIN) << 8;
+#endif
+}
+
+static inline int32_t float_to_s32_sample (const float in)
+{
+	float f = in * S32_MAX;
+
+	if (f >= S32_MAX)
+		return S32_MAX << 8;
+	if (f <= S32_MIN)
+		return S32_MIN << 8;
+#ifdef HAVE_LRINTF
+	return lrintf(f) << 8;
+#else
+	return (int32_t)f << 8;
+#endif
+}
+
+static inline float u8_sample_to_float (const uint8_t in)
+{
+	return (((int)in) + INT8_MIN) / (float)(INT8_MAX + 1);
+}
+
+static inline float s8_sample_to_float (const int8_t in)
+{
+	return in / (float)(INT8_MAX + 1);
+}
+
+static inline float u16_sample_to_float (const uint16_t in)
+{
+	return ((int)in + INT16_MIN) / (float)(INT16_MAX + 1);
+}
+
+static inline float s16_sample_to_float (const int16_t in)
+{
+	return in / (float)(INT16_MAX + 1);
+}
+
+static inline float u32_sample_to_float (const uint32_t in)
+{
+	return ((float)in + (float)INT32_MIN) / ((float)INT32_MAX + 1.0);
+}
+
+static inline float s32_sample_to_float (const int32_t in)
+{
+	return in / ((float)INT32_MAX + 1.0);
+}
 
 static void float_to_u8 (const float *in, unsigned char *out,
 		const size_t samples)
@@ -52,21 +182,8 @@ static void float_to_u8 (const float *in, unsigned char *out,
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++) {
-		float f = in[i] * INT32_MAX;
-
-		if (f >= INT32_MAX)
-			out[i] = UINT8_MAX;
-		else if (f <= INT32_MIN)
-			out[i] = 0;
-		else {
-#ifdef HAVE_LRINTF
-			out[i] = (unsigned int)((lrintf(f) >> 24) - INT8_MIN);
-#else
-			out[i] = (unsigned int)(((int)f >> 24) - INT8_MIN);
-#endif
-		}
-	}
+	for (i = 0; i < samples; i++)
+		out[i] = float_to_u8_sample (in[i]);
 }
 
 static void float_to_s8 (const float *in, char *out, const size_t samples)
@@ -76,132 +193,58 @@ static void float_to_s8 (const float *in, char *out, const size_t samples)
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++) {
-		float f = in[i] * INT32_MAX;
-
-		if (f >= INT32_MAX)
-			out[i] = INT8_MAX;
-		else if (f <= INT32_MIN)
-			out[i] = INT8_MIN;
-		else {
-#ifdef HAVE_LRINTF
-			out[i] = lrintf(f) >> 24;
-#else
-			out[i] = (int)f >> 24;
-#endif
-		}
-	}
+	for (i = 0; i < samples; i++)
+		out[i] = float_to_s8_sample (in[i]);
 }
 
 static void float_to_u16 (const float *in, unsigned char *out,
 		const size_t samples)
 {
 	size_t i;
+	uint16_t *out_16 = (uint16_t *)out;
 
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++) {
-		uint16_t *out_val = (uint16_t *)(out + i * sizeof (uint16_t));
-		float f = in[i] * INT32_MAX;
-
-		if (f >= INT32_MAX)
-			*out_val = UINT16_MAX;
-		else if (f <= INT32_MIN)
-			*out_val = 0;
-		else {
-#ifdef HAVE_LRINTF
-			*out_val = (unsigned int)((lrintf(f) >> 16) - INT16_MIN);
-#else
-			*out_val = (unsigned int)(((int)f >> 16) - INT16_MIN);
-#endif
-		}
-	}
+	for (i = 0; i < samples; i++)
+		out_16[i] = float_to_u16_sample (in[i]);
 }
 
 static void float_to_s16 (const float *in, char *out, const size_t samples)
 {
 	size_t i;
+	int16_t *out_16 = (int16_t *)out;
 
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++) {
-		int16_t *out_val = (int16_t *)(out + i * sizeof (int16_t));
-		float f = in[i] * INT32_MAX;
-
-		if (f >= INT32_MAX)
-			*out_val = INT16_MAX;
-		else if (f <= INT32_MIN)
-			*out_val = INT16_MIN;
-		else {
-#ifdef HAVE_LRINTF
-			*out_val = lrintf(f) >> 16;
-#else
-			*out_val = ((int)f >> 16);
-#endif
-		}
-	}
+	for (i = simd->float_to_s16 (in, out_16, samples); i < samples; i++)
+		out_16[i] = float_to_s16_sample (in[i]);
 }
 
 static void float_to_u32 (const float *in, unsigned char *out,
 		const size_t samples)
 {
 	size_t i;
-
-	/* maximum and minimum values of 32-bit samples */
-	const unsigned int U32_MAX = (1 << 24) - 1;
-	const int S32_MAX = (1 << 23) - 1;
-	const int S32_MIN = -(1 << 23);
+	uint32_t *out_32 = (uint32_t *)out;
 
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++) {
-		uint32_t *out_val = (uint32_t *)(out + i * sizeof (uint32_t));
-		float f = in[i] * S32_MAX;
-
-		if (f >= S32_MAX)
-			*out_val = U32_MAX << 8;
-		else if (f <= S32_MIN)
-			*out_val = 0;
-		else {
-#ifdef HAVE_LRINTF
-			*out_val = (uint32_t)(lrintf(f) - S32_MIN) << 8;
-#else
-			*out_val = (uint32_t)((int32_t)f - S32_MIN) << 8;
-#endif
-		}
-	}
+	for (i = 0; i < samples; i++)
+		out_32[i] = float_to_u32_sample (in[i]);
 }
 
 static void float_to_s32 (const float *in, char *out, const size_t samples)
 {
 	size_t i;
-
-	/* maximum and minimum values of 32-bit samples */
-	const int S32_MAX = (1 << 23) - 1;
-	const int S32_MIN = -(1 << 23);
+	int32_t *out_32 = (int32_t *)out;
 
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++) {
-		int32_t *out_val = (int32_t *)(out + i * sizeof (int32_t));
-		float f = in[i] * S32_MAX;
-
-		if (f >= S32_MAX)
-			*out_val = S32_MAX << 8;
-		else if (f <= S32_MIN)
-			*out_val = S32_MIN << 8;
-		else {
-#ifdef HAVE_LRINTF
-			*out_val = lrintf(f) << 8;
-#else
-			*out_val = (int32_t)f << 8;
-#endif
-		}
-	}
+	for (i = 0; i < samples; i++)
+		out_32[i] = float_to_s32_sample (in[i]);
 }
 
 static void u8_to_float (const unsigned char *in, float *out,
@@ -213,7 +256,7 @@ static void u8_to_float (const unsigned char *in, float *out,
 	assert (out != NULL);
 
 	for (i = 0; i < samples; i++)
-		out[i] = (((int)*in++) + INT8_MIN) / (float)(INT8_MAX + 1);
+		out[i] = u8_sample_to_float (in[i]);
 }
 
 static void s8_to_float (const char *in, float *out, const size_t samples)
@@ -224,7 +267,7 @@ static void s8_to_float (const char *in, float *out, const size_t samples)
 	assert (out != NULL);
 
 	for (i = 0; i < samples; i++)
-		out[i] = *in++ / (float)(INT8_MAX + 1);
+		out[i] = s8_sample_to_float (in[i]);
 }
 
 static void u16_to_float (const unsigned char *in, float *out,
@@ -237,7 +280,7 @@ static void u16_to_float (const unsigned char *in, float *out,
 	assert (out != NULL);
 
 	for (i = 0; i < samples; i++)
-		out[i] = ((int)*in_16++ + INT16_MIN) / (float)(INT16_MAX + 1);
+		out[i] = u16_sample_to_float (in_16[i]);
 }
 
 static void s16_to_float (const char *in, float *out, const size_t samples)
@@ -248,8 +291,8 @@ static void s16_to_float (const char *in, float *out, const size_t samples)
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++)
-		out[i] = *in_16++ / (float)(INT16_MAX + 1);
+	for (i = simd->s16_to_float (in_16, out, samples); i < samples; i++)
+		out[i] = s16_sample_to_float (in_16[i]);
 }
 
 static void u32_to_float (const unsigned char *in, float *out,
@@ -262,7 +305,7 @@ static void u32_to_float (const unsigned char *in, float *out,
 	assert (out != NULL);
 
 	for (i = 0; i < samples; i++)
-		out[i] = ((float)*in_32++ + (float)INT32_MIN) / ((float)INT32_MAX + 1.0);
+		out[i] = u32_sample_to_float (in_32[i]);
 }
 
 static void s32_to_float (const char *in, float *out, const size_t samples)
@@ -274,48 +317,35 @@ static void s32_to_float (const char *in, float *out, const size_t samples)
 	assert (out != NULL);
 
 	for (i = 0; i < samples; i++)
-		out[i] = *in_32++ / ((float)INT32_MAX + 1.0);
+		out[i] = s32_sample_to_float (in_32[i]);
 }
 
 /* Convert fixed point samples in format fmt (size in bytes) to float.
- * Size of converted sound is put in new_size. Returned memory is malloc()ed. */
-static float *fixed_to_float (const char *buf, const size_t size,
-		const long fmt, size_t *new_size)
+ * The output buffer must be large enough for the converted samples. */
+static void fixed_to_float (const char *buf, const size_t size,
+		const long fmt, float *out)
 {
-	float *out = NULL;
 	char fmt_name[SFMT_STR_MAX];
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
-			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			u8_to_float ((unsigned char *)buf, out, size);
 			break;
 		case SFMT_S8:
-			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			s8_to_float (buf, out, size);
 			break;
 		case SFMT_U16:
-			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			u16_to_float ((unsigned char *)buf, out, size / 2);
 			break;
 		case SFMT_S16:
-			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			s16_to_float (buf, out, size / 2);
 			break;
 		case SFMT_U32:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			u32_to_float ((unsigned char *)buf, out, size / 4);
 			break;
 		case SFMT_S32:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			s32_to_float (buf, out, size / 4);
 			break;
 		default:
@@ -323,49 +353,34 @@ static float *fixed_to_float (const char *buf, const size_t size,
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return out;
 }
 
-/* Convert float samples to fixed point format fmt. Returned samples of size
- * new_size bytes is malloc()ed. */
-static char *float_to_fixed (const float *buf, const size_t samples,
-		const long fmt, size_t *new_size)
+/* Convert float samples to fixed point format fmt.  The output buffer must
+ * be large enough for the converted samples. */
+static void float_to_fixed (const float *buf, const size_t samples,
+		const long fmt, char *new_snd)
 {
 	char fmt_name[SFMT_STR_MAX];
-	char *new_snd = NULL;
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
-			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
 			float_to_u8 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S8:
-			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
 			float_to_s8 (buf, new_snd, samples);
 			break;
 		case SFMT_U16:
-			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_u16 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S16:
-			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_s16 (buf, new_snd, samples);
 			break;
 		case SFMT_U32:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_u32 (buf, (unsigned char *)new_snd, samples);
 			break;
 		case SFMT_S32:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
 			float_to_s32 (buf, new_snd, samples);
 			break;
 		default:
@@ -373,8 +388,6 @@ static char *float_to_fixed (const float *buf, const size_t samples,
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return new_snd;
 }
 
 static void change_sign_8 (uint8_t *buf, const size_t samples)
@@ -476,6 +489,149 @@ static void swap_endian (char *buf, const size_t size, const long fmt)
 	}
 }
 
+/* Single pass conversion kernels for the common cases where the sample
+ * rate doesn't change.  Each kernel reads a sample, byte swaps it if the
+ * input isn't in native endianness, converts it and stores it once (or
+ * twice for mono to stereo) in native endianness, so the buffer is walked
+ * only once instead of once per conversion stage. */
+
+#define NO_SWAP(x)		(x)
+#define NO_VECTOR(in, out, samples)	0
+#define VECTOR_S16_FLOAT(in, out, samples) \
+	simd->s16_to_float ((const int16_t *)(in), (float *)(out), (samples))
+#define VECTOR_S32_S16(in, out, samples) \
+	simd->s32_to_s16 ((const int32_t *)(in), (int16_t *)(out), (samples))
+#define VECTOR_FLOAT_S16(in, out, samples) \
+	simd->float_to_s16 ((const float *)(in), (int16_t *)(out), (samples))
+#define RAW_COPY(x)		(x)
+#define RAW_32_TO_16(x)		((x) >> 16)
+#define S16_TO_S32(x)		float_to_s32_sample (s16_sample_to_float (x))
+#define S32_TO_FLOAT(x)		s32_sample_to_float (x)
+#define S16_TO_FLOAT(x)		s16_sample_to_float (x)
+#define FLOAT_TO_S16(x)		float_to_s16_sample (x)
+#define FLOAT_TO_S32(x)		float_to_s32_sample (x)
+#define U8_TO_S16(x)		float_to_s16_sample (u8_sample_to_float (x))
+#define S8_TO_S16(x)		float_to_s16_sample (s8_sample_to_float (x))
+
+/* Define the kernel name and its variants for byte swapped input (_sw)
+ * and mono to stereo (_dup).  The variants pass constant flags to the
+ * common inline body so each gets its own branch-free loop.  The plain
+ * variant first lets the vector kernel do what it can. */
+#define FUSED_KERNEL(name, in_type, out_type, swap, convert, vector) \
+static inline void name##_body (const char *in_buf, char *out_buf, \
+		const size_t samples, const int swap_in, const int dup) \
+{ \
+	const in_type *in = (const in_type *)in_buf; \
+	out_type *out = (out_type *)out_buf; \
+	size_t i; \
+ \
+	for (i = 0; i < samples; i++) { \
+		out_type val = convert (swap_in ? swap (in[i]) : in[i]); \
+ \
+		if (dup) { \
+			out[2 * i] = val; \
+			out[2 * i + 1] = val; \
+		} \
+		else \
+			out[i] = val; \
+	} \
+} \
+ \
+static void name (const char *in, char *out, const size_t samples) \
+{ \
+	size_t done = vector (in, out, samples); \
+ \
+	name##_body (in + done * sizeof(in_type), \
+			out + done * sizeof(out_type), samples - done, 0, 0); \
+} \
+ \
+static void name##_dup (const char *in, char *out, const size_t samples) \
+{ \
+	name##_body (in, out, samples, 0, 1); \
+} \
+ \
+static void name##_sw (const char *in, char *out, const size_t samples) \
+{ \
+	name##_body (in, out, samples, 1, 0); \
+} \
+ \
+static void name##_sw_dup (const char *in, char *out, const size_t samples) \
+{ \
+	name##_body (in, out, samples, 1, 1); \
+}
+
+FUSED_KERNEL(fused_s16_s16, uint16_t, uint16_t, bswap_16, RAW_COPY,
+		NO_VECTOR)
+FUSED_KERNEL(fused_s16_s32, uint16_t, int32_t, bswap_16, S16_TO_S32,
+		NO_VECTOR)
+FUSED_KERNEL(fused_s16_float, uint16_t, float, bswap_16, S16_TO_FLOAT,
+		VECTOR_S16_FLOAT)
+FUSED_KERNEL(fused_s32_s16, uint32_t, uint16_t, bswap_32, RAW_32_TO_16,
+		VECTOR_S32_S16)
+FUSED_KERNEL(fused_s32_s32, uint32_t, uint32_t, bswap_32, RAW_COPY,
+		NO_VECTOR)
+FUSED_KERNEL(fused_s32_float, uint32_t, float, bswap_32, S32_TO_FLOAT,
+		NO_VECTOR)
+FUSED_KERNEL(fused_float_s16, float, int16_t, NO_SWAP, FLOAT_TO_S16,
+		VECTOR_FLOAT_S16)
+FUSED_KERNEL(fused_float_s32, float, int32_t, NO_SWAP, FLOAT_TO_S32,
+		NO_VECTOR)
+FUSED_KERNEL(fused_float_float, float, float, NO_SWAP, RAW_COPY,
+		NO_VECTOR)
+FUSED_KERNEL(fused_u8_s16, uint8_t, int16_t, NO_SWAP, U8_TO_S16,
+		NO_VECTOR)
+FUSED_KERNEL(fused_s8_s16, uint8_t, int16_t, NO_SWAP, S8_TO_S16,
+		NO_VECTOR)
+
+#define FUSED_FUNCS(name) \
+	{ { name, name##_dup }, { name##_sw, name##_sw_dup } }
+
+static const struct fused_conv
+{
+	long from;	/* sample format without endianness */
+	long to;
+	audio_conv_func func[2][2];	/* [swap input][mono to stereo] */
+} fused_convs[] = {
+	{ SFMT_S16, SFMT_S16, FUSED_FUNCS(fused_s16_s16) },
+	{ SFMT_S16, SFMT_S32, FUSED_FUNCS(fused_s16_s32) },
+	{ SFMT_S16, SFMT_FLOAT, FUSED_FUNCS(fused_s16_float) },
+	{ SFMT_S32, SFMT_S16, FUSED_FUNCS(fused_s32_s16) },
+	{ SFMT_S32, SFMT_S32, FUSED_FUNCS(fused_s32_s32) },
+	{ SFMT_S32, SFMT_FLOAT, FUSED_FUNCS(fused_s32_float) },
+	{ SFMT_FLOAT, SFMT_S16, FUSED_FUNCS(fused_float_s16) },
+	{ SFMT_FLOAT, SFMT_S32, FUSED_FUNCS(fused_float_s32) },
+	{ SFMT_FLOAT, SFMT_FLOAT, FUSED_FUNCS(fused_float_float) },
+	{ SFMT_U8, SFMT_S16, FUSED_FUNCS(fused_u8_s16) },
+	{ SFMT_S8, SFMT_S16, FUSED_FUNCS(fused_s8_s16) }
+};
+
+/* Return the single pass conversion function for the conversion, or NULL
+ * if it must be done in stages. */
+static audio_conv_func find_fused_conv (const struct sound_params *from,
+		const struct sound_params *to)
+{
+	size_t i;
+	int swap_in, dup;
+
+	if (from->rate != to->rate)
+		return NULL;
+
+	/* The kernels only produce native endian output. */
+	if (!(to->fmt & (SFMT_S8 | SFMT_U8 | SFMT_FLOAT | SFMT_NE)))
+		return NULL;
+
+	swap_in = !(from->fmt & (SFMT_S8 | SFMT_U8 | SFMT_FLOAT | SFMT_NE));
+	dup = (from->channels == 1 && to->channels == 2);
+
+	for (i = 0; i < ARRAY_SIZE(fused_convs); i++) {
+		if ((from->fmt & SFMT_MASK_FORMAT) == fused_convs[i].from
+				&& (to->fmt & SFMT_MASK_FORMAT) == fused_convs[i].to)
+			return fused_convs[i].func[swap_in][dup];
+	}
+
+	return NULL;
+}
+
 /* Initialize the audio_conversion structure for conversion between parameters
  * from and to. Return 0 on error. */
 int audio_conv_new (struct audio_conversion *conv,
@@ -533,21 +689,62 @@ int audio_conv_new (struct audio_conversion *conv,
 	conv->from = *from;
 	conv->to = *to;
 
+	conv->fused = find_fused_conv (from, to);
+	if (conv->fused)
+		logit ("Using single pass conversion.");
+
+	conv->scratch[0] = NULL;
+	conv->scratch[1] = NULL;
+	conv->scratch_size[0] = 0;
+	conv->scratch_size[1] = 0;
+
 #ifdef HAVE_SAMPLERATE
 	conv->resample_buf = NULL;
 	conv->resample_buf_nsamples = 0;
+	conv->resample_buf_size = 0;
 #endif
 
 	return 1;
 }
 
+/* Return the scratch buffer which is not curr, making sure it can hold
+ * size bytes.  The buffers only ever grow, so once they have reached the
+ * size needed by the stream no more allocation is done. */
+static char *scratch_buf (struct audio_conversion *conv, const char *curr,
+		const size_t size)
+{
+	int i = (curr == conv->scratch[0]) ? 1 : 0;
+
+	if (conv->scratch_size[i] < size) {
+		conv->scratch[i] = (char *)xrealloc (conv->scratch[i], size);
+		conv->scratch_size[i] = size;
+	}
+
+	return conv->scratch[i];
+}
+
+/* Return curr if it is one of the scratch buffers (so it can be modified
+ * in place), otherwise copy it into a scratch buffer and return that. */
+static char *writable_buf (struct audio_conversion *conv, const char *curr,
+		const size_t size)
+{
+	char *out;
+
+	if (curr == conv->scratch[0] || curr == conv->scratch[1])
+		return (char *)curr;
+
+	out = scratch_buf (conv, curr, size);
+	memcpy (out, curr, size);
+
+	return out;
+}
+
 #ifdef HAVE_SAMPLERATE
 static float *resample_sound (struct audio_conversion *conv, const float *buf,
 		const size_t samples, const int nchannels, size_t *resampled_samples)
 {
 	SRC_DATA resample_data;
 	float *output;
-	float *new_input_start;
 	int output_samples = 0;
 
 	resample_data.end_of_input = 0;
@@ -558,27 +755,20 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 	resample_data.output_frames = resample_data.input_frames
 		* resample_data.src_ratio;
 
-	if (conv->resample_buf) {
+	if (conv->resample_buf_size < conv->resample_buf_nsamples + samples) {
+		conv->resample_buf_size = conv->resample_buf_nsamples + samples;
 		conv->resample_buf = (float *)xrealloc (conv->resample_buf,
-				sizeof(float) * resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf
-			+ conv->resample_buf_nsamples;
-	}
-	else {
-		conv->resample_buf = (float *)xmalloc (sizeof(float)
-				* resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf;
+				sizeof(float) * conv->resample_buf_size);
 	}
 
-	output = (float *)xmalloc (sizeof(float) * resample_data.output_frames
-				* nchannels);
+	output = (float *)scratch_buf (conv, (const char *)buf, sizeof(float)
+			* resample_data.output_frames * nchannels);
 
 	/*debug ("Resampling %lu bytes of data by ratio %f", (unsigned long)size,
 			resample_data.src_ratio);*/
 
-	memcpy (new_input_start, buf, samples * sizeof(float));
+	memcpy (conv->resample_buf + conv->resample_buf_nsamples, buf,
+			samples * sizeof(float));
 	resample_data.data_in = conv->resample_buf;
 	resample_data.data_out = output;
 
@@ -587,7 +777,7 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 		if ((err = src_process(conv->src_state, &resample_data))) {
 			error ("Can't resample: %s", src_strerror (err));
-			free (output);
+			conv->resample_buf_nsamples = 0;
 			return NULL;
 		}
 
@@ -603,91 +793,78 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 	*resampled_samples = output_samples;
 
-	if (resample_data.input_frames) {
-		conv->resample_buf_nsamples = resample_data.input_frames
-			* nchannels;
-		if (conv->resample_buf != resample_data.data_in) {
-			float *new;
-
-			new = (float *)xmalloc (sizeof(float) *
-					conv->resample_buf_nsamples);
-			memcpy (new, resample_data.data_in, sizeof(float) *
-					conv->resample_buf_nsamples);
-			free (conv->resample_buf);
-			conv->resample_buf = new;
-		}
-	}
-	else {
-		free (conv->resample_buf);
-		conv->resample_buf = NULL;
-		conv->resample_buf_nsamples = 0;
-	}
+	/* Keep the unused input for the next call. */
+	conv->resample_buf_nsamples = resample_data.input_frames * nchannels;
+	if (conv->resample_buf_nsamples
+			&& conv->resample_buf != resample_data.data_in)
+		memmove (conv->resample_buf, resample_data.data_in,
+				sizeof(float) * conv->resample_buf_nsamples);
 
 	return output;
 }
 #endif
 
-/* Double the channels from */
-static char *mono_to_stereo (const char *mono, const size_t size,
-		const long format)
+/* Double the channels from mono to stereo. */
+static void mono_to_stereo (const char *mono, char *stereo,
+		const size_t size, const long format)
 {
 	int Bps = sfmt_Bps (format);
 	size_t i;
-	char *stereo;
-
-	stereo = (char *)xmalloc (size * 2);
 
 	for (i = 0; i < size; i += Bps) {
 		memcpy (stereo + (i * 2), mono + i, Bps);
 		memcpy (stereo + (i * 2 + Bps), mono + i, Bps);
 	}
-
-	return stereo;
 }
 
-static int16_t *s32_to_s16 (int32_t *in, const size_t samples)
+static void s32_to_s16 (const int32_t *in, int16_t *out, const size_t samples)
 {
 	size_t i;
-	int16_t *new;
-
-	new = (int16_t *)xmalloc (samples * 2);
 
-	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 16;
-
-	return new;
+	for (i = simd->s32_to_s16 (in, out, samples); i < samples; i++)
+		out[i] = in[i] >> 16;
 }
 
-static uint16_t *u32_to_u16 (uint32_t *in, const size_t samples)
+static void u32_to_u16 (const uint32_t *in, uint16_t *out,
+		const size_t samples)
 {
 	size_t i;
-	uint16_t *new;
-
-	new = (uint16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 16;
-
-	return new;
+		out[i] = in[i] >> 16;
 }
 
 /* Do the sound conversion.  buf of length size is the sample buffer to
  * convert and the size of the converted sound is put into *conv_len.
- * Return the converted sound in malloc()ed memory. */
-char *audio_conv (struct audio_conversion *conv, const char *buf,
+ * Return the converted sound, which is held in a buffer owned by conv
+ * and is valid until the next call to audio_conv() or
+ * audio_conv_destroy().  Return NULL on error. */
+const char *audio_conv (struct audio_conversion *conv, const char *buf,
 		const size_t size, size_t *conv_len)
 {
-	char *curr_sound;
+	const char *curr_sound = buf;
 	long curr_sfmt = conv->from.fmt;
 
-	*conv_len = size;
+	if (conv->fused) {
+		size_t samples = size / sfmt_Bps (conv->from.fmt);
+		char *new_sound;
+
+		*conv_len = samples * sfmt_Bps (conv->to.fmt)
+			* (conv->to.channels / conv->from.channels);
+		new_sound = scratch_buf (conv, buf, *conv_len);
+		conv->fused (buf, new_sound, samples);
+
+		return new_sound;
+	}
 
-	curr_sound = (char *)xmalloc (size);
-	memcpy (curr_sound, buf, size);
+	*conv_len = size;
 
 	if (!(curr_sfmt & SFMT_NE)) {
-		swap_endian (curr_sound, *conv_len, curr_sfmt);
+		char *new_sound = writable_buf (conv, curr_sound, *conv_len);
+
+		swap_endian (new_sound, *conv_len, curr_sfmt);
 		curr_sfmt = sfmt_set_endian (curr_sfmt, SFMT_NE);
+		curr_sound = new_sound;
 	}
 
 	/* Special case (optimization): if we only need to convert 32bit samples
@@ -695,21 +872,19 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
 	    (conv->to.fmt & (SFMT_S16 | SFMT_U16)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		char *new_sound = scratch_buf (conv, curr_sound, *conv_len / 2);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s16 ((int32_t *)curr_sound,
-					*conv_len / 4);
+			s32_to_s16 ((const int32_t *)curr_sound,
+					(int16_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S16);
 		}
 		else {
-			new_sound = (char *)u32_to_u16 ((uint32_t *)curr_sound,
-					*conv_len / 4);
+			u32_to_u16 ((const uint32_t *)curr_sound,
+					(uint16_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U16);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		*conv_len /= 2;
 
@@ -721,76 +896,83 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 				|| (conv->to.fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT
 				|| !sfmt_same_bps(conv->to.fmt, curr_sfmt))
 			&& (curr_sfmt & SFMT_MASK_FORMAT) != SFMT_FLOAT) {
-		char *new_sound;
+		size_t new_len = *conv_len / sfmt_Bps (curr_sfmt) * sizeof(float);
+		char *new_sound = scratch_buf (conv, curr_sound, new_len);
 
-		new_sound = (char *)fixed_to_float (curr_sound, *conv_len,
-				curr_sfmt, conv_len);
+		fixed_to_float (curr_sound, *conv_len, curr_sfmt,
+				(float *)new_sound);
 		curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_FLOAT);
-
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
+		*conv_len = new_len;
 	}
 
 #ifdef HAVE_SAMPLERATE
 	if (conv->from.rate != conv->to.rate) {
-		char *new_sound = (char *)resample_sound (conv,
-				(float *)curr_sound,
+		curr_sound = (const char *)resample_sound (conv,
+				(const float *)curr_sound,
 				*conv_len / sizeof(float), conv->to.channels,
 				conv_len);
+		if (!curr_sound)
+			return NULL;
 		*conv_len *= sizeof(float);
-		if (curr_sound != buf)
-			free (curr_sound);
-		curr_sound = new_sound;
 	}
 #endif
 
 	if ((curr_sfmt & SFMT_MASK_FORMAT)
 			!= (conv->to.fmt & SFMT_MASK_FORMAT)) {
 
-		if (sfmt_same_bps(curr_sfmt, conv->to.fmt))
-			change_sign (curr_sound, size, &curr_sfmt);
+		if (sfmt_same_bps(curr_sfmt, conv->to.fmt)) {
+			char *new_sound = writable_buf (conv, curr_sound,
+					*conv_len);
+
+			change_sign (new_sound, *conv_len, &curr_sfmt);
+			curr_sound = new_sound;
+		}
 		else {
-			char *new_sound;
+			size_t samples = *conv_len / sizeof(float);
+			size_t new_len = samples * sfmt_Bps (conv->to.fmt);
+			char *new_sound = scratch_buf (conv, curr_sound, new_len);
 
 			assert (curr_sfmt & SFMT_FLOAT);
 
-			new_sound = float_to_fixed ((float *)curr_sound,
-					*conv_len / sizeof(float),
-					conv->to.fmt, conv_len);
+			float_to_fixed ((const float *)curr_sound, samples,
+					conv->to.fmt, new_sound);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, conv->to.fmt);
-
-			if (curr_sound != buf)
-				free (curr_sound);
 			curr_sound = new_sound;
+			*conv_len = new_len;
 		}
 	}
 
 	if ((curr_sfmt & SFMT_MASK_ENDIANNESS)
 			!= (conv->to.fmt & SFMT_MASK_ENDIANNESS)) {
-		swap_endian (curr_sound, *conv_len, curr_sfmt);
+		char *new_sound = writable_buf (conv, curr_sound, *conv_len);
+
+		swap_endian (new_sound, *conv_len, curr_sfmt);
 		curr_sfmt = sfmt_set_endian (curr_sfmt,
 				conv->to.fmt & SFMT_MASK_ENDIANNESS);
+		curr_sound = new_sound;
 	}
 
 	if (conv->from.channels == 1 && conv->to.channels == 2) {
-		char *new_sound;
-
-		new_sound = mono_to_stereo (curr_sound, *conv_len, curr_sfmt);
-		*conv_len *= 2;
+		char *new_sound = scratch_buf (conv, curr_sound, *conv_len * 2);
 
-		if (curr_sound != buf)
-			free (curr_sound);
+		mono_to_stereo (curr_sound, new_sound, *conv_len, curr_sfmt);
 		curr_sound = new_sound;
+		*conv_len *= 2;
 	}
 
 	return curr_sound;
 }
 
-void audio_conv_destroy (struct audio_conversion *conv ASSERT_ONLY)
+void audio_conv_destroy (struct audio_conversion *conv)
 {
 	assert (conv != NULL);
 
+	if (conv->scratch[0])
+		free (conv->scratch[0]);
+	if (conv->scratch[1])
+		free (conv->scratch[1]);
+
 #ifdef HAVE_SAMPLERATE
 	if (conv->resample_buf)
 		free (conv->resample_buf);
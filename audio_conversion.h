@@ -17,15 +17,29 @@
 extern "C" {
 #endif
 
+/* Converts samples of the input buffer into the output buffer in a single
+ * pass. */
+typedef void (*audio_conv_func) (const char *in, char *out,
+		const size_t samples);
+
 struct audio_conversion
 {
 	struct sound_params from;
 	struct sound_params to;
 
+	audio_conv_func fused;	/* single pass conversion, or NULL if the
+				   conversion is done in stages */
+
+	/* Buffers the conversion stages alternate between, reused across
+	 * calls to audio_conv(). */
+	char *scratch[2];
+	size_t scratch_size[2];	/* allocated size in bytes */
+
 #ifdef HAVE_SAMPLERATE
 	SRC_STATE *src_state;
 	float *resample_buf;
 	size_t resample_buf_nsamples; /* in samples ( sizeof(float) ) */
+	size_t resample_buf_size; /* allocated, in samples */
 #endif
 
 };
@@ -33,7 +47,7 @@ struct audio_conversion
 int audio_conv_new (struct audio_conversion *conv,
 		const struct sound_params *from,
 		const struct sound_params *to);
-char *audio_conv (struct audio_conversion *conv,
+const char *audio_conv (struct audio_conversion *conv,
 		const char *buf, const size_t size, size_t *conv_len);
 void audio_conv_destroy (struct audio_conversion *conv);
 
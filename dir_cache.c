@@ -0,0 +1,308 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Cache of directory listings for the interface.
+ *
+ * A listing is kept already sorted, together with the tags the interface
+ * received for its files, so going back to a directory doesn't need to
+ * read and sort it again.  A listing is valid as long as the modification
+ * time of the directory is the one it had when the listing was read.  As
+ * the time has a resolution of one second, listings of directories
+ * modified in the second they were read are not kept.
+ *
+ * Editing a file doesn't change the modification time of its directory,
+ * so using a listing also takes a stat() of each file that has tags, and
+ * the tags of files modified since they were cached are dropped.  That is
+ * one stat() per entry, but no readdir(), sorting or tags requests for
+ * the files which didn't change.
+ *
+ * The least recently used listings are dropped when there are more than
+ * max_dirs of them. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "playlist.h"
+#include "rbtree.h"
+#include "lists.h"
+#include "files.h"
+#include "dir_cache.h"
+
+struct dir_listing
+{
+	char *dir;
+	time_t mtime;		/* modification time of the directory */
+	lists_t_strs *dirs;
+	lists_t_strs *playlists;
+	struct plist plist;
+	struct dir_listing *older;
+	struct dir_listing *newer;
+};
+
+struct dir_cache
+{
+	struct rb_tree *tree;
+	struct dir_listing *oldest;
+	struct dir_listing *newest;
+	int nitems;
+	int max_dirs;
+};
+
+static int listing_compare (const void *a, const void *b,
+                            const void *unused ATTR_UNUSED)
+{
+	const struct dir_listing *la = (const struct dir_listing *)a;
+	const struct dir_listing *lb = (const struct dir_listing *)b;
+
+	return strcmp (la->dir, lb->dir);
+}
+
+static int listing_compare_key (const void *key, const void *data,
+                                const void *unused ATTR_UNUSED)
+{
+	const char *dir = (const char *)key;
+	const struct dir_listing *l = (const struct dir_listing *)data;
+
+	return strcmp (dir, l->dir);
+}
+
+static void strs_copy (lists_t_strs *dst, const lists_t_strs *src)
+{
+	int i;
+
+	for (i = 0; i < lists_strs_size (src); i++)
+		lists_strs_append (dst, lists_strs_at (src, i));
+}
+
+static void listing_unlink (struct dir_cache *c, struct dir_listing *l)
+{
+	if (l->older)
+		l->older->newer = l->newer;
+	else
+		c->oldest = l->newer;
+	if (l->newer)
+		l->newer->older = l->older;
+	else
+		c->newest = l->older;
+	l->older = l->newer = NULL;
+}
+
+static void listing_append (struct dir_cache *c, struct dir_listing *l)
+{
+	l->older = c->newest;
+	l->newer = NULL;
+	if (c->newest)
+		c->newest->newer = l;
+	else
+		c->oldest = l;
+	c->newest = l;
+}
+
+static void listing_free (struct dir_listing *l)
+{
+	free (l->dir);
+	lists_strs_free (l->dirs);
+	lists_strs_free (l->playlists);
+	plist_free (&l->plist);
+	free (l);
+}
+
+static struct dir_listing *listing_find (struct dir_cache *c, const char *dir)
+{
+	struct rb_node *x;
+
+	x = rb_search (c->tree, dir);
+	if (rb_is_null (x))
+		return NULL;
+
+	return (struct dir_listing *)rb_get_data (x);
+}
+
+static void listing_remove (struct dir_cache *c, struct dir_listing *l)
+{
+	rb_delete (c->tree, l->dir);
+	listing_unlink (c, l);
+	c->nitems -= 1;
+	listing_free (l);
+}
+
+/* Drop the tags of the files modified since they were added to the
+ * listing, so the interface asks for them again. */
+static void listing_drop_stale_tags (struct dir_listing *l)
+{
+	int i;
+
+	for (i = 0; i < l->plist.num; i++) {
+		struct plist_item *item = &l->plist.items[i];
+		time_t mtime;
+
+		if (plist_deleted (&l->plist, i) || !item->tags)
+			continue;
+
+		mtime = get_mtime (item->file);
+		if (mtime != item->mtime) {
+			debug ("Tags of %s are out of date", item->file);
+			plist_discard_item_tags (&l->plist, i);
+			item->mtime = mtime;
+		}
+	}
+}
+
+struct dir_cache *dir_cache_new (const int max_dirs)
+{
+	struct dir_cache *c;
+
+	assert (max_dirs > 0);
+
+	c = (struct dir_cache *)xmalloc (sizeof (struct dir_cache));
+	c->tree = rb_tree_new (listing_compare, listing_compare_key, NULL);
+	c->oldest = c->newest = NULL;
+	c->nitems = 0;
+	c->max_dirs = max_dirs;
+
+	return c;
+}
+
+void dir_cache_clear (struct dir_cache *c)
+{
+	assert (c != NULL);
+
+	while (c->oldest)
+		listing_remove (c, c->oldest);
+}
+
+void dir_cache_free (struct dir_cache *c)
+{
+	assert (c != NULL);
+
+	dir_cache_clear (c);
+	rb_tree_free (c->tree);
+	free (c);
+}
+
+/* Fill the lists and the playlist with the cached listing of the directory
+ * if there is one and the directory wasn't modified since it was read.
+ * Return 0 if there is no valid listing. */
+int dir_cache_get (struct dir_cache *c, const char *dir, lists_t_strs *dirs,
+                   lists_t_strs *playlists, struct plist *plist)
+{
+	struct dir_listing *l;
+	struct stat st;
+
+	assert (c != NULL);
+	assert (dir != NULL);
+	assert (dirs != NULL);
+	assert (playlists != NULL);
+	assert (plist != NULL);
+
+	l = listing_find (c, dir);
+	if (!l)
+		return 0;
+
+	if (stat (dir, &st) == -1 || st.st_mtime != l->mtime) {
+		debug ("Cached listing of %s is out of date", dir);
+		listing_remove (c, l);
+		return 0;
+	}
+
+	listing_drop_stale_tags (l);
+
+	strs_copy (dirs, l->dirs);
+	strs_copy (playlists, l->playlists);
+	plist_cat (plist, &l->plist);
+
+	listing_unlink (c, l);
+	listing_append (c, l);
+
+	debug ("Using cached listing of %s", dir);
+
+	return 1;
+}
+
+/* Store the listing of the directory.  The read_time is the time just
+ * before the directory was read. */
+void dir_cache_put (struct dir_cache *c, const char *dir,
+                    const time_t read_time, const lists_t_strs *dirs,
+                    const lists_t_strs *playlists, const struct plist *plist)
+{
+	struct dir_listing *l;
+	struct stat st;
+
+	assert (c != NULL);
+	assert (dir != NULL);
+	assert (dirs != NULL);
+	assert (playlists != NULL);
+	assert (plist != NULL);
+
+	if ((l = listing_find (c, dir)))
+		listing_remove (c, l);
+
+	/* If the directory was modified in the same second as (or after) we
+	 * read it, a later change would not be noticed. */
+	if (stat (dir, &st) == -1 || st.st_mtime >= read_time)
+		return;
+
+	l = (struct dir_listing *)xmalloc (sizeof (struct dir_listing));
+	l->dir = xstrdup (dir);
+	l->mtime = st.st_mtime;
+	l->dirs = lists_strs_new (lists_strs_size (dirs));
+	strs_copy (l->dirs, dirs);
+	l->playlists = lists_strs_new (lists_strs_size (playlists));
+	strs_copy (l->playlists, playlists);
+	plist_init (&l->plist);
+	plist_cat (&l->plist, (struct plist *)plist);
+
+	rb_insert (c->tree, l);
+	listing_append (c, l);
+	c->nitems += 1;
+
+	while (c->nitems > c->max_dirs)
+		listing_remove (c, c->oldest);
+}
+
+/* Replace the files of the cached listing with these from the playlist,
+ * which carry the tags read since the listing was stored. */
+void dir_cache_update (struct dir_cache *c, const char *dir,
+                       const struct plist *plist)
+{
+	struct dir_listing *l;
+
+	assert (c != NULL);
+	assert (dir != NULL);
+	assert (plist != NULL);
+
+	if (!(l = listing_find (c, dir)))
+		return;
+
+	plist_clear (&l->plist);
+	plist_cat (&l->plist, (struct plist *)plist);
+}
+
+void dir_cache_remove (struct dir_cache *c, const char *dir)
+{
+	struct dir_listing *l;
+
+	assert (c != NULL);
+	assert (dir != NULL);
+
+	if ((l = listing_find (c, dir)))
+		listing_remove (c, l);
+}
@@ -0,0 +1,32 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <time.h>
+
+#include "lists.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct plist;
+struct dir_cache;
+
+struct dir_cache *dir_cache_new (const int max_dirs);
+void dir_cache_free (struct dir_cache *c);
+void dir_cache_clear (struct dir_cache *c);
+
+int dir_cache_get (struct dir_cache *c, const char *dir, lists_t_strs *dirs,
+                   lists_t_strs *playlists, struct plist *plist);
+void dir_cache_put (struct dir_cache *c, const char *dir,
+                    const time_t read_time, const lists_t_strs *dirs,
+                    const lists_t_strs *playlists, const struct plist *plist);
+void dir_cache_update (struct dir_cache *c, const char *dir,
+                       const struct plist *plist);
+void dir_cache_remove (struct dir_cache *c, const char *dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -47,6 +47,7 @@
 #include "log.h"
 #include "files.h"
 #include "equalizer.h"
+#include "simd.h"
 
 #define TWOPI (2.0 * M_PI)
 
@@ -63,12 +64,18 @@
 #define EQUALIZER_SAVE_FILE "equalizer"
 #define EQUALIZER_SAVE_OPTION "Equalizer_SaveState"
 
+/* Channels are filtered in groups of this many lanes. */
+#define EQ_LANES 4
+
+/* Number of coefficient and state planes of a filter cascade. */
+#define EQ_COEFS 5
+#define EQ_STATES 4
+
 typedef struct t_biquad t_biquad;
 
 struct t_biquad
 {
   float a0, a1, a2, a3, a4;
-  float x1, x2, y1, y2;
   float cf, bw, gain, srate;
   int israte;
 };
@@ -87,13 +94,20 @@ struct t_eq_setup
 
 typedef struct t_eq_set t_eq_set;
 
+/* The filter cascade is kept structure-of-arrays: coef holds the planes
+ * a0..a4 and state the planes x1, x2, y1, y2, each plane being
+ * [bcount][lanes] with every coefficient repeated across the lanes.  This
+ * lets all channels of a frame go through a band at once. */
 struct t_eq_set
 {
   char *name;
   int channels;
+  int lanes;
+  int israte;
   float preamp;
   int bcount;
-  t_biquad *b;
+  float *coef;
+  float *state;
 };
 
 typedef struct t_eq_set_list t_eq_set_list;
@@ -132,7 +146,8 @@ static void equalizer_read_config();
 static void equalizer_write_config();
 
 /* biquad application */
-static inline void apply_biquads(float *src, float *dst, int channels, int len, t_biquad *b, int blen);
+static void apply_biquads(float *buf, size_t frames, t_eq_set *set);
+static float *equ_lane_buffer(size_t frames, int lanes);
 
 /* biquad filter creation */
 static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biquad *b);
@@ -162,6 +177,11 @@ static char *eqsetdir;
 
 static char *config_preset_name;
 
+/* frames of samples spread over the filter lanes, reused between calls */
+static float *lane_buf;
+static size_t lane_buf_size;
+static int lane_buf_channels;
+
 /* public functions */
 int equalizer_is_active()
 {
@@ -256,11 +276,6 @@ static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biqu
   b->a3 = a1 / a0;
   b->a4 = a2 / a0;
 
-  b->x1 = 0.0f;
-  b->x2 = 0.0f;
-  b->y1 = 0.0f;
-  b->y2 = 0.0f;
-
   b->cf = cf;
   b->bw = bw;
   b->srate = srate;
@@ -287,44 +302,79 @@ static inline void biquad(float *src, float *dst, int len, t_biquad *b)
 }
 */
 
-/* Applies a set of biquadratic filters to a buffer of floating point
- * samples.
- * It is safe to have the same input and output buffer.
+/* Applies the filter cascade of an equalizer set to frames of floating
+ * point samples, in place.  Each frame of buf is set->lanes floats wide
+ * with the channels in the first lanes; the remaining lanes are zero and
+ * stay so.
  *
- * blen is the sample-count ignoring channels (samples per channel * channels)
+ * The vector kernel runs the lanes in parallel; this loop does whatever
+ * is left and computes exactly the same thing.
  */
-static inline void apply_biquads(float *src, float *dst, int channels, int len, t_biquad *b, int blen)
+static void apply_biquads(float *buf, size_t frames, t_eq_set *set)
 {
-  int bi, ci, boffs, idx;
-  while(len>0)
+  int bi, li;
+  int lanes = set->lanes;
+  size_t n = (size_t)set->bcount * lanes;
+  size_t fi, idx;
+
+  const float *a0 = set->coef;
+  const float *a1 = a0 + n;
+  const float *a2 = a1 + n;
+  const float *a3 = a2 + n;
+  const float *a4 = a3 + n;
+  float *x1 = set->state;
+  float *x2 = x1 + n;
+  float *y1 = x2 + n;
+  float *y2 = y1 + n;
+
+  fi = simd->biquad_cascade(buf, frames, lanes, set->bcount, set->coef, set->state);
+
+  for(buf += fi * lanes; fi < frames; fi++, buf += lanes)
   {
-    boffs = 0;
-    for(ci=0; ci<channels; ci++)
+    for(bi=0; bi<set->bcount; bi++)
     {
-      float s = *src++;
-      float f = s;
-      for(bi=0; bi<blen; bi++)
+      for(li=0; li<lanes; li++)
       {
-        idx = boffs + bi;
+        float s = buf[li];
+        float f;
+
+        idx = bi * lanes + li;
         f =
-          s * b[idx].a0 \
-          + b[idx].a1 * b[idx].x1 \
-          + b[idx].a2 * b[idx].x2 \
-          - b[idx].a3 * b[idx].y1 \
-          - b[idx].a4 * b[idx].y2;
-        b[idx].x2 = b[idx].x1;
-        b[idx].x1 = s;
-        b[idx].y2 = b[idx].y1;
-        b[idx].y1 = f;
-        s = f;
+          s * a0[idx] \
+          + a1[idx] * x1[idx] \
+          + a2[idx] * x2[idx] \
+          - a3[idx] * y1[idx] \
+          - a4[idx] * y2[idx];
+        x2[idx] = x1[idx];
+        x1[idx] = s;
+        y2[idx] = y1[idx];
+        y1[idx] = f;
+        buf[li] = f;
       }
-      *dst++=f;
-      boffs += blen;
-      len--;
     }
   }
 }
 
+/* Return the lane buffer, big enough for the given number of frames.
+ * Lanes not used by a channel are zero. */
+static float *equ_lane_buffer(size_t frames, int lanes)
+{
+  size_t size = frames * lanes;
+
+  if(size > lane_buf_size)
+  {
+    free(lane_buf);
+    lane_buf = (float *)xcalloc(size, sizeof(float));
+    lane_buf_size = size;
+  }
+  else if(lane_buf_channels != equ_channels)
+    memset(lane_buf, 0, lane_buf_size * sizeof(float));
+
+  lane_buf_channels = equ_channels;
+
+  return lane_buf;
+}
+
 /*
  preamping
  XMMS / Beep Media Player / Audacious use all the same code but
@@ -516,6 +566,10 @@ void equalizer_shutdown()
 
   clear_eq_set(&equ_list);
 
+  free(lane_buf);
+  lane_buf = NULL;
+  lane_buf_size = 0;
+
   logit ("Equalizer stopped");
 }
 
@@ -589,22 +643,35 @@ void equalizer_refresh()
 
         if(r==0)
         {
-          int i, channel;
+          int i, lane;
+          size_t n;
+          t_biquad b;
           t_eq_set *eqset = (t_eq_set *)xmalloc(sizeof(t_eq_set));
-          eqset->b = (t_biquad *)xmalloc(sizeof(t_biquad)*eqs->bcount*equ_channels);
 
           eqset->name = xstrdup(eqs->name);
           eqset->preamp = eqs->preamp;
           eqset->bcount = eqs->bcount;
           eqset->channels = equ_channels;
+          eqset->lanes = (equ_channels + EQ_LANES - 1) / EQ_LANES * EQ_LANES;
+          eqset->israte = sample_rate;
+
+          n = (size_t)eqset->bcount * eqset->lanes;
+          eqset->coef = (float *)xmalloc(EQ_COEFS * n * sizeof(float));
+          eqset->state = (float *)xcalloc(EQ_STATES * n, sizeof(float));
 
           for(i=0; i<eqs->bcount; i++)
           {
-            mk_biquad(eqs->dg[i], eqs->cf[i], sample_rate, eqs->bw[i], &eqset->b[i]);
+            mk_biquad(eqs->dg[i], eqs->cf[i], sample_rate, eqs->bw[i], &b);
 
-            for(channel=1; channel<equ_channels; channel++)
+            for(lane=0; lane<eqset->lanes; lane++)
             {
-              eqset->b[channel*eqset->bcount + i] = eqset->b[i];
+              size_t idx = i * eqset->lanes + lane;
+
+              eqset->coef[idx] = b.a0;
+              eqset->coef[n + idx] = b.a1;
+              eqset->coef[2 * n + idx] = b.a2;
+              eqset->coef[3 * n + idx] = b.a3;
+              eqset->coef[4 * n + idx] = b.a4;
             }
           }
 
@@ -697,7 +764,7 @@ void equalizer_process_buffer(char *buf, size_t size, const struct sound_params
   if(!equ_active || !current_equ || !current_equ->set)
     return;
 
-  if(sound_params->rate != current_equ->set->b->israte || sound_params->channels != equ_channels)
+  if(sound_params->rate != current_equ->set->israte || sound_params->channels != equ_channels)
   {
     logit ("Recreating filters due to sound parameter changes...");
     sample_rate = sound_params->rate;
@@ -719,6 +786,8 @@ void equalizer_process_buffer(char *buf, size_t size, const struct sound_params
     need_endianness_swap = 1;
   }
 
+  /* Should the buffer still end with a partial frame, the
+   * equ_process_buffer_*() functions leave it as it is. */
   assert (size % (samplewidth * sound_params->channels) == 0);
 
   /* setup samples to perform arithmetic */
@@ -769,170 +838,219 @@ void equalizer_process_buffer(char *buf, size_t size, const struct sound_params
 
 static void equ_process_buffer_u8(uint8_t *buf, size_t samples)
 {
-  size_t i;
+  size_t fi, frames = samples / equ_channels;
+  int ci, lanes = current_equ->set->lanes;
   float *tmp;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  if(frames == 0)
+    return;
+
+  tmp = equ_lane_buffer(frames, lanes);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  for(fi=0; fi<frames; fi++)
+    for(ci=0; ci<equ_channels; ci++)
+      tmp[fi * lanes + ci] = preampf * (float)buf[fi * equ_channels + ci];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  apply_biquads(tmp, frames, current_equ->set);
 
-  for(i=0; i<samples; i++)
+  for(fi=0; fi<frames; fi++)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT8_MAX);
-    buf[i] = (uint8_t)tmp[i];
+    for(ci=0; ci<equ_channels; ci++)
+    {
+      size_t i = fi * equ_channels + ci;
+      float f = r_mixin_rate * tmp[fi * lanes + ci] + mixin_rate * buf[i];
+      f = CLAMP(0, f, UINT8_MAX);
+      buf[i] = (uint8_t)f;
+    }
   }
-
-  free(tmp);
 }
 
 static void equ_process_buffer_s8(int8_t *buf, size_t samples)
 {
-  size_t i;
+  size_t fi, frames = samples / equ_channels;
+  int ci, lanes = current_equ->set->lanes;
   float *tmp;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  if(frames == 0)
+    return;
+
+  tmp = equ_lane_buffer(frames, lanes);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  for(fi=0; fi<frames; fi++)
+    for(ci=0; ci<equ_channels; ci++)
+      tmp[fi * lanes + ci] = preampf * (float)buf[fi * equ_channels + ci];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  apply_biquads(tmp, frames, current_equ->set);
 
-  for(i=0; i<samples; i++)
+  for(fi=0; fi<frames; fi++)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT8_MIN, tmp[i], INT8_MAX);
-    buf[i] = (int8_t)tmp[i];
+    for(ci=0; ci<equ_channels; ci++)
+    {
+      size_t i = fi * equ_channels + ci;
+      float f = r_mixin_rate * tmp[fi * lanes + ci] + mixin_rate * buf[i];
+      f = CLAMP(INT8_MIN, f, INT8_MAX);
+      buf[i] = (int8_t)f;
+    }
   }
-
-  free(tmp);
 }
 
 static void equ_process_buffer_u16(uint16_t *buf, size_t samples)
 {
-  size_t i;
+  size_t fi, frames = samples / equ_channels;
+  int ci, lanes = current_equ->set->lanes;
   float *tmp;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  if(frames == 0)
+    return;
+
+  tmp = equ_lane_buffer(frames, lanes);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  for(fi=0; fi<frames; fi++)
+    for(ci=0; ci<equ_channels; ci++)
+      tmp[fi * lanes + ci] = preampf * (float)buf[fi * equ_channels + ci];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  apply_biquads(tmp, frames, current_equ->set);
 
-  for(i=0; i<samples; i++)
+  for(fi=0; fi<frames; fi++)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT16_MAX);
-    buf[i] = (uint16_t)tmp[i];
+    for(ci=0; ci<equ_channels; ci++)
+    {
+      size_t i = fi * equ_channels + ci;
+      float f = r_mixin_rate * tmp[fi * lanes + ci] + mixin_rate * buf[i];
+      f = CLAMP(0, f, UINT16_MAX);
+      buf[i] = (uint16_t)f;
+    }
   }
-
-  free(tmp);
 }
 
 static void equ_process_buffer_s16(int16_t *buf, size_t samples)
 {
-  size_t i;
+  size_t fi, frames = samples / equ_channels;
+  int ci, lanes = current_equ->set->lanes;
   float *tmp;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  if(frames == 0)
+    return;
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  tmp = equ_lane_buffer(frames, lanes);
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  for(fi=0; fi<frames; fi++)
+    for(ci=0; ci<equ_channels; ci++)
+      tmp[fi * lanes + ci] = preampf * (float)buf[fi * equ_channels + ci];
 
-  for(i=0; i<samples; i++)
+  apply_biquads(tmp, frames, current_equ->set);
+
+  for(fi=0; fi<frames; fi++)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT16_MIN, tmp[i], INT16_MAX);
-    buf[i] = (int16_t)tmp[i];
+    for(ci=0; ci<equ_channels; ci++)
+    {
+      size_t i = fi * equ_channels + ci;
+      float f = r_mixin_rate * tmp[fi * lanes + ci] + mixin_rate * buf[i];
+      f = CLAMP(INT16_MIN, f, INT16_MAX);
+      buf[i] = (int16_t)f;
+    }
   }
-
-  free(tmp);
 }
 
 static void equ_process_buffer_u32(uint32_t *buf, size_t samples)
 {
-  size_t i;
+  size_t fi, frames = samples / equ_channels;
+  int ci, lanes = current_equ->set->lanes;
   float *tmp;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  if(frames == 0)
+    return;
+
+  tmp = equ_lane_buffer(frames, lanes);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  for(fi=0; fi<frames; fi++)
+    for(ci=0; ci<equ_channels; ci++)
+      tmp[fi * lanes + ci] = preampf * (float)buf[fi * equ_channels + ci];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  apply_biquads(tmp, frames, current_equ->set);
 
-  for(i=0; i<samples; i++)
+  for(fi=0; fi<frames; fi++)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT32_MAX);
-    buf[i] = (uint32_t)tmp[i];
+    for(ci=0; ci<equ_channels; ci++)
+    {
+      size_t i = fi * equ_channels + ci;
+      float f = r_mixin_rate * tmp[fi * lanes + ci] + mixin_rate * buf[i];
+      f = CLAMP(0, f, UINT32_MAX);
+      buf[i] = (uint32_t)f;
+    }
   }
-
-  free(tmp);
 }
 
 static void equ_process_buffer_s32(int32_t *buf, size_t samples)
 {
-  size_t i;
+  size_t fi, frames = samples / equ_channels;
+  int ci, lanes = current_equ->set->lanes;
   float *tmp;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  if(frames == 0)
+    return;
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  tmp = equ_lane_buffer(frames, lanes);
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  for(fi=0; fi<frames; fi++)
+    for(ci=0; ci<equ_channels; ci++)
+      tmp[fi * lanes + ci] = preampf * (float)buf[fi * equ_channels + ci];
 
-  for(i=0; i<samples; i++)
+  apply_biquads(tmp, frames, current_equ->set);
+
+  for(fi=0; fi<frames; fi++)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT32_MIN, tmp[i], INT32_MAX);
-    buf[i] = (int32_t)tmp[i];
+    for(ci=0; ci<equ_channels; ci++)
+    {
+      size_t i = fi * equ_channels + ci;
+      float f = r_mixin_rate * tmp[fi * lanes + ci] + mixin_rate * buf[i];
+      f = CLAMP(INT32_MIN, f, INT32_MAX);
+      buf[i] = (int32_t)f;
+    }
   }
-
-  free(tmp);
 }
 
 static void equ_process_buffer_float(float *buf, size_t samples)
 {
-  size_t i;
+  size_t fi, frames = samples / equ_channels;
+  int ci, lanes = current_equ->set->lanes;
   float *tmp;
 
   debug ("equalizing");
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  if(frames == 0)
+    return;
+
+  tmp = equ_lane_buffer(frames, lanes);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  for(fi=0; fi<frames; fi++)
+    for(ci=0; ci<equ_channels; ci++)
+      tmp[fi * lanes + ci] = preampf * buf[fi * equ_channels + ci];
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  apply_biquads(tmp, frames, current_equ->set);
 
-  for(i=0; i<samples; i++)
+  for(fi=0; fi<frames; fi++)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(-1.0f, tmp[i], 1.0f);
-    buf[i] = tmp[i];
+    for(ci=0; ci<equ_channels; ci++)
+    {
+      size_t i = fi * equ_channels + ci;
+      float f = r_mixin_rate * tmp[fi * lanes + ci] + mixin_rate * buf[i];
+      f = CLAMP(-1.0f, f, 1.0f);
+      buf[i] = (float)f;
+    }
   }
-
-  free(tmp);
 }
 
 /* equalizer list maintenance */
@@ -966,7 +1084,8 @@ static void clear_eq_set(t_eq_set_list *l)
   if(l->set)
   {
     free(l->set->name);
-    free(l->set->b);
+    free(l->set->coef);
+    free(l->set->state);
     free(l->set);
     l->set = NULL;
   }
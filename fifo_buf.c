@@ -144,6 +144,39 @@ size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
 	return written;
 }
 
+/* Return the contiguous free region following the data in the buffer and
+ * put its size in len (0 if the buffer is full), so it can be filled in
+ * place.  The data is added to the buffer by fifo_buf_commit(); the
+ * region is invalidated by fifo_buf_clear(). */
+char *fifo_buf_reserve (struct fifo_buf *b, size_t *len)
+{
+	int write_from;
+
+	assert (b != NULL);
+	assert (len != NULL);
+
+	if (b->pos + b->fill < b->size) {
+		write_from = b->pos + b->fill;
+		*len = b->size - write_from;
+	}
+	else {
+		write_from = b->pos + b->fill - b->size;
+		*len = b->size - b->fill;
+	}
+
+	return b->buf + write_from;
+}
+
+/* Add len bytes written to the region returned by fifo_buf_reserve() to
+ * the buffer. */
+void fifo_buf_commit (struct fifo_buf *b, const size_t len)
+{
+	assert (b != NULL);
+	assert (len <= (size_t)(b->size - b->fill));
+
+	b->fill += len;
+}
+
 /* Get the amount of free space in the buffer. */
 size_t fifo_buf_get_space (const struct fifo_buf *b)
 {
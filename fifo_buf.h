@@ -12,6 +12,8 @@ void fifo_buf_free (struct fifo_buf *b);
 size_t fifo_buf_put (struct fifo_buf *b, const char *data, size_t size);
 size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size);
 size_t fifo_buf_peek (struct fifo_buf *b, char *user_buf, size_t user_buf_size);
+char *fifo_buf_reserve (struct fifo_buf *b, size_t *len);
+void fifo_buf_commit (struct fifo_buf *b, const size_t len);
 size_t fifo_buf_get_space (const struct fifo_buf *b);
 void fifo_buf_clear (struct fifo_buf *b);
 size_t fifo_buf_get_fill (const struct fifo_buf *b);
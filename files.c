@@ -24,9 +24,10 @@
 #include <stdlib.h>
 #include <dirent.h>
 
+#include <pthread.h>
+
 #ifdef HAVE_LIBMAGIC
 #include <magic.h>
-#include <pthread.h>
 #endif
 
 #define DEBUG
@@ -426,93 +427,314 @@ int read_directory (const char *directory, lists_t_strs *dirs,
 	return 1;
 }
 
-static int dir_symlink_loop (const ino_t inode_no, const ino_t *dir_stack,
-		const int depth)
+/* Number of threads reading directories in read_directory_recurr(). */
+#define DIR_SCAN_THREADS	8
+
+/* A directory found by the recursive scan.  Its entries are kept in the
+ * order returned by readdir() and merged into the playlist only when the
+ * whole tree has been read, so the result does not depend on which thread
+ * read which directory. */
+struct scan_dir
 {
-	int i;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct scan_dir *parent;
+	struct scan_entry *entries;
+	struct scan_entry *last_entry;
+	struct scan_dir *next_queued;
+};
+
+/* Either a sound file or a subdirectory. */
+struct scan_entry
+{
+	char *file;
+	struct scan_dir *dir;
+	struct scan_entry *next;
+};
 
-	for (i = 0; i < depth; i++)
-		if (dir_stack[i] == inode_no)
-			return 1;
+struct dir_scan
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct scan_dir *queue_head;
+	struct scan_dir *queue_tail;
+	int pending;		/* directories queued or being read */
+	char *error_dir;	/* last directory we couldn't read */
+	int error_errno;
+	int (*stop)(void *);	/* optional: return non-zero to stop the scan */
+	void *stop_data;
+};
+
+static int dir_scan_interrupted (struct dir_scan *s)
+{
+	return user_wants_interrupt () || (s->stop && s->stop (s->stop_data));
+}
 
-	return 0;
+static struct scan_dir *scan_dir_new (char *path, struct scan_dir *parent)
+{
+	struct scan_dir *d;
+
+	d = (struct scan_dir *)xcalloc (1, sizeof (struct scan_dir));
+	d->path = path;
+	d->parent = parent;
+
+	return d;
+}
+
+static void scan_dir_add_entry (struct scan_dir *d, char *file,
+		struct scan_dir *subdir)
+{
+	struct scan_entry *e;
+
+	e = (struct scan_entry *)xmalloc (sizeof (struct scan_entry));
+	e->file = file;
+	e->dir = subdir;
+	e->next = NULL;
+
+	if (d->last_entry)
+		d->last_entry->next = e;
+	else
+		d->entries = e;
+	d->last_entry = e;
 }
 
-/* Recursively add files from the directory to the playlist.
- * Return 1 if OK (and even some errors), 0 if the user interrupted. */
-static int read_directory_recurr_internal (const char *directory, struct plist *plist,
-		ino_t **dir_stack, int *depth)
+static void dir_scan_queue (struct dir_scan *s, struct scan_dir *d)
+{
+	LOCK (s->mutex);
+	if (s->queue_tail)
+		s->queue_tail->next_queued = d;
+	else
+		s->queue_head = d;
+	s->queue_tail = d;
+	s->pending += 1;
+	pthread_cond_signal (&s->cond);
+	UNLOCK (s->mutex);
+}
+
+static void dir_scan_error (struct dir_scan *s, const char *dir, int err)
+{
+	LOCK (s->mutex);
+	free (s->error_dir);
+	s->error_dir = xstrdup (dir);
+	s->error_errno = err;
+	UNLOCK (s->mutex);
+
+	logit ("Can't read directory %s: %s", dir, strerror (err));
+}
+
+/* Return the type of the directory entry, using the type reported by
+ * readdir() where possible to avoid a stat() for each file.  Only
+ * directories and sound files are of interest here. */
+static enum file_type scan_entry_type (DIR *dir ATTR_UNUSED,
+		const struct dirent *entry, const char *file)
+{
+	struct stat st;
+
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	if (entry->d_type == DT_DIR)
+		return F_DIR;
+	if (entry->d_type == DT_REG)
+		return is_sound_file (file) ? F_SOUND : F_OTHER;
+#endif
+
+#ifdef HAVE_FSTATAT
+	if (fstatat (dirfd (dir), entry->d_name, &st, 0) == -1)
+#else
+	if (stat (file, &st) == -1)
+#endif
+		return F_OTHER;
+	if (S_ISDIR(st.st_mode))
+		return F_DIR;
+	if (is_sound_file (file))
+		return F_SOUND;
+
+	return F_OTHER;
+}
+
+/* Read one directory, queueing its subdirectories for the other threads. */
+static void scan_dir_read (struct dir_scan *s, struct scan_dir *d)
 {
 	DIR *dir;
 	struct dirent *entry;
 	struct stat st;
+	struct scan_dir *p;
+	size_t len;
 
-	if (stat(directory, &st)) {
-		error ("Can't stat %s: %s", directory, strerror(errno));
-		return 0;
+	if (!(dir = opendir (d->path))) {
+		dir_scan_error (s, d->path, errno);
+		return;
 	}
 
-	assert (plist != NULL);
-	assert (directory != NULL);
-
-	if (*dir_stack && dir_symlink_loop(st.st_ino, *dir_stack, *depth)) {
-		logit ("Detected symlink loop on %s", directory);
-		return 1;
+	if (fstat (dirfd (dir), &st) == -1) {
+		dir_scan_error (s, d->path, errno);
+		closedir (dir);
+		return;
 	}
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
 
-	if (!(dir = opendir(directory))) {
-		error ("Can't read directory: %s", strerror(errno));
-		return 1;
+	for (p = d->parent; p; p = p->parent) {
+		if (p->dev == d->dev && p->ino == d->ino) {
+			logit ("Detected symlink loop on %s", d->path);
+			closedir (dir);
+			return;
+		}
 	}
 
-	(*depth)++;
-	*dir_stack = (ino_t *)xrealloc (*dir_stack, sizeof(ino_t) * (*depth));
-	(*dir_stack)[*depth - 1] = st.st_ino;
+	len = strlen (d->path);
+	if (len > 0 && d->path[len - 1] == '/')
+		len -= 1;
 
-	while ((entry = readdir(dir))) {
-		int rc;
-		char file[PATH_MAX];
+	while ((entry = readdir (dir)) && !dir_scan_interrupted (s)) {
+		char *file;
 		enum file_type type;
 
-		if (user_wants_interrupt()) {
-			error ("Interrupted! Not all files read!");
-			break;
-		}
-
 		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
 			continue;
-		rc = snprintf(file, sizeof(file), "%s/%s", directory, entry->d_name);
-		if (rc >= ssizeof(file)) {
-			error ("Path too long!");
-			continue;
+
+		file = (char *)xmalloc (len + strlen (entry->d_name) + 2);
+		memcpy (file, d->path, len);
+		file[len] = '/';
+		strcpy (file + len + 1, entry->d_name);
+
+		type = scan_entry_type (dir, entry, file);
+		if (type == F_DIR) {
+			struct scan_dir *subdir = scan_dir_new (file, d);
+
+			scan_dir_add_entry (d, NULL, subdir);
+			dir_scan_queue (s, subdir);
 		}
-		type = file_type (file);
-		if (type == F_DIR)
-			read_directory_recurr_internal(file, plist, dir_stack, depth);
-		else if (type == F_SOUND && plist_find_fname(plist, file) == -1)
-			plist_add (plist, file);
+		else if (type == F_SOUND)
+			scan_dir_add_entry (d, file, NULL);
+		else
+			free (file);
 	}
 
-	(*depth)--;
-	*dir_stack = (ino_t *)xrealloc (*dir_stack, sizeof(ino_t) * (*depth));
-
 	closedir (dir);
-	return 1;
 }
 
-int read_directory_recurr (const char *directory, struct plist *plist)
+static void *dir_scan_thread (void *arg)
 {
-	int ret;
-	int depth = 0;
-	ino_t *dir_stack = NULL;
+	struct dir_scan *s = (struct dir_scan *)arg;
 
-	ret = read_directory_recurr_internal (directory, plist, &dir_stack,
-			&depth);
+	LOCK (s->mutex);
+	while (1) {
+		struct scan_dir *d;
+
+		while (!s->queue_head && s->pending > 0)
+			pthread_cond_wait (&s->cond, &s->mutex);
+		if (!s->queue_head)
+			break;
+
+		d = s->queue_head;
+		s->queue_head = d->next_queued;
+		if (!s->queue_head)
+			s->queue_tail = NULL;
+		UNLOCK (s->mutex);
 
-	if (dir_stack)
-		free (dir_stack);
+		if (!dir_scan_interrupted (s))
+			scan_dir_read (s, d);
+
+		LOCK (s->mutex);
+		s->pending -= 1;
+		if (s->pending == 0)
+			pthread_cond_broadcast (&s->cond);
+	}
+	UNLOCK (s->mutex);
+
+	return NULL;
+}
 
-	return ret;
+/* Add the files found in the directory and its subdirectories to the
+ * playlist in readdir() order, depth first, and free the directory. */
+static void scan_dir_merge (struct scan_dir *d, struct plist *plist)
+{
+	struct scan_entry *e, *next;
+
+	for (e = d->entries; e; e = next) {
+		next = e->next;
+		if (e->dir)
+			scan_dir_merge (e->dir, plist);
+		else {
+			if (plist_find_fname (plist, e->file) == -1)
+				plist_add (plist, e->file);
+			free (e->file);
+		}
+		free (e);
+	}
+
+	free (d->path);
+	free (d);
+}
+
+/* Recursively add files from the directory to the playlist.  Directories
+ * are read by a pool of threads.  If stop is not NULL, the threads call
+ * stop (stop_data) before each directory and entry and give up when it
+ * returns non-zero; the files found so far are still added.  Return 1 if
+ * OK (and even some errors), 0 if the directory can't be read at all. */
+int read_directory_recurr_stop (const char *directory, struct plist *plist,
+		int (*stop)(void *), void *stop_data)
+{
+	struct dir_scan s;
+	struct scan_dir *top;
+	struct stat st;
+	pthread_t threads[DIR_SCAN_THREADS - 1];
+	int i, started = 0;
+
+	assert (directory != NULL);
+	assert (plist != NULL);
+
+	if (stat(directory, &st)) {
+		error ("Can't stat %s: %s", directory, strerror(errno));
+		return 0;
+	}
+
+	top = scan_dir_new (xstrdup (directory), NULL);
+
+	pthread_mutex_init (&s.mutex, NULL);
+	pthread_cond_init (&s.cond, NULL);
+	s.queue_head = s.queue_tail = top;
+	s.pending = 1;
+	s.error_dir = NULL;
+	s.error_errno = 0;
+	s.stop = stop;
+	s.stop_data = stop_data;
+
+	for (i = 0; i < DIR_SCAN_THREADS - 1; i++) {
+		int rc;
+
+		rc = pthread_create (&threads[started], NULL, dir_scan_thread, &s);
+		if (rc != 0) {
+			logit ("Can't create directory scan thread: %s", strerror (rc));
+			break;
+		}
+		started += 1;
+	}
+
+	dir_scan_thread (&s);
+	for (i = 0; i < started; i++)
+		pthread_join (threads[i], NULL);
+
+	if (user_wants_interrupt ())
+		error ("Interrupted! Not all files read!");
+	else if (stop && stop (stop_data))
+		logit ("Scan of %s stopped", directory);
+	else if (s.error_dir)
+		error ("Can't read directory: %s", strerror (s.error_errno));
+
+	scan_dir_merge (top, plist);
+
+	free (s.error_dir);
+	pthread_cond_destroy (&s.cond);
+	pthread_mutex_destroy (&s.mutex);
+
+	return 1;
+}
+
+int read_directory_recurr (const char *directory, struct plist *plist)
+{
+	return read_directory_recurr_stop (directory, plist, NULL, NULL);
 }
 
 /* Return the file extension position or NULL if the file has no extension. */
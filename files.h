@@ -16,6 +16,8 @@ void files_cleanup ();
 int read_directory (const char *directory, lists_t_strs *dirs,
 		lists_t_strs *playlists, struct plist *plist);
 int read_directory_recurr (const char *directory, struct plist *plist);
+int read_directory_recurr_stop (const char *directory, struct plist *plist,
+		int (*stop)(void *), void *stop_data);
 void resolve_path (char *buf, const int size, const char *file);
 char *ext_pos (const char *file);
 enum file_type file_type (const char *file);
@@ -43,6 +43,8 @@
 #include "keys.h"
 #include "options.h"
 #include "files.h"
+#include "dir_cache.h"
+#include "library.h"
 #include "decoder.h"
 #include "themes.h"
 #include "softmixer.h"
@@ -51,17 +53,26 @@
 #define INTERFACE_LOG	"mocp_client_log"
 #define PLAYLIST_FILE	"playlist.m3u"
 
-#define QUEUE_CLEAR_THRESH 128
+/* Number of directory listings kept in the cache. */
+#define DIR_CACHE_SIZE	64
 
 static struct file_tags *get_tags (const char *file);
 
 /* Socket of the server connection. */
 static int srv_sock = -1;
 
+/* Data for the server is buffered and sent when we are going to wait for
+ * the response or for the user, or when this much has been collected. */
+#define SRV_BUF_MAX	(64 * 1024)
+static struct packet_buf *srv_buf = NULL;
+
 static struct plist *playlist = NULL; /* our playlist */
 static struct plist *queue = NULL; /* our queue */
 static struct plist *dir_plist = NULL; /* contents of the current directory */
 
+/* Listings of recently visited directories. */
+static struct dir_cache *dir_cache = NULL;
+
 /* Queue for events coming from the server. */
 static struct event_queue events;
 
@@ -124,34 +135,50 @@ static void clear_interrupt ()
 	wants_interrupt = 0;
 }
 
+/* Send the data buffered for the server. */
+static void flush_to_srv ()
+{
+	if (srv_buf && !packet_buf_send(srv_sock, srv_buf))
+		fatal ("Can't send() data to the server!");
+}
+
+/* Return the buffer for data to be sent to the server. */
+static struct packet_buf *get_srv_buf ()
+{
+	if (!srv_buf)
+		srv_buf = packet_buf_new ();
+	else if (srv_buf->len >= SRV_BUF_MAX)
+		flush_to_srv ();
+
+	return srv_buf;
+}
+
 static void send_int_to_srv (const int num)
 {
-	if (!send_int(srv_sock, num))
-		fatal ("Can't send() int to the server!");
+	packet_buf_add_int (get_srv_buf (), num);
 }
 
 static void send_bool_to_srv (const bool t)
 {
-	if (!send_int(srv_sock, t ? 1 : 0))
-		fatal ("Can't send() bool to the server!");
+	packet_buf_add_int (get_srv_buf (), t ? 1 : 0);
 }
 
 static void send_str_to_srv (const char *str)
 {
-	if (!send_str(srv_sock, str))
-		fatal ("Can't send() string to the server!");
+	packet_buf_add_str (get_srv_buf (), str);
 }
 
+/* If item == NULL, send the end of playlist mark. */
 static void send_item_to_srv (const struct plist_item *item)
 {
-	if (!send_item(srv_sock, item))
-		fatal ("Can't send() item to the server!");
+	packet_buf_add_item (get_srv_buf (), item);
 }
 
 static int get_int_from_srv ()
 {
 	int num;
 
+	flush_to_srv ();
 	if (!get_int(srv_sock, &num))
 		fatal ("Can't receive value from the server!");
 
@@ -162,6 +189,7 @@ static bool get_bool_from_srv ()
 {
 	int num;
 
+	flush_to_srv ();
 	if (!get_int(srv_sock, &num))
 		fatal ("Can't receive value from the server!");
 
@@ -171,7 +199,10 @@ static bool get_bool_from_srv ()
 /* Returned memory is malloc()ed. */
 static char *get_str_from_srv ()
 {
-	char *str = get_str (srv_sock);
+	char *str;
+
+	flush_to_srv ();
+	str = get_str (srv_sock);
 
 	if (!str)
 		fatal ("Can't receive string from the server!");
@@ -181,7 +212,10 @@ static char *get_str_from_srv ()
 
 static struct file_tags *recv_tags_from_srv ()
 {
-	struct file_tags *tags = recv_tags (srv_sock);
+	struct file_tags *tags;
+
+	flush_to_srv ();
+	tags = recv_tags (srv_sock);
 
 	if (!tags)
 		fatal ("Can't receive tags from the server!");
@@ -194,6 +228,7 @@ static int get_int_from_srv_noblock (int *num)
 {
 	enum noblock_io_status st;
 
+	flush_to_srv ();
 	if ((st = get_int_noblock(srv_sock, num)) == NB_IO_ERR)
 		fatal ("Can't receive value from the server!");
 
@@ -204,6 +239,7 @@ static struct plist_item *recv_item_from_srv ()
 {
 	struct plist_item *item;
 
+	flush_to_srv ();
 	if (!(item = recv_item(srv_sock)))
 		fatal ("Can't receive item from the server!");
 
@@ -227,6 +263,7 @@ static struct move_ev_data *recv_move_ev_data_from_srv ()
 {
 	struct move_ev_data *d;
 
+	flush_to_srv ();
 	if (!(d = recv_move_ev_data(srv_sock)))
 		fatal ("Can't receive move data from the server!");
 
@@ -578,6 +615,14 @@ static int get_tags_setting ()
 	return needed_tags;
 }
 
+/* Return non-zero if the item is missing any of the given tags. */
+static int needs_tags (const struct plist *plist, const int num,
+		const int tags_sel)
+{
+	return !plist_deleted(plist, num) && (!plist->items[num].tags
+			|| ~plist->items[num].tags->filled & tags_sel);
+}
+
 /* For each file in the playlist, send a request for all the given tags if
  * the file is missing any of those tags.  Return the number of requests. */
 static int ask_for_tags (const struct plist *plist, const int tags_sel)
@@ -589,9 +634,7 @@ static int ask_for_tags (const struct plist *plist, const int tags_sel)
 
 	if (tags_sel != 0) {
 		for (i = 0; i < plist->num; i++) {
-			if (!plist_deleted(plist, i) &&
-			    (!plist->items[i].tags ||
-			     ~plist->items[i].tags->filled & tags_sel)) {
+			if (needs_tags (plist, i, tags_sel)) {
 				char *file;
 
 				file = plist_get_file (plist, i);
@@ -604,6 +647,42 @@ static int ask_for_tags (const struct plist *plist, const int tags_sel)
 	return req;
 }
 
+/* Ask the server to read tags for the files shown on the screen before
+ * the others still waiting in its queue. */
+static void prioritize_visible_tags ()
+{
+	int i, tags_sel;
+	lists_t_strs *files;
+
+	tags_sel = get_tags_setting ();
+	if (tags_sel == 0)
+		return;
+
+	files = lists_strs_new (32);
+	iface_get_visible_files (files);
+
+	for (i = 0; i < lists_strs_size (files); i++) {
+		const char *file = lists_strs_at (files, i);
+		int num;
+
+		if ((num = plist_find_fname (dir_plist, file)) != -1) {
+			if (!needs_tags (dir_plist, num, tags_sel))
+				continue;
+		}
+		else if ((num = plist_find_fname (playlist, file)) != -1) {
+			if (!needs_tags (playlist, num, tags_sel))
+				continue;
+		}
+		else
+			continue;
+
+		send_int_to_srv (CMD_PRIORITIZE_TAGS);
+		send_str_to_srv (file);
+	}
+
+	lists_strs_free (files);
+}
+
 static void interface_message (const char *format, ...)
 {
 	va_list va;
@@ -1042,6 +1121,7 @@ static void event_plist_del (char *file)
 
 		file = plist_get_file (playlist, item);
 		plist_delete (playlist, item);
+		plist_reclaim (playlist, -1);
 
 		iface_del_plist_item (file);
 		playlist_total_time = plist_total_time (playlist,
@@ -1065,13 +1145,7 @@ static void event_queue_del (char *file)
 
 	if (item != -1) {
 		plist_delete (queue, item);
-
-		/* Free the deleted items occasionally.
-		 * QUEUE_CLEAR_THRESH is chosen to be two times
-		 * the initial size of the playlist. */
-		if (plist_count(queue) == 0
-				&& queue->num >= QUEUE_CLEAR_THRESH)
-			plist_clear (queue);
+		plist_reclaim (queue, -1);
 
 		iface_set_files_in_queue (plist_count(queue));
 		iface_update_queue_positions (queue, playlist, dir_plist, file);
@@ -1270,6 +1344,8 @@ static int go_to_dir (const char *dir, const int reload)
 	char last_dir[PATH_MAX];
 	const char *new_dir = dir ? dir : cwd;
 	int going_up = 0;
+	int cached = 0;
+	time_t read_time = 0;
 	lists_t_strs *dirs, *playlists;
 
 	iface_set_status ("Reading directory...");
@@ -1286,19 +1362,31 @@ static int go_to_dir (const char *dir, const int reload)
 	dirs = lists_strs_new (FILES_LIST_INIT_SIZE);
 	playlists = lists_strs_new (FILES_LIST_INIT_SIZE);
 
-	if (!read_directory(new_dir, dirs, playlists, dir_plist)) {
-		iface_set_status ("");
-		plist_free (dir_plist);
-		lists_strs_free (dirs);
-		lists_strs_free (playlists);
-		free (dir_plist);
-		dir_plist = old_dir_plist;
-		return 0;
+	if (!reload)
+		cached = dir_cache_get (dir_cache, new_dir, dirs, playlists,
+				dir_plist);
+
+	if (!cached) {
+		read_time = time (NULL);
+		if (!read_directory(new_dir, dirs, playlists, dir_plist)) {
+			dir_cache_remove (dir_cache, new_dir);
+			iface_set_status ("");
+			plist_free (dir_plist);
+			lists_strs_free (dirs);
+			lists_strs_free (playlists);
+			free (dir_plist);
+			dir_plist = old_dir_plist;
+			return 0;
+		}
 	}
 
 	/* TODO: use CMD_ABORT_TAGS_REQUESTS (what if we requested tags for the
 	 playlist?) */
 
+	/* Keep the tags we got for the directory we are leaving. */
+	if (cwd[0])
+		dir_cache_update (dir_cache, cwd, old_dir_plist);
+
 	plist_free (old_dir_plist);
 	free (old_dir_plist);
 
@@ -1307,9 +1395,13 @@ static int go_to_dir (const char *dir, const int reload)
 
 	switch_titles_file (dir_plist);
 
-	plist_sort_fname (dir_plist);
-	lists_strs_sort (dirs, sort_dirs_func);
-	lists_strs_sort (playlists, sort_strcmp_func);
+	if (!cached) {
+		plist_sort_fname (dir_plist);
+		lists_strs_sort (dirs, sort_dirs_func);
+		lists_strs_sort (playlists, sort_strcmp_func);
+		dir_cache_put (dir_cache, cwd, read_time, dirs, playlists,
+				dir_plist);
+	}
 
 	ask_for_tags (dir_plist, get_tags_setting());
 
@@ -1328,6 +1420,8 @@ static int go_to_dir (const char *dir, const int reload)
 	if (iface_in_plist_menu())
 		iface_switch_to_dir ();
 
+	prioritize_visible_tags ();
+
 	return 1;
 }
 
@@ -1876,6 +1970,7 @@ static void remove_file_from_playlist (const char *file)
 		assert (n != -1);
 
 		plist_delete (playlist, n);
+		plist_reclaim (playlist, -1);
 		iface_del_plist_item (file);
 
 		if (plist_count(playlist) == 0)
@@ -3041,6 +3136,8 @@ static void run_external_cmd (char **args, const int arg_num ASSERT_ONLY)
 	assert (args[0] != NULL);
 	assert (args[arg_num] == NULL);
 
+	/* Don't keep the server waiting while the command runs. */
+	flush_to_srv ();
 	iface_temporary_exit ();
 
 	child = fork();
@@ -3178,6 +3275,7 @@ static void menu_key (const struct iface_key *k)
 			case KEY_CMD_MENU_LAST:
 				iface_menu_key (cmd);
 				last_menu_move_time = time (NULL);
+				prioritize_visible_tags ();
 				break;
 			case KEY_CMD_QUIT:
 				want_quit = QUIT_SERVER;
@@ -3261,6 +3359,7 @@ static void menu_key (const struct iface_key *k)
 			case KEY_CMD_TOGGLE_SHOW_HIDDEN_FILES:
 				options_set_bool ("ShowHiddenFiles",
 				                  !options_get_bool ("ShowHiddenFiles"));
+				dir_cache_clear (dir_cache);
 				if (iface_in_dir_menu ())
 					reread_dir ();
 				break;
@@ -3515,6 +3614,7 @@ void init_interface (const int sock, const int logging, lists_t_strs *args)
 	file_info_reset (&curr_file);
 	file_info_block_init (&curr_file);
 	init_playlists ();
+	dir_cache = dir_cache_new (DIR_CACHE_SIZE);
 	event_queue_init (&events);
 	keys_init ();
 	windows_init ();
@@ -3607,6 +3707,7 @@ void interface_loop ()
 		FD_SET (STDIN_FILENO, &fds);
 
 		dequeue_events ();
+		flush_to_srv ();
 		ret = pselect (srv_sock + 1, &fds, NULL, NULL, &timeout, NULL);
 		if (ret == -1 && !want_quit && errno != EINTR)
 			interface_fatal ("pselect() failed: %s", strerror(errno));
@@ -3682,12 +3783,18 @@ void interface_end ()
 		send_int_to_srv (CMD_QUIT);
 	else
 		send_int_to_srv (CMD_DISCONNECT);
+	flush_to_srv ();
 	close (srv_sock);
 	srv_sock = -1;
+	packet_buf_free (srv_buf);
+	srv_buf = NULL;
 
 	windows_end ();
 	keys_cleanup ();
 
+	dir_cache_free (dir_cache);
+	dir_cache = NULL;
+
 	plist_free (dir_plist);
 	plist_free (playlist);
 	plist_free (queue);
@@ -3747,6 +3854,8 @@ void interface_cmdline_clear_plist (int server_sock)
 	unlink (create_file_name (PLAYLIST_FILE));
 
 	plist_free (&plist);
+
+	flush_to_srv ();
 }
 
 static void add_recursively (struct plist *plist, lists_t_strs *args)
@@ -3860,6 +3969,8 @@ void interface_cmdline_append (int server_sock, lists_t_strs *args)
 		plist_free (&clients_plist);
 		plist_free (&new);
 	}
+
+	flush_to_srv ();
 }
 
 void interface_cmdline_play_first (int server_sock)
@@ -3893,6 +4004,8 @@ void interface_cmdline_play_first (int server_sock)
 	send_str_to_srv ("");
 
 	plist_free (&plist);
+
+	flush_to_srv ();
 }
 
 /* Request tags from the server, wait until they arrive and return them
@@ -4061,6 +4174,8 @@ void interface_cmdline_enqueue (int server_sock, lists_t_strs *args)
 			free (path);
 		}
 	}
+
+	flush_to_srv ();
 }
 
 void interface_cmdline_playit (int server_sock, lists_t_strs *args)
@@ -4105,6 +4220,8 @@ void interface_cmdline_playit (int server_sock, lists_t_strs *args)
 	send_str_to_srv ("");
 
 	plist_free (&plist);
+
+	flush_to_srv ();
 }
 
 void interface_cmdline_seek_by (int server_sock, const int seek_by)
@@ -4112,12 +4229,16 @@ void interface_cmdline_seek_by (int server_sock, const int seek_by)
 	srv_sock = server_sock; /* the interface is not initialized, so set it
 				   here */
 	seek (seek_by);
+
+	flush_to_srv ();
 }
 
 void interface_cmdline_jump_to (int server_sock, const int pos)
 {
 	srv_sock = server_sock; /* the interface is not initialized, so set it here */
 	jump_to (pos);
+
+	flush_to_srv ();
 }
 
 void interface_cmdline_jump_to_percent (int server_sock, const int percent)
@@ -4145,6 +4266,8 @@ void interface_cmdline_jump_to_percent (int server_sock, const int percent)
 	new_pos = (percent*curr_file.tags->time)/100;
 	printf("Jumping to: %ds. Total time is: %ds\n", new_pos, curr_file.tags->time);
 	jump_to (new_pos);
+
+	flush_to_srv ();
 }
 
 void interface_cmdline_adj_volume (int server_sock, const char *arg)
@@ -4157,6 +4280,8 @@ void interface_cmdline_adj_volume (int server_sock, const char *arg)
 		adjust_mixer(atoi(arg)); /* atoi can handle -  */
 	else if (arg[0] != 0)
 		set_mixer(atoi(arg));
+
+	flush_to_srv ();
 }
 
 void interface_cmdline_set (int server_sock, char *arg, const int val)
@@ -4196,6 +4321,8 @@ void interface_cmdline_set (int server_sock, char *arg, const int val)
 
 		tok = strtok_r (NULL, ",", &last);
 	}
+
+	flush_to_srv ();
 }
 
 /* Print formatted info
@@ -4385,3 +4512,46 @@ void interface_cmdline_formatted_info (const int server_sock,
 	plist_free (queue);
 
 }
+
+/* Print the files in the music library matching the pattern. */
+void interface_cmdline_find (int server_sock, const char *pattern)
+{
+	int state, end_of_list = 0;
+	struct plist_item *item;
+
+	srv_sock = server_sock; /* the interface is not initialized, so set it
+				   here */
+
+	send_int_to_srv (CMD_LIBRARY_QUERY);
+	send_str_to_srv (pattern);
+	send_int_to_srv (0);
+
+	state = get_data_int ();
+
+	do {
+		item = recv_item_from_srv ();
+		if (item->file[0])
+			printf ("%s\n", item->file);
+		else
+			end_of_list = 1;
+		plist_free_item_fields (item);
+		free (item);
+	} while (!end_of_list);
+
+	if (state == LIBRARY_EMPTY)
+		fprintf (stderr, "The music library can't be indexed, "
+		                 "is MusicDir set?\n");
+	else if (state == LIBRARY_BUILDING)
+		fprintf (stderr, "The music library is being indexed, "
+		                 "results may be incomplete.\n");
+}
+
+void interface_cmdline_update_library (int server_sock)
+{
+	srv_sock = server_sock; /* the interface is not initialized, so set it
+				   here */
+
+	send_int_to_srv (CMD_LIBRARY_UPDATE);
+
+	flush_to_srv ();
+}
@@ -51,6 +51,8 @@ void interface_cmdline_adj_volume (int server_sock, const char *arg);
 void interface_cmdline_set (int server_sock, char *arg, const int val);
 void interface_cmdline_formatted_info (const int server_sock, const char *format_str);
 void interface_cmdline_enqueue (int server_sock, lists_t_strs *args);
+void interface_cmdline_find (int server_sock, const char *pattern);
+void interface_cmdline_update_library (int server_sock);
 
 #ifdef __cplusplus
 }
@@ -98,6 +98,8 @@ struct side_menu
 			struct menu *main;    /* visible menu */
 			struct menu *copy;    /* copy of the menu when we display
 			                         matching items while searching */
+			struct menu_matches *matches; /* items of the copy
+			                                 matching the search */
 		} list;
 		/* struct menu_tree *tree;*/
 	} menu;
@@ -785,6 +787,7 @@ static void side_menu_init (struct side_menu *m, const enum side_menu_type type,
 	if (type == MENU_DIR || type == MENU_PLAYLIST) {
 		side_menu_init_menu (m);
 		m->menu.list.copy = NULL;
+		m->menu.list.matches = NULL;
 
 		menu_set_items_numbering (m->menu.list.main,
 				type == MENU_PLAYLIST
@@ -805,6 +808,7 @@ static void side_menu_init (struct side_menu *m, const enum side_menu_type type,
 	else if (type == MENU_THEMES) {
 		side_menu_init_menu (m);
 		m->menu.list.copy = NULL;
+		m->menu.list.matches = NULL;
 	}
 	else
 		abort ();
@@ -822,6 +826,7 @@ static void side_menu_destroy (struct side_menu *m)
 			menu_free (m->menu.list.main);
 			if (m->menu.list.copy)
 				menu_free (m->menu.list.copy);
+			menu_matches_free (m->menu.list.matches);
 		}
 		else
 			abort ();
@@ -1443,6 +1448,14 @@ static void update_menu_item (struct menu_item *mi,
 
 }
 
+/* Forget the search results, they point to the items of the copy of the
+ * menu which is being changed. */
+static void side_menu_clear_matches (struct side_menu *m)
+{
+	menu_matches_free (m->menu.list.matches);
+	m->menu.list.matches = NULL;
+}
+
 /* Update item title and time for this item if it's present on this menu.
  * Return a non-zero value if the item is visible. */
 static int side_menu_update_item (struct side_menu *m,
@@ -1468,6 +1481,7 @@ static int side_menu_update_item (struct side_menu *m,
 	}
 	if (m->menu.list.copy
 			&& (mi = menu_find(m->menu.list.copy, file))) {
+		side_menu_clear_matches (m);
 		update_menu_item (mi, plist, n, m->type == MENU_PLAYLIST
 				&& options_get_bool("PlaylistFullpaths"));
 		visible = visible || menu_is_visible (m->menu.list.main, mi);
@@ -1526,6 +1540,7 @@ static int side_menu_add_plist_item (struct side_menu *m,
 	assert (m->visible);
 	assert (m->type == MENU_DIR || m->type == MENU_PLAYLIST);
 
+	side_menu_clear_matches (m);
 	visible = add_to_menu (m->menu.list.copy ? m->menu.list.copy
 			: m->menu.list.main,
 			plist, num,
@@ -1599,6 +1614,7 @@ static void side_menu_del_item (struct side_menu *m, const char *file)
 	assert (m->visible);
 	assert (m->type == MENU_DIR || m->type == MENU_PLAYLIST);
 
+	side_menu_clear_matches (m);
 	menu_del_item (m->menu.list.copy ? m->menu.list.copy : m->menu.list.main,
 			file);
 }
@@ -1615,24 +1631,46 @@ static void side_menu_set_plist_time (struct side_menu *m, const int time,
 }
 
 /* Replace the menu with one having only those items which contain 'pattern'.
- * If no items match, don't do anything.
+ * If no items match, don't do anything.  The matches of the previous
+ * pattern are kept, so when the pattern grows while typing only they are
+ * searched and the menu is not rebuilt if none of them dropped out.
  * Return the number of matching items. */
 static int side_menu_filter (struct side_menu *m, const char *pattern)
 {
 	struct menu *filtered_menu;
+	int narrowed = 0;
+	int nitems;
 
 	assert (m != NULL);
 	assert (pattern != NULL);
 	assert (m->menu.list.main != NULL);
 
-	filtered_menu = menu_filter_pattern (m->menu.list.copy
-			? m->menu.list.copy : m->menu.list.main, pattern);
+	if (!m->menu.list.copy)
+		side_menu_clear_matches (m);
+	else if (m->menu.list.matches) {
+		const char *shown = menu_matches_pattern (m->menu.list.matches);
+
+		narrowed = !strncmp (shown, pattern, strlen (shown));
+	}
+
+	m->menu.list.matches = menu_matches_push (m->menu.list.copy
+			? m->menu.list.copy : m->menu.list.main,
+			m->menu.list.matches, pattern);
+	nitems = menu_matches_count (m->menu.list.matches);
 
-	if (menu_nitems(filtered_menu) == 0) {
-		menu_free (filtered_menu);
+	if (nitems == 0) {
+		m->menu.list.matches = menu_matches_pop (m->menu.list.matches);
 		return 0;
 	}
 
+	/* The longer pattern matches the same items as those displayed. */
+	if (narrowed && nitems == menu_nitems (m->menu.list.main))
+		return nitems;
+
+	filtered_menu = menu_filter_matches (m->menu.list.copy
+			? m->menu.list.copy : m->menu.list.main,
+			m->menu.list.matches);
+
 	if (m->menu.list.copy)
 		menu_free (m->menu.list.main);
 	else
@@ -1640,7 +1678,7 @@ static int side_menu_filter (struct side_menu *m, const char *pattern)
 
 	m->menu.list.main = filtered_menu;
 
-	return menu_nitems (filtered_menu);
+	return nitems;
 }
 
 static void side_menu_use_main (struct side_menu *m)
@@ -1652,6 +1690,7 @@ static void side_menu_use_main (struct side_menu *m)
 		menu_free (m->menu.list.main);
 		m->menu.list.main = m->menu.list.copy;
 		m->menu.list.copy = NULL;
+		side_menu_clear_matches (m);
 	}
 }
 
@@ -2291,6 +2330,18 @@ static void main_win_resize (struct main_win *w)
 	main_win_draw (w);
 }
 
+static void main_win_get_visible_files (const struct main_win *w,
+		lists_t_strs *files)
+{
+	const struct side_menu *m;
+
+	assert (w != NULL);
+
+	m = &w->menus[w->selected_menu];
+	if (m->type == MENU_DIR || m->type == MENU_PLAYLIST)
+		menu_get_visible_files (m->menu.list.main, files);
+}
+
 static void main_win_make_visible (struct main_win *w,
 		const enum side_menu_type type, const char *file)
 {
@@ -4371,6 +4422,14 @@ void iface_swap_plist_items (const char *file1, const char *file2)
 	iface_refresh_screen ();
 }
 
+/* Add the sound files shown in the current menu to the list. */
+void iface_get_visible_files (lists_t_strs *files)
+{
+	assert (files != NULL);
+
+	main_win_get_visible_files (&main_win, files);
+}
+
 /* Make sure that this file in this menu is visible. */
 void iface_make_visible (const enum iface_menu menu, const char *file)
 {
@@ -51,6 +51,11 @@
 # define CURL_ONLY ATTR_UNUSED
 #endif
 
+/* Maximum number of bytes read from the source at a time by the read
+ * thread.  Some sources (like curl) block until the whole amount has been
+ * read, so this must not be too big. */
+#define IO_READ_CHUNK	8096
+
 #ifdef HAVE_MMAP
 static ssize_t io_read_mmap (struct io_stream *s, const int dont_move,
 		void *buf, size_t count)
@@ -358,20 +363,36 @@ static void *io_read_thread (void *data)
 	logit ("IO read thread created");
 
 	while (!s->stop_read_thread) {
-		char read_buf[8096];
-		int read_buf_fill = 0;
-		int read_buf_pos = 0;
+		char *read_buf;
+		size_t read_buf_size;
+		ssize_t read_buf_fill;
+
+		LOCK (s->buf_mtx);
+		while (fifo_buf_get_space(s->buf) == 0 && !s->stop_read_thread) {
+			debug ("The buffer is full, waiting.");
+			pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
+			debug ("Some space in the buffer was freed");
+		}
+		UNLOCK (s->buf_mtx);
+
+		if (s->stop_read_thread)
+			break;
 
 		LOCK (s->io_mtx);
 		debug ("Reading...");
 
+		/* Only this thread adds data, so the free space can only grow
+		 * until the region is committed.  If the buffer is cleared by
+		 * a seek in the meantime, after_seek tells us to drop it. */
 		LOCK (s->buf_mtx);
 		s->after_seek = 0;
+		read_buf = fifo_buf_reserve (s->buf, &read_buf_size);
 		UNLOCK (s->buf_mtx);
 
-		read_buf_fill = io_internal_read (s, 0, read_buf, sizeof(read_buf));
+		read_buf_fill = io_internal_read (s, 0, read_buf,
+				MIN(read_buf_size, IO_READ_CHUNK));
 		UNLOCK (s->io_mtx);
-		debug ("Read %d bytes", read_buf_fill);
+		debug ("Read %zd bytes", read_buf_fill);
 
 		LOCK (s->buf_mtx);
 
@@ -401,36 +422,18 @@ static void *io_read_thread (void *data)
 
 		s->eof = 0;
 
-		while (read_buf_pos < read_buf_fill && !s->after_seek) {
-			size_t put;
-
-			debug ("Buffer fill: %zu", fifo_buf_get_fill (s->buf));
-
-			put = fifo_buf_put (s->buf,
-					read_buf + read_buf_pos,
-					read_buf_fill - read_buf_pos);
-
-			if (s->stop_read_thread)
-				break;
-
-			if (put > 0) {
-				debug ("Put %zu bytes into the buffer", put);
-				if (s->buf_fill_callback) {
-					UNLOCK (s->buf_mtx);
-					s->buf_fill_callback (s,
-						fifo_buf_get_fill (s->buf),
-						fifo_buf_get_size (s->buf),
-						s->buf_fill_callback_data);
-					LOCK (s->buf_mtx);
-				}
-				pthread_cond_broadcast (&s->buf_fill_cond);
-				read_buf_pos += put;
-			}
-			else {
-				debug ("The buffer is full, waiting.");
-				pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
-				debug ("Some space in the buffer was freed");
+		if (!s->after_seek) {
+			fifo_buf_commit (s->buf, read_buf_fill);
+			debug ("Put %zd bytes into the buffer", read_buf_fill);
+			if (s->buf_fill_callback) {
+				UNLOCK (s->buf_mtx);
+				s->buf_fill_callback (s,
+					fifo_buf_get_fill (s->buf),
+					fifo_buf_get_size (s->buf),
+					s->buf_fill_callback_data);
+				LOCK (s->buf_mtx);
 			}
+			pthread_cond_broadcast (&s->buf_fill_cond);
 		}
 
 		UNLOCK (s->buf_mtx);
@@ -0,0 +1,707 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Index of the sound files in the music directory, searchable by the
+ * file name and the tags.
+ *
+ * The index is built in a separate thread from a scan of the directory
+ * and the tags cache, and replaced as a whole when it is rebuilt.  Records
+ * are stored column by column: the strings are kept in one pool and the
+ * records refer to them by offset (artists and albums only once).  For
+ * searching, every three characters long substring (trigram) of the
+ * fields is hashed into one of LIBRARY_BUCKETS buckets, and each bucket
+ * has the sorted list of the records containing such a trigram.  A query
+ * only has to check the records present in the lists of all the trigrams
+ * of its words. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "compat.h"
+#include "log.h"
+#include "playlist.h"
+#include "files.h"
+#include "rbtree.h"
+#include "lists.h"
+#include "tags_cache.h"
+#include "library.h"
+
+/* Number of trigram hash buckets. */
+#define LIBRARY_BUCKETS	65536
+
+/* Offset of the empty string in the pool, used for missing tags. */
+#define NO_STRING	0
+
+enum library_field
+{
+	FIELD_PATH,
+	FIELD_ARTIST,
+	FIELD_ALBUM,
+	FIELD_TITLE,
+	FIELDS
+};
+
+struct library_index
+{
+	char *music_dir;		/* paths are relative to this */
+	int nrecords;
+	int allocated;
+
+	/* Columns. */
+	uint32_t *field[FIELDS];	/* offsets in the string pool */
+	int *track;
+	int *time;
+
+	/* String pool. */
+	char *strings;
+	size_t strings_len;
+	size_t strings_allocated;
+
+	/* Records for each trigram bucket. */
+	uint32_t *bucket_start;		/* LIBRARY_BUCKETS + 1 entries */
+	uint32_t *postings;
+};
+
+struct library
+{
+	pthread_mutex_t mutex;
+	struct library_index *index;
+	struct tags_cache *tags_cache;
+	pthread_t build_thread;
+	int building;		/* the build thread is running */
+	int joined;		/* the last build thread was joined */
+	int stop;		/* ask the build thread to stop */
+	char *music_dir;
+};
+
+/* An interned string in the pool, used while building. */
+struct pooled_str
+{
+	const struct library_index *index;
+	uint32_t offset;
+};
+
+static int pooled_compare (const void *a, const void *b,
+                           const void *unused ATTR_UNUSED)
+{
+	const struct pooled_str *pa = (const struct pooled_str *)a;
+	const struct pooled_str *pb = (const struct pooled_str *)b;
+
+	return strcmp (pa->index->strings + pa->offset,
+	               pb->index->strings + pb->offset);
+}
+
+static int pooled_compare_key (const void *key, const void *data,
+                               const void *unused ATTR_UNUSED)
+{
+	const char *str = (const char *)key;
+	const struct pooled_str *p = (const struct pooled_str *)data;
+
+	return strcmp (str, p->index->strings + p->offset);
+}
+
+static struct library_index *index_new (const char *music_dir)
+{
+	struct library_index *index;
+	size_t len;
+	int i;
+
+	len = strlen (music_dir);
+	while (len > 0 && music_dir[len - 1] == '/')
+		len--;
+
+	index = (struct library_index *)xcalloc (1,
+			sizeof (struct library_index));
+
+	/* Without the trailing slash, so paths are joined with a single one
+	 * (the root directory becomes ""). */
+	index->music_dir = (char *)xmalloc (len + 1);
+	memcpy (index->music_dir, music_dir, len);
+	index->music_dir[len] = '\0';
+	index->allocated = 1024;
+	for (i = 0; i < FIELDS; i++)
+		index->field[i] = (uint32_t *)xmalloc (index->allocated
+				* sizeof (uint32_t));
+	index->track = (int *)xmalloc (index->allocated * sizeof (int));
+	index->time = (int *)xmalloc (index->allocated * sizeof (int));
+
+	index->strings_allocated = 64 * 1024;
+	index->strings = (char *)xmalloc (index->strings_allocated);
+	index->strings[NO_STRING] = 0;
+	index->strings_len = 1;
+
+	return index;
+}
+
+static void index_free (struct library_index *index)
+{
+	int i;
+
+	if (!index)
+		return;
+
+	free (index->music_dir);
+	for (i = 0; i < FIELDS; i++)
+		free (index->field[i]);
+	free (index->track);
+	free (index->time);
+	free (index->strings);
+	free (index->bucket_start);
+	free (index->postings);
+	free (index);
+}
+
+static uint32_t pool_add (struct library_index *index, const char *str)
+{
+	size_t len;
+	uint32_t offset;
+
+	if (!str || !str[0])
+		return NO_STRING;
+
+	len = strlen (str) + 1;
+	if (index->strings_len + len > index->strings_allocated) {
+		while (index->strings_len + len > index->strings_allocated)
+			index->strings_allocated *= 2;
+		index->strings = (char *)xrealloc (index->strings,
+				index->strings_allocated);
+	}
+
+	offset = index->strings_len;
+	memcpy (index->strings + offset, str, len);
+	index->strings_len += len;
+
+	return offset;
+}
+
+/* Add the string to the pool only if an equal one is not already there. */
+static uint32_t pool_add_shared (struct library_index *index,
+		struct rb_tree *shared, const char *str)
+{
+	struct rb_node *x;
+	struct pooled_str *p;
+
+	if (!str || !str[0])
+		return NO_STRING;
+
+	x = rb_search (shared, str);
+	if (!rb_is_null (x))
+		return ((const struct pooled_str *)rb_get_data (x))->offset;
+
+	p = (struct pooled_str *)xmalloc (sizeof (struct pooled_str));
+	p->index = index;
+	p->offset = pool_add (index, str);
+	rb_insert (shared, p);
+
+	return p->offset;
+}
+
+static void index_add (struct library_index *index, struct rb_tree *shared,
+		const char *file, const struct file_tags *tags)
+{
+	int n = index->nrecords;
+	size_t len = strlen (index->music_dir);
+
+	/* Store the path relative to the music directory. */
+	if (!strncmp (file, index->music_dir, len)) {
+		file += len;
+		while (*file == '/')
+			file++;
+	}
+
+	if (n == index->allocated) {
+		int i;
+
+		index->allocated *= 2;
+		for (i = 0; i < FIELDS; i++)
+			index->field[i] = (uint32_t *)xrealloc (index->field[i],
+					index->allocated * sizeof (uint32_t));
+		index->track = (int *)xrealloc (index->track,
+				index->allocated * sizeof (int));
+		index->time = (int *)xrealloc (index->time,
+				index->allocated * sizeof (int));
+	}
+
+	index->field[FIELD_PATH][n] = pool_add (index, file);
+	index->field[FIELD_ARTIST][n] = pool_add_shared (index, shared,
+			tags->artist);
+	index->field[FIELD_ALBUM][n] = pool_add_shared (index, shared,
+			tags->album);
+	index->field[FIELD_TITLE][n] = pool_add (index, tags->title);
+	index->track[n] = tags->track;
+	index->time[n] = tags->time;
+	index->nrecords += 1;
+}
+
+static inline const char *index_field (const struct library_index *index,
+		const int field, const int rec)
+{
+	return index->strings + index->field[field][rec];
+}
+
+static inline uint32_t trigram_bucket (const char *s)
+{
+	uint32_t h;
+
+	h = (uint32_t)tolower ((unsigned char)s[0]) * 0x10001u;
+	h ^= (uint32_t)tolower ((unsigned char)s[1]) * 0x9e3779b1u;
+	h ^= (uint32_t)tolower ((unsigned char)s[2]) * 0x85ebca77u;
+	h ^= h >> 15;
+
+	return h % LIBRARY_BUCKETS;
+}
+
+static int uint32_compare (const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+/* Put the distinct trigram buckets of the string into the array,
+ * return their number. */
+static int string_buckets (const char *str, uint32_t **buckets,
+		int *allocated)
+{
+	size_t len, i;
+	int n = 0, unique = 0;
+
+	len = strlen (str);
+	if (len < 3)
+		return 0;
+
+	if ((int)len > *allocated) {
+		*allocated = len;
+		*buckets = (uint32_t *)xrealloc (*buckets,
+				*allocated * sizeof (uint32_t));
+	}
+
+	for (i = 0; i + 2 < len; i++)
+		(*buckets)[n++] = trigram_bucket (str + i);
+
+	qsort (*buckets, n, sizeof (uint32_t), uint32_compare);
+	for (i = 0; i < (size_t)n; i++)
+		if (i == 0 || (*buckets)[i] != (*buckets)[unique - 1])
+			(*buckets)[unique++] = (*buckets)[i];
+
+	return unique;
+}
+
+/* Like string_buckets(), but for all fields of the record. */
+static int record_buckets (const struct library_index *index, const int rec,
+		uint32_t **buckets, int *allocated)
+{
+	size_t len = 0;
+	char *text, *p;
+	int field, n;
+
+	for (field = 0; field < FIELDS; field++)
+		len += strlen (index_field (index, field, rec)) + 1;
+
+	/* Join the fields with a separator no query word contains, so
+	 * trigrams spanning two fields never match. */
+	text = p = (char *)xmalloc (len);
+	for (field = 0; field < FIELDS; field++) {
+		const char *s = index_field (index, field, rec);
+		size_t l = strlen (s);
+
+		memcpy (p, s, l);
+		p[l] = '\n';
+		p += l + 1;
+	}
+	p[-1] = 0;
+
+	n = string_buckets (text, buckets, allocated);
+	free (text);
+
+	return n;
+}
+
+static void index_build_postings (struct library_index *index)
+{
+	uint32_t *buckets = NULL;
+	uint32_t *fill;
+	int allocated = 0;
+	int rec, i;
+
+	index->bucket_start = (uint32_t *)xcalloc (LIBRARY_BUCKETS + 1,
+			sizeof (uint32_t));
+
+	for (rec = 0; rec < index->nrecords; rec++) {
+		int n = record_buckets (index, rec, &buckets, &allocated);
+
+		for (i = 0; i < n; i++)
+			index->bucket_start[buckets[i] + 1] += 1;
+	}
+
+	for (i = 0; i < LIBRARY_BUCKETS; i++)
+		index->bucket_start[i + 1] += index->bucket_start[i];
+
+	index->postings = (uint32_t *)xmalloc (
+			MAX(index->bucket_start[LIBRARY_BUCKETS], 1)
+			* sizeof (uint32_t));
+	fill = (uint32_t *)xmalloc (LIBRARY_BUCKETS * sizeof (uint32_t));
+	memcpy (fill, index->bucket_start, LIBRARY_BUCKETS * sizeof (uint32_t));
+
+	for (rec = 0; rec < index->nrecords; rec++) {
+		int n = record_buckets (index, rec, &buckets, &allocated);
+
+		for (i = 0; i < n; i++)
+			index->postings[fill[buckets[i]]++] = rec;
+	}
+
+	free (fill);
+	free (buckets);
+}
+
+static void pooled_free_all (struct rb_tree *shared)
+{
+	struct rb_node *x;
+
+	for (x = rb_min (shared); !rb_is_null (x); x = rb_next (x))
+		free ((void *)rb_get_data (x));
+}
+
+/* Tell the directory scan to give up when library_free() is waiting. */
+static int build_stopped (void *arg)
+{
+	struct library *lib = (struct library *)arg;
+	int stop;
+
+	LOCK (lib->mutex);
+	stop = lib->stop;
+	UNLOCK (lib->mutex);
+
+	return stop;
+}
+
+/* Build the index of the sound files in the directory.  Return NULL if
+ * we were asked to stop. */
+static struct library_index *index_build (struct library *lib,
+		const char *music_dir)
+{
+	struct library_index *index;
+	struct rb_tree *shared;
+	struct plist plist;
+	int i, stop = 0;
+
+	plist_init (&plist);
+	read_directory_recurr_stop (music_dir, &plist, build_stopped, lib);
+	if (build_stopped (lib)) {
+		plist_free (&plist);
+		return NULL;
+	}
+	plist_sort_fname (&plist);
+
+	index = index_new (music_dir);
+	shared = rb_tree_new (pooled_compare, pooled_compare_key, NULL);
+
+	for (i = 0; i < plist.num && !stop; i++) {
+		struct file_tags *tags;
+
+		if (plist_deleted (&plist, i))
+			continue;
+
+		if ((stop = build_stopped (lib)))
+			break;
+
+		tags = tags_cache_get_uncached (lib->tags_cache,
+				plist.items[i].file, TAGS_COMMENTS | TAGS_TIME);
+		index_add (index, shared, plist.items[i].file, tags);
+		tags_free (tags);
+	}
+
+	pooled_free_all (shared);
+	rb_tree_free (shared);
+	plist_free (&plist);
+
+	if (stop) {
+		index_free (index);
+		return NULL;
+	}
+
+	index_build_postings (index);
+
+	return index;
+}
+
+static void *build_thread (void *arg)
+{
+	struct library *lib = (struct library *)arg;
+	struct library_index *index, *old = NULL;
+
+	logit ("Indexing %s", lib->music_dir);
+
+	index = index_build (lib, lib->music_dir);
+
+	LOCK (lib->mutex);
+	if (index) {
+		old = lib->index;
+		lib->index = index;
+		logit ("Library indexed: %d files", index->nrecords);
+	}
+	lib->building = 0;
+	UNLOCK (lib->mutex);
+
+	index_free (old);
+
+	return NULL;
+}
+
+struct library *library_new (struct tags_cache *tags_cache)
+{
+	struct library *lib;
+
+	assert (tags_cache != NULL);
+
+	lib = (struct library *)xmalloc (sizeof (struct library));
+	pthread_mutex_init (&lib->mutex, NULL);
+	lib->index = NULL;
+	lib->tags_cache = tags_cache;
+	lib->building = 0;
+	lib->joined = 1;
+	lib->stop = 0;
+	lib->music_dir = NULL;
+
+	return lib;
+}
+
+static void library_join (struct library *lib)
+{
+	if (!lib->joined) {
+		pthread_join (lib->build_thread, NULL);
+		lib->joined = 1;
+	}
+}
+
+void library_free (struct library *lib)
+{
+	assert (lib != NULL);
+
+	LOCK (lib->mutex);
+	lib->stop = 1;
+	UNLOCK (lib->mutex);
+
+	library_join (lib);
+
+	index_free (lib->index);
+	free (lib->music_dir);
+	pthread_mutex_destroy (&lib->mutex);
+	free (lib);
+}
+
+/* Start indexing the directory in the background unless it is already
+ * being done. */
+void library_update (struct library *lib, const char *music_dir)
+{
+	int rc;
+
+	assert (lib != NULL);
+	assert (music_dir != NULL);
+
+	LOCK (lib->mutex);
+	if (lib->building) {
+		UNLOCK (lib->mutex);
+		logit ("Library is already being indexed");
+		return;
+	}
+	UNLOCK (lib->mutex);
+
+	library_join (lib);
+
+	LOCK (lib->mutex);
+	free (lib->music_dir);
+	lib->music_dir = xstrdup (music_dir);
+	lib->building = 1;
+	lib->stop = 0;
+	UNLOCK (lib->mutex);
+
+	rc = pthread_create (&lib->build_thread, NULL, build_thread, lib);
+	if (rc != 0) {
+		error ("Can't create library indexing thread: %s", strerror (rc));
+		LOCK (lib->mutex);
+		lib->building = 0;
+		UNLOCK (lib->mutex);
+		return;
+	}
+	lib->joined = 0;
+}
+
+int library_state (struct library *lib)
+{
+	int state;
+
+	assert (lib != NULL);
+
+	LOCK (lib->mutex);
+	if (lib->building)
+		state = LIBRARY_BUILDING;
+	else if (lib->index)
+		state = LIBRARY_READY;
+	else
+		state = LIBRARY_EMPTY;
+	UNLOCK (lib->mutex);
+
+	return state;
+}
+
+/* Intersect the sorted list of records with the bucket's list,
+ * return the new size of the list. */
+static int intersect_bucket (const struct library_index *index,
+		uint32_t *recs, int nrecs, const uint32_t bucket)
+{
+	const uint32_t *p = index->postings + index->bucket_start[bucket];
+	const uint32_t *end = index->postings + index->bucket_start[bucket + 1];
+	int i, n = 0;
+
+	for (i = 0; i < nrecs && p < end; ) {
+		if (recs[i] < *p)
+			i++;
+		else if (recs[i] > *p)
+			p++;
+		else {
+			recs[n++] = recs[i++];
+			p++;
+		}
+	}
+
+	return n;
+}
+
+/* Return non-zero if every word is found in some field of the record. */
+static int record_matches (const struct library_index *index, const int rec,
+		const lists_t_strs *words)
+{
+	int w, field;
+
+	for (w = 0; w < lists_strs_size (words); w++) {
+		const char *word = lists_strs_at (words, w);
+
+		for (field = 0; field < FIELDS; field++)
+			if (strcasestr (index_field (index, field, rec), word))
+				break;
+		if (field == FIELDS)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void add_result (const struct library_index *index, const int rec,
+		struct plist *results)
+{
+	struct file_tags *tags;
+	char *file;
+	int num;
+
+	file = (char *)xmalloc (strlen (index->music_dir)
+			+ strlen (index_field (index, FIELD_PATH, rec)) + 2);
+	sprintf (file, "%s/%s", index->music_dir,
+			index_field (index, FIELD_PATH, rec));
+	num = plist_add (results, file);
+	free (file);
+
+	tags = tags_new ();
+	if (index->field[FIELD_ARTIST][rec] != NO_STRING)
+		tags->artist = xstrdup (index_field (index, FIELD_ARTIST, rec));
+	if (index->field[FIELD_ALBUM][rec] != NO_STRING)
+		tags->album = xstrdup (index_field (index, FIELD_ALBUM, rec));
+	if (index->field[FIELD_TITLE][rec] != NO_STRING)
+		tags->title = xstrdup (index_field (index, FIELD_TITLE, rec));
+	tags->track = index->track[rec];
+	tags->time = index->time[rec];
+	tags->filled = TAGS_COMMENTS | TAGS_TIME;
+
+	plist_set_tags (results, num, tags);
+	tags_free (tags);
+}
+
+/* Search the library for files whose path or tags contain all the words
+ * of the pattern, ignoring case.  Add at most max of them to the results
+ * (all if max is 0).  Return the state of the library. */
+int library_query (struct library *lib, const char *pattern, const int max,
+                   struct plist *results)
+{
+	lists_t_strs *words, *all;
+	struct library_index *index;
+	uint32_t *recs, *buckets = NULL;
+	int allocated = 0;
+	int nrecs, i, w, found, state;
+
+	assert (lib != NULL);
+	assert (pattern != NULL);
+	assert (results != NULL);
+
+	all = lists_strs_new (4);
+	lists_strs_tokenise (all, pattern);
+	words = lists_strs_new (lists_strs_size (all));
+	for (i = 0; i < lists_strs_size (all); i++)
+		if (lists_strs_at (all, i)[0])
+			lists_strs_append (words, lists_strs_at (all, i));
+	lists_strs_free (all);
+
+	LOCK (lib->mutex);
+
+	state = lib->building ? LIBRARY_BUILDING : LIBRARY_READY;
+	if (!(index = lib->index)) {
+		if (!lib->building)
+			state = LIBRARY_EMPTY;
+		UNLOCK (lib->mutex);
+		lists_strs_free (words);
+		return state;
+	}
+
+	nrecs = index->nrecords;
+	recs = (uint32_t *)xmalloc (MAX(nrecs, 1) * sizeof (uint32_t));
+	for (i = 0; i < nrecs; i++)
+		recs[i] = i;
+
+	for (w = 0; w < lists_strs_size (words) && nrecs > 0; w++) {
+		int n = string_buckets (lists_strs_at (words, w), &buckets,
+				&allocated);
+
+		for (i = 0; i < n && nrecs > 0; i++)
+			nrecs = intersect_bucket (index, recs, nrecs, buckets[i]);
+	}
+
+	found = 0;
+	for (i = 0; i < nrecs && (max == 0 || found < max); i++) {
+		if (record_matches (index, recs[i], words)) {
+			add_result (index, recs[i], results);
+			found += 1;
+		}
+	}
+
+	UNLOCK (lib->mutex);
+
+	debug ("Library query '%s': %d candidates, %d results", pattern,
+			nrecs, found);
+
+	free (recs);
+	free (buckets);
+	lists_strs_free (words);
+
+	return state;
+}
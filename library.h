@@ -0,0 +1,28 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* State of the library sent in response to CMD_LIBRARY_QUERY. */
+#define LIBRARY_EMPTY		0	/* not indexed yet */
+#define LIBRARY_BUILDING	1	/* being indexed */
+#define LIBRARY_READY		2
+
+struct plist;
+struct tags_cache;
+struct library;
+
+struct library *library_new (struct tags_cache *tags_cache);
+void library_free (struct library *lib);
+void library_update (struct library *lib, const char *music_dir);
+int library_state (struct library *lib);
+int library_query (struct library *lib, const char *pattern, const int max,
+                   struct plist *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -92,6 +92,8 @@ struct parameters
 	char *toggle;
 	char *on;
 	char *off;
+	char *find_pattern;
+	int update_library;
 };
 
 /* Connect to the server, return fd of the socket or -1 on error. */
@@ -283,6 +285,10 @@ static void server_command (struct parameters *params, lists_t_strs *args)
 		interface_cmdline_set (sock, params->on, 1);
 	if (params->off)
 		interface_cmdline_set (sock, params->off, 0);
+	if (params->update_library)
+		interface_cmdline_update_library (sock);
+	if (params->find_pattern)
+		interface_cmdline_find (sock, params->find_pattern);
 	if (params->exit) {
 		if (!send_int(sock, CMD_QUIT))
 			fatal ("Can't send command!");
@@ -571,6 +577,11 @@ static struct poptOption server_opts[] = {
 			"Print information about the file currently playing", NULL},
 	{"format", 'Q', POPT_ARG_STRING, &params.formatted_info_param, CL_GETINFO,
 			"Print formatted information about the file currently playing", "FORMAT"},
+	{"find", 0, POPT_ARG_STRING, &params.find_pattern, CL_NOIFACE,
+			"Print files in MusicDir whose name or tags contain all "
+			"the words", "WORDS"},
+	{"update-library", 0, POPT_ARG_NONE, &params.update_library, CL_NOIFACE,
+			"Index MusicDir again for --find", NULL},
 	POPT_TABLEEND
 };
 
@@ -543,15 +543,109 @@ void menu_unmark_item (struct menu *menu)
 	menu->marked = NULL;
 }
 
-/* Make a new menu from elements matching pattern. */
-struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern)
+/* Items of a menu containing a pattern, kept as pointers to the menu's
+ * items.  Each entry of the stack holds the matches for a longer pattern
+ * than the one below it, and these are searched only among the matches
+ * below. */
+struct menu_matches
 {
-	struct menu *new;
-	const struct menu_item *mi;
+	char *pattern;
+	const struct menu_item **items;
+	int nitems;
+	struct menu_matches *prev;	/* matches of a prefix of the pattern */
+};
+
+/* Remove the top of the stack, return the new top. */
+struct menu_matches *menu_matches_pop (struct menu_matches *matches)
+{
+	struct menu_matches *prev;
+
+	assert (matches != NULL);
+
+	prev = matches->prev;
+	free (matches->pattern);
+	free (matches->items);
+	free (matches);
+
+	return prev;
+}
+
+void menu_matches_free (struct menu_matches *matches)
+{
+	while (matches)
+		matches = menu_matches_pop (matches);
+}
+
+const char *menu_matches_pattern (const struct menu_matches *matches)
+{
+	assert (matches != NULL);
+
+	return matches->pattern;
+}
+
+int menu_matches_count (const struct menu_matches *matches)
+{
+	assert (matches != NULL);
+
+	return matches->nitems;
+}
+
+/* Find the items of the menu containing the pattern and put them on top
+ * of the stack of matches (which may be NULL).  Matches of patterns which
+ * are not a prefix of this one are dropped first, and the search is done
+ * among the matches of the longest prefix left.  Return the new top of the
+ * stack. */
+struct menu_matches *menu_matches_push (const struct menu *menu,
+		struct menu_matches *matches, const char *pattern)
+{
+	struct menu_matches *new;
+	int i;
 
 	assert (menu != NULL);
 	assert (pattern != NULL);
 
+	while (matches && strncmp (matches->pattern, pattern,
+				strlen (matches->pattern)))
+		matches = menu_matches_pop (matches);
+
+	if (matches && !strcmp (matches->pattern, pattern))
+		return matches;
+
+	new = (struct menu_matches *)xmalloc (sizeof (struct menu_matches));
+	new->pattern = xstrdup (pattern);
+	new->nitems = 0;
+	new->prev = matches;
+
+	if (matches) {
+		new->items = (const struct menu_item **)xmalloc (
+				MAX(matches->nitems, 1) * sizeof (struct menu_item *));
+		for (i = 0; i < matches->nitems; i++)
+			if (strcasestr (matches->items[i]->title, pattern))
+				new->items[new->nitems++] = matches->items[i];
+	}
+	else {
+		const struct menu_item *mi;
+
+		new->items = (const struct menu_item **)xmalloc (
+				MAX(menu->nitems, 1) * sizeof (struct menu_item *));
+		for (mi = menu->items; mi; mi = mi->next)
+			if (strcasestr (mi->title, pattern))
+				new->items[new->nitems++] = mi;
+	}
+
+	return new;
+}
+
+/* Make a new menu from the matching items of the menu. */
+struct menu *menu_filter_matches (const struct menu *menu,
+		const struct menu_matches *matches)
+{
+	struct menu *new;
+	int i;
+
+	assert (menu != NULL);
+	assert (matches != NULL);
+
 	new = menu_new (menu->win, menu->posx, menu->posy, menu->width,
 			menu->height);
 	menu_set_show_time (new, menu->show_time);
@@ -561,9 +655,8 @@ struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern)
 	menu_set_info_attr_marked (new, menu->info_attr_marked);
 	menu_set_info_attr_sel_marked (new, menu->info_attr_sel_marked);
 
-	for (mi = menu->items; mi; mi = mi->next)
-		if (strcasestr(mi->title, pattern))
-			menu_add_from_item (new, mi);
+	for (i = 0; i < matches->nitems; i++)
+		menu_add_from_item (new, matches->items[i]);
 
 	if (menu->marked)
 		menu_mark_item (new, menu->marked->file);
@@ -813,6 +906,21 @@ int menu_is_visible (const struct menu *menu, const struct menu_item *mi)
 	return 0;
 }
 
+/* Add the sound files in the visible part of the menu to the list. */
+void menu_get_visible_files (const struct menu *menu, lists_t_strs *files)
+{
+	struct menu_item *mi;
+	int i;
+
+	assert (menu != NULL);
+	assert (files != NULL);
+
+	for (mi = menu->top, i = 0; mi && i < menu->height; mi = mi->next, i++) {
+		if (mi->type == F_SOUND)
+			lists_strs_append (files, mi->file);
+	}
+}
+
 static void menu_items_swap (struct menu *menu, struct menu_item *mi1,
 		struct menu_item *mi2)
 {
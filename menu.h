@@ -102,6 +102,9 @@ struct menu_state
 	int selected_item;
 };
 
+/* Items matching a search pattern, see menu_matches_push(). */
+struct menu_matches;
+
 struct menu *menu_new (WINDOW *win, const int posx, const int posy,
 		const int width, const int height);
 struct menu_item *menu_add (struct menu *menu, const char *title,
@@ -127,7 +130,14 @@ void menu_get_state (const struct menu *menu, struct menu_state *st);
 void menu_update_size (struct menu *menu, const int posx, const int posy,
 		const int width, const int height);
 void menu_unmark_item (struct menu *menu);
-struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern);
+struct menu_matches *menu_matches_push (const struct menu *menu,
+		struct menu_matches *matches, const char *pattern);
+struct menu_matches *menu_matches_pop (struct menu_matches *matches);
+void menu_matches_free (struct menu_matches *matches);
+const char *menu_matches_pattern (const struct menu_matches *matches);
+int menu_matches_count (const struct menu_matches *matches);
+struct menu *menu_filter_matches (const struct menu *menu,
+		const struct menu_matches *matches);
 void menu_set_show_time (struct menu *menu, const int t);
 void menu_set_show_format (struct menu *menu, const bool t);
 void menu_set_info_attr_normal (struct menu *menu, const int attr);
@@ -144,6 +154,7 @@ struct menu_item *menu_find (struct menu *menu, const char *fname);
 void menu_del_item (struct menu *menu, const char *fname);
 void menu_item_set_align (struct menu_item *mi, const enum menu_align align);
 int menu_is_visible (const struct menu *menu, const struct menu_item *mi);
+void menu_get_visible_files (const struct menu *menu, lists_t_strs *files);
 void menu_swap_items (struct menu *menu, const char *file1, const char *file2);
 void menu_make_visible (struct menu *menu, const char *file);
 void menu_set_cursor (const struct menu *m);
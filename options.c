@@ -663,8 +663,10 @@ void options_init ()
 	                                  "SincFastest", "ZeroOrderHold", "Linear");
 	add_int  ("ForceSampleRate", 0, CHECK_RANGE(1), 0, 500000);
 	add_bool ("Allow24bitOutput", false);
+	add_bool ("FloatPipeline", false);
 	add_bool ("UseRealtimePriority", false);
 	add_int  ("TagsCacheSize", 256, CHECK_RANGE(1), 0, INT_MAX);
+	add_int  ("TagsReaderThreads", 0, CHECK_RANGE(1), 0, 32);
 	add_bool ("PlaylistNumbering", true);
 
 	add_list ("Layout1", "directory(0,0,50%,100%):playlist(50%,0,FILL,100%)",
@@ -34,13 +34,20 @@
 #include "common.h"
 #include "audio.h"
 #include "log.h"
-#include "fifo_buf.h"
+#include "ring_buf.h"
 #include "out_buf.h"
 #include "options.h"
 
+/* The sound data goes through a lock-free ring buffer: out_buf_put() is
+ * the only writer and the reading thread the only reader.  The mutex only
+ * protects the state flags and is used with the conditions to sleep when
+ * the buffer is empty or full; the reading thread plays straight from the
+ * ring buffer without holding it. */
 struct out_buf
 {
-	struct fifo_buf *buf;
+	struct ring_buf *buf;
+	char *play_buf;	/* Copy of the data when a frame wraps around the
+			   end of buf. */
 	pthread_mutex_t	mutex;
 	pthread_t tid;	/* Thread id of the reading thread. */
 
@@ -64,6 +71,7 @@ struct out_buf
 	int hardware_buf_fill;	/* How the sound card buffer is filled. */
 
 	int read_thread_waiting; /* Is the read thread waiting for data? */
+	int ready_waiters;	/* Number of threads waiting on ready_cond. */
 };
 
 /* Don't play more than this value (in seconds) in one audio_play().
@@ -108,9 +116,11 @@ static void *read_thread (void *arg)
 
 	while (1) {
 		int played = 0;
-		char play_buf[AUDIO_MAX_PLAY_BYTES];
-		int play_buf_fill;
-		int play_buf_pos = 0;
+		char *play_buf;
+		size_t play_buf_fill;
+		const char *play_data;
+		size_t play_size;
+		size_t play_pos = 0;
 
 		if (buf->reset_dev && !audio_dev_closed) {
 			audio_reset ();
@@ -118,7 +128,7 @@ static void *read_thread (void *arg)
 		}
 
 		if (buf->stop)
-			fifo_buf_clear (buf->buf);
+			ring_buf_clear (buf->buf);
 
 		if (buf->free_callback) {
 			/* unlock the mutex to make calls to out_buf functions
@@ -128,10 +138,12 @@ static void *read_thread (void *arg)
 			LOCK (buf->mutex);
 		}
 
-		debug ("sending the signal");
-		pthread_cond_broadcast (&buf->ready_cond);
+		if (buf->ready_waiters) {
+			debug ("sending the signal");
+			pthread_cond_broadcast (&buf->ready_cond);
+		}
 
-		if ((fifo_buf_get_fill(buf->buf) == 0 || buf->pause || buf->stop)
+		if ((ring_buf_get_fill(buf->buf) == 0 || buf->pause || buf->stop)
 				&& !buf->exit) {
 			if (buf->pause && !audio_dev_closed) {
 				logit ("Closing the device due to pause");
@@ -157,7 +169,7 @@ static void *read_thread (void *arg)
 				audio_dev_closed = 0;
 		}
 
-		if (fifo_buf_get_fill(buf->buf) == 0) {
+		if (ring_buf_get_fill(buf->buf) == 0) {
 			if (buf->exit) {
 				logit ("exit");
 				break;
@@ -181,34 +193,54 @@ static void *read_thread (void *arg)
 			int audio_bpf;
 			size_t play_buf_frames;
 
-			audio_bpf = audio_get_bpf();
-			play_buf_frames = MIN(audio_get_bps() * AUDIO_MAX_PLAY,
+			audio_bpf = audio_get_pcm_bpf();
+			play_buf_frames = MIN(audio_get_pcm_bps() * AUDIO_MAX_PLAY,
 			                      AUDIO_MAX_PLAY_BYTES) / audio_bpf;
-			play_buf_fill = fifo_buf_get(buf->buf, play_buf,
-			                             play_buf_frames * audio_bpf);
 			UNLOCK (buf->mutex);
 
-			debug ("playing %d bytes", play_buf_fill);
+			/* Play whole frames directly from the buffer, unless
+			 * there is not even one before its end. */
+			play_buf = ring_buf_read_region (buf->buf, &play_buf_fill);
+			play_buf_fill = MIN(play_buf_fill,
+			                    play_buf_frames * audio_bpf);
+			play_buf_fill -= play_buf_fill % audio_bpf;
+			if (play_buf_fill == 0) {
+				play_buf_fill = MIN(ring_buf_get_fill(buf->buf),
+				                    play_buf_frames * audio_bpf);
+				if (play_buf_fill >= (size_t)audio_bpf)
+					play_buf_fill -= play_buf_fill % audio_bpf;
+				play_buf = buf->play_buf;
+				play_buf_fill = ring_buf_get (buf->buf, play_buf,
+				                              play_buf_fill);
+			}
+
+			play_data = audio_process_pcm (play_buf, play_buf_fill,
+					&play_size);
 
-			while (play_buf_pos < play_buf_fill) {
-				played = audio_send_pcm (
-						play_buf + play_buf_pos,
-						play_buf_fill - play_buf_pos);
+			debug ("playing %zu bytes", play_size);
+
+			while (play_pos < play_size) {
+				played = audio_send_pcm (play_data + play_pos,
+						play_size - play_pos);
 
 #ifdef OUT_TEST
-				write (fd, play_buf + play_buf_pos, played);
+				write (fd, play_data + play_pos, played);
 #endif
 
-				play_buf_pos += played;
+				play_pos += played;
 			}
 
+			if (play_buf != buf->play_buf)
+				ring_buf_consume (buf->buf, play_buf_fill);
+
 			/*logit ("done sending PCM");*/
 
 			LOCK (buf->mutex);
 
 			/* Update time */
-			if (play_buf_fill && audio_get_bps())
-				buf->time += play_buf_fill / (float)audio_get_bps();
+			if (play_buf_fill && audio_get_pcm_bps())
+				buf->time += play_buf_fill
+					/ (float)audio_get_pcm_bps();
 			buf->hardware_buf_fill = audio_get_buf_fill();
 		}
 	}
@@ -230,7 +262,8 @@ struct out_buf *out_buf_new (int size)
 
 	buf = xmalloc (sizeof (struct out_buf));
 
-	buf->buf = fifo_buf_new (size);
+	buf->buf = ring_buf_new (size);
+	buf->play_buf = xmalloc (AUDIO_MAX_PLAY_BYTES);
 	buf->exit = 0;
 	buf->pause = 0;
 	buf->stop = 0;
@@ -238,6 +271,7 @@ struct out_buf *out_buf_new (int size)
 	buf->reset_dev = 0;
 	buf->hardware_buf_fill = 0;
 	buf->read_thread_waiting = 0;
+	buf->ready_waiters = 0;
 	buf->free_callback = NULL;
 
 	pthread_mutex_init (&buf->mutex, NULL);
@@ -273,12 +307,13 @@ void out_buf_free (struct out_buf *buf)
 	/* Let other threads using this buffer know that the state of the
 	 * buffer has changed. */
 	LOCK (buf->mutex);
-	fifo_buf_clear (buf->buf);
+	ring_buf_clear (buf->buf);
 	pthread_cond_broadcast (&buf->ready_cond);
 	UNLOCK (buf->mutex);
 
-	fifo_buf_free (buf->buf);
+	ring_buf_free (buf->buf);
 	buf->buf = NULL;
+	free (buf->play_buf);
 	rc = pthread_mutex_destroy (&buf->mutex);
 	if (rc != 0)
 		logit ("Destroying buffer mutex failed: %s", strerror (rc));
@@ -310,9 +345,11 @@ int out_buf_put (struct out_buf *buf, const char *data, int size)
 
 		LOCK (buf->mutex);
 
-		if (fifo_buf_get_space(buf->buf) == 0 && !buf->stop) {
+		if (ring_buf_get_space(buf->buf) == 0 && !buf->stop) {
 			/*logit ("buffer full, waiting for the signal");*/
+			buf->ready_waiters += 1;
 			pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+			buf->ready_waiters -= 1;
 			/*logit ("buffer ready");*/
 		}
 
@@ -322,15 +359,21 @@ int out_buf_put (struct out_buf *buf, const char *data, int size)
 			return 0;
 		}
 
-		written = fifo_buf_put (buf->buf, data + pos, size);
+		UNLOCK (buf->mutex);
+
+		written = ring_buf_put (buf->buf, data + pos, size);
 
 		if (written) {
-			pthread_cond_signal (&buf->play_cond);
 			size -= written;
 			pos += written;
-		}
 
-		UNLOCK (buf->mutex);
+			/* The data is already visible to the reading thread,
+			 * so it only needs waking up if it went to sleep. */
+			LOCK (buf->mutex);
+			if (buf->read_thread_waiting)
+				pthread_cond_signal (&buf->play_cond);
+			UNLOCK (buf->mutex);
+		}
 	}
 
 	return 1;
@@ -364,7 +407,9 @@ void out_buf_stop (struct out_buf *buf)
 	logit ("sending signal");
 	pthread_cond_signal (&buf->play_cond);
 	logit ("waiting for signal");
+	buf->ready_waiters += 1;
 	pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+	buf->ready_waiters -= 1;
 	logit ("done");
 	UNLOCK (buf->mutex);
 }
@@ -376,7 +421,7 @@ void out_buf_reset (struct out_buf *buf)
 	logit ("resetting the buffer");
 
 	LOCK (buf->mutex);
-	fifo_buf_clear (buf->buf);
+	ring_buf_clear (buf->buf);
 	buf->stop = 0;
 	buf->pause = 0;
 	buf->reset_dev = 0;
@@ -420,28 +465,16 @@ void out_buf_set_free_callback (struct out_buf *buf,
 
 int out_buf_get_free (struct out_buf *buf)
 {
-	int space;
-
 	assert (buf != NULL);
 
-	LOCK (buf->mutex);
-	space = fifo_buf_get_space (buf->buf);
-	UNLOCK (buf->mutex);
-
-	return space;
+	return ring_buf_get_space (buf->buf);
 }
 
 int out_buf_get_fill (struct out_buf *buf)
 {
-	int fill;
-
 	assert (buf != NULL);
 
-	LOCK (buf->mutex);
-	fill = fifo_buf_get_fill (buf->buf);
-	UNLOCK (buf->mutex);
-
-	return fill;
+	return ring_buf_get_fill (buf->buf);
 }
 
 /* Wait until the read thread will stop and wait for data to come.
@@ -456,7 +489,9 @@ void out_buf_wait (struct out_buf *buf)
 	LOCK (buf->mutex);
 	while (!buf->read_thread_waiting) {
 		debug ("waiting....");
+		buf->ready_waiters += 1;
 		pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+		buf->ready_waiters -= 1;
 	}
 	UNLOCK (buf->mutex);
 
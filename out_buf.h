@@ -1,8 +1,6 @@
 #ifndef BUF_H
 #define BUF_H
 
-#include "fifo_buf.h"
-
 #ifdef __cplusplus
 extern "C" {
 #endif
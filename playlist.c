@@ -38,6 +38,156 @@
 /* Initial size of the table */
 #define	INIT_SIZE	64
 
+/* Which items are deleted is kept in plist->live, a Fenwick tree counting
+ * non-deleted items over plist->allocated slots: live[i] (1-based) holds
+ * the count for the slots (i - lowbit(i), i].  This gives the position of
+ * an item and the next or previous non-deleted item in O(log n), however
+ * many deleted items there are. */
+
+/* Rebuild the counts after the items or the table size changed. */
+static void live_build (struct plist *plist)
+{
+	int i;
+
+	plist->live = (int *)xrealloc (plist->live,
+			sizeof(int) * (plist->allocated + 1));
+
+	plist->live[0] = 0;
+	for (i = 0; i < plist->allocated; i++)
+		plist->live[i + 1] = i < plist->num && !plist->items[i].deleted;
+
+	for (i = 1; i <= plist->allocated; i++) {
+		int parent = i + (i & -i);
+
+		if (parent <= plist->allocated)
+			plist->live[parent] += plist->live[i];
+	}
+}
+
+static void live_update (struct plist *plist, const int num, const int delta)
+{
+	int i;
+
+	for (i = num + 1; i <= plist->allocated; i += i & -i)
+		plist->live[i] += delta;
+}
+
+/* Return the number of non-deleted items before the item num. */
+static int live_before (const struct plist *plist, const int num)
+{
+	int i;
+	int count = 0;
+
+	for (i = num; i > 0; i -= i & -i)
+		count += plist->live[i];
+
+	return count;
+}
+
+/* Return the index of the k-th (starting with 1) non-deleted item. */
+static int live_find (const struct plist *plist, int k)
+{
+	int step = 1;
+	int i = 0;
+
+	assert (k > 0 && k <= plist->not_deleted);
+
+	while (step * 2 <= plist->allocated)
+		step *= 2;
+
+	for (; step; step /= 2) {
+		if (i + step <= plist->allocated && plist->live[i + step] < k) {
+			i += step;
+			k -= plist->live[i];
+		}
+	}
+
+	return i;
+}
+
+/* The random order (see struct plist) holds all non-deleted items and the
+ * deleted items which were already drawn. */
+
+static void order_free (struct plist *plist)
+{
+	free (plist->order);
+	free (plist->order_pos);
+	plist->order = NULL;
+	plist->order_pos = NULL;
+	plist->order_num = 0;
+	plist->order_drawn = 0;
+}
+
+static void order_resize (struct plist *plist)
+{
+	if (plist->order) {
+		plist->order = (int *)xrealloc (plist->order,
+				sizeof(int) * plist->allocated);
+		plist->order_pos = (int *)xrealloc (plist->order_pos,
+				sizeof(int) * plist->allocated);
+	}
+}
+
+/* Swap the items at two positions of the order. */
+static void order_swap (struct plist *plist, const int a, const int b)
+{
+	int t = plist->order[a];
+
+	plist->order[a] = plist->order[b];
+	plist->order[b] = t;
+	plist->order_pos[plist->order[a]] = a;
+	plist->order_pos[plist->order[b]] = b;
+}
+
+/* Add a new item to those not drawn yet. */
+static void order_append (struct plist *plist, const int num)
+{
+	if (plist->order) {
+		plist->order[plist->order_num] = num;
+		plist->order_pos[num] = plist->order_num++;
+	}
+}
+
+/* Remove a deleted item unless it was already drawn. */
+static void order_remove (struct plist *plist, const int num)
+{
+	int pos;
+
+	if (!plist->order || (pos = plist->order_pos[num]) < plist->order_drawn)
+		return;
+
+	order_swap (plist, pos, plist->order_num - 1);
+	plist->order_pos[num] = -1;
+	plist->order_num--;
+}
+
+/* Draw the next item of the order; return its position. */
+static int order_draw_next (struct plist *plist)
+{
+	int pos = plist->order_drawn;
+
+	assert (pos < plist->order_num);
+
+	order_swap (plist, pos, pos + rand () % (plist->order_num - pos));
+	plist->order_drawn++;
+
+	return pos;
+}
+
+/* Return the position of the item in the order, drawing it now if it is
+ * not drawn yet.  Return -1 if the item is not in the order. */
+static int order_draw_item (struct plist *plist, const int num)
+{
+	int pos = plist->order_pos[num];
+
+	if (pos >= plist->order_drawn) {
+		order_swap (plist, pos, plist->order_drawn);
+		pos = plist->order_drawn++;
+	}
+
+	return pos;
+}
+
 void tags_free (struct file_tags *tags)
 {
 	assert (tags != NULL);
@@ -156,6 +306,12 @@ void plist_init (struct plist *plist)
 	plist->search_tree = rb_tree_new (rb_compare, rb_fname_compare, plist);
 	plist->total_time = 0;
 	plist->items_with_time = 0;
+	plist->live = NULL;
+	live_build (plist);
+	plist->order = NULL;
+	plist->order_pos = NULL;
+	plist->order_num = 0;
+	plist->order_drawn = 0;
 }
 
 /* Create a new playlist item with empty fields. */
@@ -186,6 +342,8 @@ int plist_add (struct plist *plist, const char *file_name)
 		plist->allocated *= 2;
 		plist->items = (struct plist_item *)xrealloc (plist->items,
 				sizeof(struct plist_item) * plist->allocated);
+		live_build (plist);
+		order_resize (plist);
 	}
 
 	plist->items[plist->num].file = xstrdup (file_name);
@@ -204,6 +362,8 @@ int plist_add (struct plist *plist, const char *file_name)
 		rb_insert (plist->search_tree, (void *)(intptr_t)plist->num);
 	}
 
+	live_update (plist, plist->num, 1);
+	order_append (plist, plist->num);
 	plist->num++;
 	plist->not_deleted++;
 
@@ -253,15 +413,17 @@ char *plist_get_file (const struct plist *plist, int i)
  */
 int plist_next (struct plist *plist, int num)
 {
-	int i = num + 1;
+	int before;
 
 	assert (plist != NULL);
 	assert (num >= -1);
 
-	while (i < plist->num && plist->items[i].deleted)
-		i++;
+	if (num >= plist->num)
+		return -1;
 
-	return i < plist->num ? i : -1;
+	before = live_before (plist, num + 1);
+
+	return before < plist->not_deleted ? live_find (plist, before + 1) : -1;
 }
 
 /* Get the number of the previous item on the list (skipping deleted items).
@@ -270,15 +432,17 @@ int plist_next (struct plist *plist, int num)
  */
 int plist_prev (struct plist *plist, int num)
 {
-	int i = num - 1;
+	int before;
 
 	assert (plist != NULL);
 	assert (num >= -1);
 
-	while (i >= 0 && plist->items[i].deleted)
-		i--;
+	if (num <= 0)
+		return -1;
+
+	before = live_before (plist, MIN(num, plist->num));
 
-	return i >= 0 ? i : -1;
+	return before > 0 ? live_find (plist, before) : -1;
 }
 
 void plist_free_item_fields (struct plist_item *item)
@@ -319,6 +483,8 @@ void plist_clear (struct plist *plist)
 	rb_tree_clear (plist->search_tree);
 	plist->total_time = 0;
 	plist->items_with_time = 0;
+	live_build (plist);
+	order_free (plist);
 }
 
 /* Destroy the list freeing memory; the list can't be used after that. */
@@ -331,6 +497,8 @@ void plist_free (struct plist *plist)
 	plist->allocated = 0;
 	plist->items = NULL;
 	rb_tree_free (plist->search_tree);
+	free (plist->live);
+	plist->live = NULL;
 }
 
 /* Sort the playlist by file names. */
@@ -368,6 +536,8 @@ void plist_sort_fname (struct plist *plist)
 
 	memcpy (plist->items, sorted, sizeof(struct plist_item) * n);
 	free (sorted);
+	live_build (plist);
+	order_free (plist);
 }
 
 /* Find an item in the list.  Return the index or -1 if not found. */
@@ -593,6 +763,12 @@ int plist_add_from_item (struct plist *plist, const struct plist_item *item)
 
 	plist_item_copy (&plist->items[pos], item);
 
+	if (plist->items[pos].deleted) {
+		live_update (plist, pos, -1);
+		order_remove (plist, pos);
+		plist->not_deleted--;
+	}
+
 	if (item->tags && item->tags->time != -1) {
 		plist->total_time += item->tags->time;
 		plist->items_with_time++;
@@ -625,6 +801,8 @@ void plist_delete (struct plist *plist, const int num)
 		plist->items[num].file = file;
 
 		plist->items[num].deleted = 1;
+		live_update (plist, num, -1);
+		order_remove (plist, num);
 
 		plist->not_deleted--;
 	}
@@ -756,6 +934,28 @@ int plist_total_time (const struct plist *plist, int *all_files)
 	return plist->total_time;
 }
 
+/* Index all items again after they were moved.  For duplicated file names
+ * (a file added again after being deleted) the non-deleted item is found,
+ * otherwise the later one as after plist_add(). */
+static void search_tree_rebuild (struct plist *plist)
+{
+	int deleted, i;
+
+	rb_tree_clear (plist->search_tree);
+
+	for (deleted = 1; deleted >= 0; deleted--) {
+		for (i = 0; i < plist->num; i++) {
+			if (plist->items[i].file
+					&& plist->items[i].deleted == deleted) {
+				rb_delete (plist->search_tree,
+						plist->items[i].file);
+				rb_insert (plist->search_tree,
+						(void *)(intptr_t)i);
+			}
+		}
+	}
+}
+
 /* Swap two items on the playlist. */
 static void plist_swap (struct plist *plist, const int a, const int b)
 {
@@ -769,6 +969,24 @@ static void plist_swap (struct plist *plist, const int a, const int b)
 		t = plist->items[a];
 		plist->items[a] = plist->items[b];
 		plist->items[b] = t;
+
+		if (plist->items[a].deleted != plist->items[b].deleted) {
+			live_update (plist, a, plist->items[a].deleted ? -1 : 1);
+			live_update (plist, b, plist->items[b].deleted ? -1 : 1);
+		}
+
+		/* The items keep their places in the random order. */
+		if (plist->order) {
+			int pos_a = plist->order_pos[a];
+			int pos_b = plist->order_pos[b];
+
+			plist->order_pos[a] = pos_b;
+			plist->order_pos[b] = pos_a;
+			if (pos_a != -1)
+				plist->order[pos_a] = b;
+			if (pos_b != -1)
+				plist->order[pos_b] = a;
+		}
 	}
 }
 
@@ -781,10 +999,7 @@ void plist_shuffle (struct plist *plist)
 		plist_swap (plist, i,
 				(rand()/(float)RAND_MAX) * (plist->num - 1));
 
-	rb_tree_clear (plist->search_tree);
-
-	for (i = 0; i < plist->num; i++)
-		rb_insert (plist->search_tree, (void *)(intptr_t)i);
+	search_tree_rebuild (plist);
 }
 
 /* Swap the first item on the playlist with the item with file fname. */
@@ -820,14 +1035,9 @@ int plist_get_serial (const struct plist *plist)
  * Return -1 if there are no items. */
 int plist_last (const struct plist *plist)
 {
-	int i;
-
-	i = plist->num - 1;
-
-	while (i > 0 && plist_deleted(plist, i))
-		i--;
+	assert (plist != NULL);
 
-	return i;
+	return plist->not_deleted ? live_find (plist, plist->not_deleted) : -1;
 }
 
 enum file_type plist_file_type (const struct plist *plist, const int num)
@@ -867,6 +1077,27 @@ void plist_discard_tags (struct plist *plist)
 	plist->total_time = 0;
 }
 
+/* Drop the tags of the item, so they are read again. */
+void plist_discard_item_tags (struct plist *plist, const int num)
+{
+	struct plist_item *item;
+
+	assert (plist != NULL);
+	assert (LIMIT(num, plist->num));
+
+	item = &plist->items[num];
+	if (!item->tags)
+		return;
+
+	if (item->tags->time != -1) {
+		plist->total_time -= item->tags->time;
+		plist->items_with_time--;
+	}
+
+	tags_free (item->tags);
+	item->tags = NULL;
+}
+
 void plist_set_tags (struct plist *plist, const int num,
 		const struct file_tags *tags)
 {
@@ -935,14 +1166,177 @@ void plist_swap_files (struct plist *plist, const char *file1,
 /* Return the position of a file in the list, starting with 1. */
 int plist_get_position (const struct plist *plist, int num)
 {
-	int i, pos = 1;
-
 	assert (LIMIT(num, plist->num));
 
-	for (i = 0; i < num; i++) {
-		if(!plist->items[i].deleted)
-			pos++;
+	return live_before (plist, num) + 1;
+}
+
+/* Free the deleted items if there are more of them than other items.  The
+ * deleted item num (if not -1) is kept, so the caller can still use it to
+ * find the next item.  Item indexes change if anything was freed.  Return
+ * the new index of the item num. */
+int plist_reclaim (struct plist *plist, const int num)
+{
+	int i, n;
+	int new_num = -1;
+
+	assert (plist != NULL);
+	assert (num == -1 || LIMIT(num, plist->num));
+
+	if (plist->num < INIT_SIZE
+			|| plist->num - plist->not_deleted <= plist->not_deleted)
+		return num;
+
+	debug ("Freeing %d deleted items", plist->num - plist->not_deleted);
+
+	for (i = 0, n = 0; i < plist->num; i++) {
+		if (plist->items[i].deleted && i != num) {
+			plist_free_item_fields (&plist->items[i]);
+			if (plist->order && plist->order_pos[i] != -1)
+				plist->order[plist->order_pos[i]] = -1;
+			continue;
+		}
+
+		if (i == num)
+			new_num = n;
+		if (plist->order && plist->order_pos[i] != -1)
+			plist->order[plist->order_pos[i]] = n;
+		plist->items[n++] = plist->items[i];
 	}
 
-	return pos;
+	plist->num = n;
+
+	/* Drop the freed items from the random order, they were all drawn. */
+	if (plist->order) {
+		int drawn = plist->order_drawn;
+
+		for (i = 0, n = 0; i < plist->order_num; i++) {
+			if (plist->order[i] != -1)
+				plist->order[n++] = plist->order[i];
+			else if (i < drawn)
+				plist->order_drawn--;
+		}
+		plist->order_num = n;
+	}
+
+	while (plist->allocated > INIT_SIZE && plist->allocated >= n * 4)
+		plist->allocated /= 2;
+	plist->items = (struct plist_item *)xrealloc (plist->items,
+			sizeof(struct plist_item) * plist->allocated);
+	live_build (plist);
+
+	if (plist->order) {
+		order_resize (plist);
+		for (i = 0; i < plist->num; i++)
+			plist->order_pos[i] = -1;
+		for (i = 0; i < plist->order_num; i++)
+			plist->order_pos[plist->order[i]] = i;
+	}
+
+	search_tree_rebuild (plist);
+
+	return new_num;
+}
+
+/* Start a new random order of the items, with the item first (if not -1)
+ * at the beginning.  The rest of the order is drawn as it is walked
+ * through, so this takes only a pass over the item indexes. */
+void plist_set_random_order (struct plist *plist, const int first)
+{
+	int i;
+
+	assert (plist != NULL);
+	assert (first == -1 || LIMIT(first, plist->num));
+
+	if (!plist->order) {
+		plist->order = (int *)xmalloc (sizeof(int) * plist->allocated);
+		plist->order_pos = (int *)xmalloc (sizeof(int)
+				* plist->allocated);
+	}
+
+	plist->order_num = 0;
+	plist->order_drawn = 0;
+
+	for (i = 0; i < plist->num; i++) {
+		if (plist->items[i].deleted)
+			plist->order_pos[i] = -1;
+		else
+			order_append (plist, i);
+	}
+
+	if (first != -1 && !plist->items[first].deleted)
+		order_draw_item (plist, first);
+}
+
+int plist_has_random_order (const struct plist *plist)
+{
+	assert (plist != NULL);
+
+	return plist->order != NULL;
+}
+
+/* Like plist_next(), but in the random order. */
+int plist_next_random (struct plist *plist, int num)
+{
+	int pos;
+
+	assert (plist != NULL);
+	assert (num >= -1);
+
+	/* The playlist could be cleared or sorted since num was taken. */
+	if (!plist->order || num >= plist->num)
+		return -1;
+
+	pos = num == -1 ? -1 : order_draw_item (plist, num);
+
+	do {
+		if (++pos == plist->order_num)
+			return -1;
+		if (pos == plist->order_drawn)
+			order_draw_next (plist);
+	} while (plist->items[plist->order[pos]].deleted);
+
+	return plist->order[pos];
+}
+
+/* Like plist_prev(), but in the random order. */
+int plist_prev_random (struct plist *plist, int num)
+{
+	int pos;
+
+	assert (plist != NULL);
+	assert (num >= -1);
+
+	if (!plist->order || num >= plist->num)
+		return -1;
+
+	if (num == -1 || (pos = order_draw_item (plist, num)) == -1)
+		return -1;
+
+	do {
+		if (--pos < 0)
+			return -1;
+	} while (plist->items[plist->order[pos]].deleted);
+
+	return plist->order[pos];
+}
+
+/* Like plist_last(), but in the random order.  This draws all items. */
+int plist_last_random (struct plist *plist)
+{
+	int pos;
+
+	assert (plist != NULL);
+
+	if (!plist->order)
+		return -1;
+
+	while (plist->order_drawn < plist->order_num)
+		order_draw_next (plist);
+
+	for (pos = plist->order_num - 1; pos >= 0; pos--)
+		if (!plist->items[plist->order[pos]].deleted)
+			return plist->order[pos];
+
+	return -1;
 }
@@ -59,6 +59,16 @@ struct plist
 	int items_with_time;	/* Number of items for which the time is set. */
 
 	struct rb_tree *search_tree;
+	int *live;		/* Fenwick tree of non-deleted items counts */
+
+	/* Random order of items: order[] holds item indexes, order_pos[] the
+	 * position of each item in order[] (-1 if not there).  The first
+	 * order_drawn positions are fixed, the remaining items are drawn
+	 * when the order reaches them.  NULL if there is no random order. */
+	int *order;
+	int *order_pos;
+	int order_num;
+	int order_drawn;
 };
 
 void plist_init (struct plist *plist);
@@ -105,12 +115,19 @@ void plist_item_copy (struct plist_item *dst, const struct plist_item *src);
 enum file_type plist_file_type (const struct plist *plist, const int num);
 void plist_remove_common_items (struct plist *a, struct plist *b);
 void plist_discard_tags (struct plist *plist);
+void plist_discard_item_tags (struct plist *plist, const int num);
 void plist_set_tags (struct plist *plist, const int num,
 		const struct file_tags *tags);
 struct file_tags *plist_get_tags (const struct plist *plist, const int num);
 void plist_swap_files (struct plist *plist, const char *file1,
 		const char *file2);
 int plist_get_position (const struct plist *plist, int num);
+int plist_reclaim (struct plist *plist, const int num);
+void plist_set_random_order (struct plist *plist, const int first);
+int plist_has_random_order (const struct plist *plist);
+int plist_next_random (struct plist *plist, int num);
+int plist_prev_random (struct plist *plist, int num);
+int plist_last_random (struct plist *plist);
 
 #ifdef __cplusplus
 }
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
@@ -33,13 +34,27 @@
 #define UNIX_PATH_MAX	108
 #define SOCKET_NAME	"socket2"
 
-/* Buffer used to send data in one bigger chunk instead of sending sigle
- * integer, string etc. values. */
-struct packet_buf
+/* Maximum number of events sent in one call. */
+#define SEND_IOV_MAX	64
+
+/* Serialized event with the number of queues (and the creator) holding
+ * it. */
+struct event_packet
+{
+	int refcount;
+	int type;
+	struct packet_buf *b;
+};
+
+/* The serial number and the items of a playlist as they are received,
+ * preceded by EV_DATA to make them the response for the client which
+ * requested the playlist. */
+struct plist_relay
 {
-	char *buf;
-	size_t allocated;
-	size_t len;
+	struct packet_buf *b;
+	size_t scanned;		/* end of the last complete item in b */
+	int got_serial;		/* is the serial number in b? */
+	int complete;		/* is the end of playlist mark in b? */
 };
 
 /* Create a socket name, return NULL if the name could not be created. */
@@ -169,20 +184,6 @@ char *get_str (int sock)
 	return str;
 }
 
-int send_str (int sock, const char *str)
-{
-	int len;
-
-	len = strlen (str);
-	if (!send_int (sock, len))
-		return 0;
-
-	if (send (sock, str, len, 0) != len)
-		return 0;
-
-	return 1;
-}
-
 /* Get a time_t value from the socket, return == 0 on error. */
 int get_time (int sock, time_t *i)
 {
@@ -207,7 +208,7 @@ int send_time (int sock, time_t i)
 	return res == ssizeof(time_t) ? 1 : 0;
 }
 
-static struct packet_buf *packet_buf_new ()
+struct packet_buf *packet_buf_new ()
 {
 	struct packet_buf *b;
 
@@ -219,7 +220,7 @@ static struct packet_buf *packet_buf_new ()
 	return b;
 }
 
-static void packet_buf_free (struct packet_buf *b)
+void packet_buf_free (struct packet_buf *b)
 {
 	assert (b != NULL);
 
@@ -239,7 +240,7 @@ static void packet_buf_add_space (struct packet_buf *b, const size_t len)
 }
 
 /* Add an integer value to the buffer */
-static void packet_buf_add_int (struct packet_buf *b, const int n)
+void packet_buf_add_int (struct packet_buf *b, const int n)
 {
 	assert (b != NULL);
 
@@ -249,7 +250,7 @@ static void packet_buf_add_int (struct packet_buf *b, const int n)
 }
 
 /* Add a string value to the buffer. */
-static void packet_buf_add_str (struct packet_buf *b, const char *str)
+void packet_buf_add_str (struct packet_buf *b, const char *str)
 {
 	int str_len;
 
@@ -265,7 +266,7 @@ static void packet_buf_add_str (struct packet_buf *b, const char *str)
 }
 
 /* Add a time_t value to the buffer. */
-static void packet_buf_add_time (struct packet_buf *b, const time_t n)
+void packet_buf_add_time (struct packet_buf *b, const time_t n)
 {
 	assert (b != NULL);
 
@@ -299,9 +300,15 @@ void packet_buf_add_tags (struct packet_buf *b, const struct file_tags *tags)
 	}
 }
 
-/* Add an item to the buffer. */
+/* Add an item to the buffer.  If item == NULL, add the empty item mark (end
+ * of playlist). */
 void packet_buf_add_item (struct packet_buf *b, const struct plist_item *item)
 {
+	if (!item) {
+		packet_buf_add_str (b, "");
+		return;
+	}
+
 	packet_buf_add_str (b, item->file);
 	packet_buf_add_str (b, item->title_tags ? item->title_tags : "");
 	packet_buf_add_tags (b, item->tags);
@@ -326,29 +333,18 @@ static int send_all (int sock, const char *buf, const size_t size)
 	return 1;
 }
 
-/* Send a playlist item to the socket. If item == NULL, send empty item mark
- * (end of playlist). Return 0 on error. */
-int send_item (int sock, const struct plist_item *item)
+/* Send the content of the buffer to the socket and empty it.  Return 0 on
+ * error. */
+int packet_buf_send (int sock, struct packet_buf *b)
 {
 	int res = 1;
-	struct packet_buf *b;
 
-	if (!item) {
-		if (!send_str(sock, "")) {
-			logit ("Error while sending empty item");
-			return 0;
-		}
-		return 1;
-	}
+	assert (b != NULL);
 
-	b = packet_buf_new ();
-	packet_buf_add_item (b, item);
-	if (!send_all(sock, b->buf, b->len)) {
-		logit ("Error when sending item");
+	if (b->len > 0 && !send_all(sock, b->buf, b->len))
 		res = 0;
-	}
+	b->len = 0;
 
-	packet_buf_free (b);
 	return res;
 }
 
@@ -409,22 +405,6 @@ struct file_tags *recv_tags (int sock)
 	return tags;
 }
 
-/* Send tags. If tags == NULL, send empty tags. Return 0 on error. */
-int send_tags (int sock, const struct file_tags *tags)
-{
-	int res = 1;
-	struct packet_buf *b;
-
-	b = packet_buf_new ();
-	packet_buf_add_tags (b, tags);
-
-	if (!send_all(sock, b->buf, b->len))
-		res = 0;
-
-	packet_buf_free (b);
-	return res;
-}
-
 /* Get a playlist item from the server.
  * The end of the playlist is indicated by item->file being an empty string.
  * The memory is malloc()ed.  Returns NULL on error. */
@@ -499,30 +479,45 @@ struct move_ev_data *recv_move_ev_data (int sock)
 	return d;
 }
 
-/* Push an event on the queue if it's not already there. */
-void event_push (struct event_queue *q, const int event, void *data)
+static struct event *event_push_new (struct event_queue *q, const int event)
 {
+	struct event *e;
+
 	assert (q != NULL);
 
-	if (!q->head) {
-		q->head = (struct event *)xmalloc (sizeof(struct event));
-		q->head->next = NULL;
-		q->head->type = event;
-		q->head->data = data;
-		q->tail = q->head;
-	}
+	e = (struct event *)xmalloc (sizeof(struct event));
+	e->next = NULL;
+	e->type = event;
+	e->data = NULL;
+	e->packet = NULL;
+	e->sent = 0;
+
+	if (!q->head)
+		q->head = e;
 	else {
-		assert (q->head != NULL);
 		assert (q->tail != NULL);
 		assert (q->tail->next == NULL);
 
-		q->tail->next = (struct event *)xmalloc (
-				sizeof(struct event));
-		q->tail = q->tail->next;
-		q->tail->next = NULL;
-		q->tail->type = event;
-		q->tail->data = data;
+		q->tail->next = e;
 	}
+	q->tail = e;
+
+	return e;
+}
+
+/* Push an event on the queue if it's not already there. */
+void event_push (struct event_queue *q, const int event, void *data)
+{
+	event_push_new (q, event)->data = data;
+}
+
+/* Push a serialized event on the queue. */
+void event_push_packet (struct event_queue *q, struct event_packet *p)
+{
+	assert (p != NULL);
+
+	__sync_add_and_fetch (&p->refcount, 1);
+	event_push_new (q, p->type)->packet = p;
 }
 
 /* Remove the first event from the queue (don't free the data field). */
@@ -571,21 +566,6 @@ void free_move_ev_data (struct move_ev_data *m)
 	free (m);
 }
 
-struct move_ev_data *move_ev_data_dup (const struct move_ev_data *m)
-{
-	struct move_ev_data *new;
-
-	assert (m != NULL);
-	assert (m->from != NULL);
-	assert (m->to != NULL);
-
-	new = (struct move_ev_data *)xmalloc (sizeof(struct move_ev_data));
-	new->from = xstrdup (m->from);
-	new->to = xstrdup (m->to);
-
-	return new;
-}
-
 /* Free data associated with the event if any. */
 void free_event_data (const int type, void *data)
 {
@@ -604,6 +584,15 @@ void free_event_data (const int type, void *data)
 		abort (); /* BUG */
 }
 
+/* Free the data or the packet of the event. */
+static void free_event_payload (struct event *e)
+{
+	if (e->packet)
+		event_packet_unref (e->packet);
+	else
+		free_event_data (e->type, e->data);
+}
+
 /* Free event queue content without the queue structure. */
 void event_queue_free (struct event_queue *q)
 {
@@ -612,7 +601,7 @@ void event_queue_free (struct event_queue *q)
 	assert (q != NULL);
 
 	while ((e = event_get_first(q))) {
-		free_event_data (e->type, e->data);
+		free_event_payload (e);
 		event_pop (q);
 	}
 }
@@ -653,73 +642,138 @@ int event_queue_empty (const struct event_queue *q)
 }
 
 /* Make a packet buffer filled with the event (with data). */
-static struct packet_buf *make_event_packet (const struct event *e)
+static struct packet_buf *make_event_packet (const int type, const void *data)
 {
 	struct packet_buf *b;
 
-	assert (e != NULL);
-
 	b = packet_buf_new ();
 
-	packet_buf_add_int (b, e->type);
+	packet_buf_add_int (b, type);
 
-	if (e->type == EV_PLIST_DEL
-			|| e->type == EV_QUEUE_DEL
-			|| e->type == EV_SRV_ERROR
-			|| e->type == EV_STATUS_MSG) {
-		assert (e->data != NULL);
-		packet_buf_add_str (b, e->data);
+	if (type == EV_PLIST_DEL
+			|| type == EV_QUEUE_DEL
+			|| type == EV_SRV_ERROR
+			|| type == EV_STATUS_MSG) {
+		assert (data != NULL);
+		packet_buf_add_str (b, data);
 	}
-	else if (e->type == EV_PLIST_ADD || e->type == EV_QUEUE_ADD) {
-		assert (e->data != NULL);
-		packet_buf_add_item (b, e->data);
+	else if (type == EV_PLIST_ADD || type == EV_QUEUE_ADD) {
+		assert (data != NULL);
+		packet_buf_add_item (b, data);
 	}
-	else if (e->type == EV_FILE_TAGS) {
-		struct tag_ev_response *r;
+	else if (type == EV_FILE_TAGS) {
+		const struct tag_ev_response *r;
 
-		assert (e->data != NULL);
-		r = e->data;
+		assert (data != NULL);
+		r = data;
 
 		packet_buf_add_str (b, r->file);
 		packet_buf_add_tags (b, r->tags);
 	}
-	else if (e->type == EV_PLIST_MOVE || e->type == EV_QUEUE_MOVE) {
-		struct move_ev_data *m;
+	else if (type == EV_PLIST_MOVE || type == EV_QUEUE_MOVE) {
+		const struct move_ev_data *m;
 
-		assert (e->data != NULL);
+		assert (data != NULL);
 
-		m = (struct move_ev_data *)e->data;
+		m = (const struct move_ev_data *)data;
 		packet_buf_add_str (b, m->from);
 		packet_buf_add_str (b, m->to);
 	}
-	else if (e->data)
+	else if (data)
 		abort (); /* BUG */
 
 	return b;
 }
 
-/* Send the first event from the queue an remove it on success.  If the
- * operation would block return NB_IO_BLOCK.  Return NB_IO_ERR on error
+/* Serialize the event to be pushed on many queues.  The data is not used
+ * after that, so it remains owned by the caller.  The caller holds one
+ * reference to the packet. */
+struct event_packet *event_packet_new (const int event, const void *data)
+{
+	return event_packet_from_buf (event, make_event_packet (event, data));
+}
+
+/* Make a packet of the given event type with the already serialized
+ * content of the buffer, which is owned by the packet then.  The caller
+ * holds one reference to the packet. */
+struct event_packet *event_packet_from_buf (const int event,
+		struct packet_buf *b)
+{
+	struct event_packet *p;
+
+	assert (b != NULL);
+
+	p = (struct event_packet *)xmalloc (sizeof(struct event_packet));
+	p->refcount = 1;
+	p->type = event;
+	p->b = b;
+
+	return p;
+}
+
+/* Drop a reference to the packet, free it if it was the last one. */
+void event_packet_unref (struct event_packet *p)
+{
+	assert (p != NULL);
+	assert (p->refcount > 0);
+
+	if (__sync_sub_and_fetch (&p->refcount, 1) == 0) {
+		packet_buf_free (p->b);
+		free (p);
+	}
+}
+
+/* Send events from the queue, as many as fit in one sendmsg() call, and
+ * remove these which were sent.  If the operation would block or not all
+ * of them could be sent return NB_IO_BLOCK.  Return NB_IO_ERR on error
  * or NB_IO_OK on success. */
 enum noblock_io_status event_send_noblock (int sock, struct event_queue *q)
 {
+	struct iovec iov[SEND_IOV_MAX];
+	struct msghdr msg;
 	ssize_t res;
-	struct packet_buf *b;
+	struct event *e;
+	int n = 0;
 
 	assert (q != NULL);
 	assert (!event_queue_empty(q));
 
-	/* We must do it in one send() call to be able to handle blocking. */
-	b = make_event_packet (event_get_first(q));
-	res = send (sock, b->buf, b->len, MSG_DONTWAIT);
-	packet_buf_free (b);
+	for (e = event_get_first(q); e && n < SEND_IOV_MAX; e = e->next) {
 
-	if (res > 0) {
-		struct event *e;
+		/* A part of the event could be sent already, so it must be
+		 * sent from the same buffer. */
+		if (!e->packet) {
+			e->packet = event_packet_new (e->type, e->data);
+			free_event_data (e->type, e->data);
+			e->data = NULL;
+		}
 
-		e = event_get_first (q);
-		free_event_data (e->type, e->data);
-		event_pop (q);
+		iov[n].iov_base = e->packet->b->buf + e->sent;
+		iov[n].iov_len = e->packet->b->len - e->sent;
+		n++;
+	}
+
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	res = sendmsg (sock, &msg, MSG_DONTWAIT);
+
+	if (res >= 0) {
+		while ((e = event_get_first(q)) && n > 0) {
+			size_t left = e->packet->b->len - e->sent;
+
+			if ((size_t)res < left) {
+				e->sent += res;
+				debug ("Event sent partially");
+				return NB_IO_BLOCK;
+			}
+
+			res -= left;
+			n--;
+			free_event_payload (e);
+			event_pop (q);
+		}
 
 		return NB_IO_OK;
 	}
@@ -732,3 +786,163 @@ enum noblock_io_status event_send_noblock (int sock, struct event_queue *q)
 	logit ("Error when sending event: %s", strerror(errno));
 	return NB_IO_ERR;
 }
+
+/* Check if there is a complete string at pos in the buffer of size len.
+ * Return 1 and move pos past it if so, 0 if the buffer ends before, -1 if
+ * the string is invalid.  Set *str_len to the length of the string. */
+static int scan_str (const char *buf, const size_t len, size_t *pos,
+		int *str_len)
+{
+	if (len - *pos < sizeof(int))
+		return 0;
+
+	memcpy (str_len, buf + *pos, sizeof(int));
+	if (!RANGE(0, *str_len, MAX_SEND_STRING)) {
+		logit ("Bad string length.");
+		return -1;
+	}
+
+	if (len - *pos - sizeof(int) < (size_t)*str_len)
+		return 0;
+
+	*pos += sizeof(int) + *str_len;
+	return 1;
+}
+
+/* Check if there is a complete playlist item (as added by
+ * packet_buf_add_item()) at pos in the buffer of size len.  Return like
+ * scan_str(), set *end if the item is the end of playlist mark. */
+static int scan_item (const char *buf, const size_t len, size_t *pos,
+		int *end)
+{
+	int i, res, str_len;
+
+	if ((res = scan_str(buf, len, pos, &str_len)) != 1)
+		return res;
+
+	*end = str_len == 0;
+	if (*end)
+		return 1;
+
+	/* title_tags, title, artist and album */
+	for (i = 0; i < 4; i++)
+		if ((res = scan_str(buf, len, pos, &str_len)) != 1)
+			return res;
+
+	/* track, time, filled and mtime */
+	if (len - *pos < 3 * sizeof(int) + sizeof(time_t))
+		return 0;
+	*pos += 3 * sizeof(int) + sizeof(time_t);
+
+	return 1;
+}
+
+struct plist_relay *plist_relay_new ()
+{
+	struct plist_relay *r;
+
+	r = (struct plist_relay *)xmalloc (sizeof(struct plist_relay));
+	r->b = packet_buf_new ();
+	packet_buf_add_int (r->b, EV_DATA);
+	r->scanned = r->b->len;
+	r->got_serial = 0;
+	r->complete = 0;
+
+	return r;
+}
+
+void plist_relay_free (struct plist_relay *r)
+{
+	assert (r != NULL);
+
+	packet_buf_free (r->b);
+	free (r);
+}
+
+/* Receive the part of the playlist (the serial number followed by the
+ * items and the end of playlist mark) which is available without blocking.
+ * Nothing after the end of playlist mark is read.  Return NB_IO_OK when the
+ * whole playlist was received, NB_IO_BLOCK if there is more to come, or
+ * NB_IO_ERR on error. */
+enum noblock_io_status plist_relay_recv (int sock, struct plist_relay *r)
+{
+	assert (r != NULL);
+	assert (!r->complete);
+
+	while (1) {
+		ssize_t res;
+		size_t len, pos;
+
+		packet_buf_add_space (r->b, MAX(64 * 1024, r->b->len));
+
+		/* Look at the data first to find where the playlist ends, the
+		 * client may send a command right after it. */
+		res = recv (sock, r->b->buf + r->b->len,
+				r->b->allocated - r->b->len,
+				MSG_PEEK | MSG_DONTWAIT);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return NB_IO_BLOCK;
+		if (res < 0) {
+			logit ("recv() failed when getting the playlist: %s",
+					strerror(errno));
+			return NB_IO_ERR;
+		}
+		if (res == 0) {
+			logit ("Unexpected EOF when getting the playlist");
+			return NB_IO_ERR;
+		}
+
+		len = r->b->len + res;
+		pos = r->scanned;
+
+		if (!r->got_serial && len - pos >= sizeof(int)) {
+			pos += sizeof(int);
+			r->scanned = pos;
+			r->got_serial = 1;
+		}
+
+		while (r->got_serial && !r->complete) {
+			int end;
+			int st = scan_item (r->b->buf, len, &pos, &end);
+
+			if (st == -1)
+				return NB_IO_ERR;
+			if (st == 0)
+				break;
+
+			r->scanned = pos;
+			r->complete = end;
+		}
+
+		/* The data is in place already, just remove it from the
+		 * socket. */
+		if (r->complete)
+			res = r->scanned - r->b->len;
+		res = recv (sock, r->b->buf + r->b->len, res, 0);
+		if (res <= 0) {
+			logit ("recv() failed when getting the playlist: %s",
+					strerror(errno));
+			return NB_IO_ERR;
+		}
+		r->b->len += res;
+
+		if (r->complete)
+			return NB_IO_OK;
+	}
+}
+
+/* Make the event with the whole received playlist to be sent to the client
+ * which requested it, free the relay.  The caller holds one reference to
+ * the packet. */
+struct event_packet *plist_relay_packet (struct plist_relay *r)
+{
+	struct event_packet *p;
+
+	assert (r != NULL);
+	assert (r->complete);
+
+	p = event_packet_from_buf (EV_DATA, r->b);
+	free (r);
+
+	return p;
+}
@@ -7,10 +7,16 @@
 extern "C" {
 #endif
 
+/* An event already serialized, shared by the queues of all clients it is
+ * sent to. */
+struct event_packet;
+
 struct event
 {
 	int type;	/* type of the event (one of EV_*) */
 	void *data;	/* optional data associated with the event */
+	struct event_packet *packet; /* or the serialized event */
+	size_t sent;	/* bytes of the packet already sent */
 	struct event *next;
 };
 
@@ -35,6 +41,18 @@ struct move_ev_data
 	char *to;
 };
 
+/* Buffer used to send data in one bigger chunk instead of sending single
+ * integer, string etc. values. */
+struct packet_buf
+{
+	char *buf;
+	size_t allocated;
+	size_t len;
+};
+
+/* A playlist received from a client to be sent to another one. */
+struct plist_relay;
+
 /* Status of nonblock sending/receiving function. */
 enum noblock_io_status
 {
@@ -146,19 +164,29 @@ enum noblock_io_status
 #define CMD_QUEUE_MOVE	0x3d /* move an item in the queue */
 #define CMD_QUEUE_CLEAR	0x3e /* clear the queue */
 #define CMD_GET_QUEUE	0x3f /* request the queue from the server */
+#define CMD_PRIORITIZE_TAGS	0x40 /* read tags for the file requested by
+					CMD_GET_FILE_TAGS before the others */
+#define CMD_LIBRARY_QUERY	0x41 /* search the music library */
+#define CMD_LIBRARY_UPDATE	0x42 /* index the music directory again */
 
 char *socket_name ();
 int get_int (int sock, int *i);
 enum noblock_io_status get_int_noblock (int sock, int *i);
 int send_int (int sock, int i);
 char *get_str (int sock);
-int send_str (int sock, const char *str);
 int get_time (int sock, time_t *i);
 int send_time (int sock, time_t i);
-int send_item (int sock, const struct plist_item *item);
 struct plist_item *recv_item (int sock);
 struct file_tags *recv_tags (int sock);
-int send_tags (int sock, const struct file_tags *tags);
+
+struct packet_buf *packet_buf_new ();
+void packet_buf_free (struct packet_buf *b);
+void packet_buf_add_int (struct packet_buf *b, const int n);
+void packet_buf_add_str (struct packet_buf *b, const char *str);
+void packet_buf_add_time (struct packet_buf *b, const time_t n);
+void packet_buf_add_tags (struct packet_buf *b, const struct file_tags *tags);
+void packet_buf_add_item (struct packet_buf *b, const struct plist_item *item);
+int packet_buf_send (int sock, struct packet_buf *b);
 
 void event_queue_init (struct event_queue *q);
 void event_queue_free (struct event_queue *q);
@@ -166,12 +194,20 @@ void free_event_data (const int type, void *data);
 struct event *event_get_first (struct event_queue *q);
 void event_pop (struct event_queue *q);
 void event_push (struct event_queue *q, const int event, void *data);
+struct event_packet *event_packet_new (const int event, const void *data);
+struct event_packet *event_packet_from_buf (const int event,
+		struct packet_buf *b);
+void event_packet_unref (struct event_packet *p);
+void event_push_packet (struct event_queue *q, struct event_packet *p);
 int event_queue_empty (const struct event_queue *q);
 enum noblock_io_status event_send_noblock (int sock, struct event_queue *q);
 void free_tag_ev_data (struct tag_ev_response *d);
 void free_move_ev_data (struct move_ev_data *m);
-struct move_ev_data *move_ev_data_dup (const struct move_ev_data *m);
 struct move_ev_data *recv_move_ev_data (int sock);
+struct plist_relay *plist_relay_new ();
+void plist_relay_free (struct plist_relay *r);
+enum noblock_io_status plist_relay_recv (int sock, struct plist_relay *r);
+struct event_packet *plist_relay_packet (struct plist_relay *r);
 
 #ifdef __cplusplus
 }
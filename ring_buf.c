@@ -0,0 +1,254 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Single producer, single consumer circular buffer.
+ *
+ * The writer owns 'head' and the reader owns 'tail'.  Both count modulo
+ * twice the buffer size, so that a full buffer (head - tail == size) can
+ * be told from an empty one (head == tail) without a shared fill counter.
+ * Each side publishes its counter with release semantics after it is done
+ * with the data and reads the other's with acquire semantics, which is
+ * all the synchronisation needed. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+#include "ring_buf.h"
+
+struct ring_buf
+{
+	size_t size;                        /* Size of the buffer */
+	size_t head;                        /* Write counter */
+	size_t tail;                        /* Read counter */
+	char buf[FLEXIBLE_ARRAY_MEMBER];    /* The buffer content */
+};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+static inline size_t load_acquire (const size_t *p)
+{
+	return __atomic_load_n (p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release (size_t *p, const size_t val)
+{
+	__atomic_store_n (p, val, __ATOMIC_RELEASE);
+}
+#else
+static inline size_t load_acquire (const size_t *p)
+{
+	size_t val = *(volatile const size_t *)p;
+
+	__sync_synchronize ();
+
+	return val;
+}
+
+static inline void store_release (size_t *p, const size_t val)
+{
+	__sync_synchronize ();
+	*(volatile size_t *)p = val;
+}
+#endif
+
+/* Return counter x moved forward by len bytes. */
+static inline size_t advance (const struct ring_buf *b, const size_t x,
+		const size_t len)
+{
+	return x + len < 2 * b->size ? x + len : x + len - 2 * b->size;
+}
+
+/* Return the number of bytes between the two counters. */
+static inline size_t distance (const struct ring_buf *b, const size_t head,
+		const size_t tail)
+{
+	return head >= tail ? head - tail : head + 2 * b->size - tail;
+}
+
+/* Return the position in the buffer pointed to by the counter. */
+static inline size_t position (const struct ring_buf *b, const size_t x)
+{
+	return x < b->size ? x : x - b->size;
+}
+
+/* Initialize and return a new ring_buf structure of the size requested. */
+struct ring_buf *ring_buf_new (const size_t size)
+{
+	struct ring_buf *b;
+
+	assert (size > 0);
+	assert (size <= SIZE_MAX / 2);
+
+	b = xmalloc (offsetof (struct ring_buf, buf) + size);
+
+	b->size = size;
+	b->head = 0;
+	b->tail = 0;
+
+	return b;
+}
+
+/* Destroy the buffer object. */
+void ring_buf_free (struct ring_buf *b)
+{
+	assert (b != NULL);
+
+	free (b);
+}
+
+/* Return the contiguous free region at the end of the data and put its
+ * length in len (which is 0 if the buffer is full).  The data written
+ * there becomes visible to the reader after ring_buf_commit(). */
+char *ring_buf_write_region (struct ring_buf *b, size_t *len)
+{
+	size_t head, pos, space;
+
+	assert (b != NULL);
+	assert (len != NULL);
+
+	head = b->head;
+	space = b->size - distance (b, head, load_acquire (&b->tail));
+	pos = position (b, head);
+
+	*len = MIN(space, b->size - pos);
+
+	return b->buf + pos;
+}
+
+/* Make len bytes written into the region returned by
+ * ring_buf_write_region() available to the reader. */
+void ring_buf_commit (struct ring_buf *b, const size_t len)
+{
+	assert (b != NULL);
+	assert (len <= ring_buf_get_space (b));
+
+	store_release (&b->head, advance (b, b->head, len));
+}
+
+/* Put data into the buffer. Returns number of bytes actually put. */
+size_t ring_buf_put (struct ring_buf *b, const char *data, size_t size)
+{
+	size_t written = 0;
+
+	assert (b != NULL);
+
+	while (written < size) {
+		size_t len;
+		char *region = ring_buf_write_region (b, &len);
+
+		if (len == 0)
+			break;
+		if (len > size - written)
+			len = size - written;
+
+		memcpy (region, data + written, len);
+		ring_buf_commit (b, len);
+		written += len;
+	}
+
+	return written;
+}
+
+/* Return the contiguous region of data at the beginning of the buffer
+ * and put its length in len (which is 0 if the buffer is empty).  The
+ * reader may modify the data in place; the space is given back to the
+ * writer by ring_buf_consume(). */
+char *ring_buf_read_region (struct ring_buf *b, size_t *len)
+{
+	size_t tail, pos, fill;
+
+	assert (b != NULL);
+	assert (len != NULL);
+
+	tail = b->tail;
+	fill = distance (b, load_acquire (&b->head), tail);
+	pos = position (b, tail);
+
+	*len = MIN(fill, b->size - pos);
+
+	return b->buf + pos;
+}
+
+/* Remove len bytes from the beginning of the buffer. */
+void ring_buf_consume (struct ring_buf *b, const size_t len)
+{
+	assert (b != NULL);
+	assert (len <= ring_buf_get_fill (b));
+
+	store_release (&b->tail, advance (b, b->tail, len));
+}
+
+/* Copy data from the beginning of the buffer to the user buffer and remove
+ * it.  Returns the number of bytes copied. */
+size_t ring_buf_get (struct ring_buf *b, char *user_buf, size_t user_buf_size)
+{
+	size_t copied = 0;
+
+	assert (b != NULL);
+
+	while (copied < user_buf_size) {
+		size_t len;
+		char *region = ring_buf_read_region (b, &len);
+
+		if (len == 0)
+			break;
+		if (len > user_buf_size - copied)
+			len = user_buf_size - copied;
+
+		memcpy (user_buf + copied, region, len);
+		ring_buf_consume (b, len);
+		copied += len;
+	}
+
+	return copied;
+}
+
+/* Discard all data in the buffer. */
+void ring_buf_clear (struct ring_buf *b)
+{
+	assert (b != NULL);
+
+	store_release (&b->tail, load_acquire (&b->head));
+}
+
+/* Get the amount of data in the buffer. */
+size_t ring_buf_get_fill (const struct ring_buf *b)
+{
+	size_t tail;
+
+	assert (b != NULL);
+
+	tail = load_acquire (&b->tail);
+
+	/* If this is neither the reader nor the writer, tail may have
+	 * moved on since it was loaded. */
+	return MIN(distance (b, load_acquire (&b->head), tail), b->size);
+}
+
+/* Get the amount of free space in the buffer. */
+size_t ring_buf_get_space (const struct ring_buf *b)
+{
+	assert (b != NULL);
+
+	return b->size - ring_buf_get_fill (b);
+}
+
+size_t ring_buf_get_size (const struct ring_buf *b)
+{
+	assert (b != NULL);
+
+	return b->size;
+}
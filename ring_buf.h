@@ -0,0 +1,38 @@
+#ifndef RING_BUF_H
+#define RING_BUF_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A circular buffer for exactly one writing and one reading thread which
+ * need no lock between them.  The functions marked 'writer' below may
+ * only be called by the writing thread and those marked 'reader' by the
+ * reading thread; the others may be called by any thread. */
+struct ring_buf;
+
+struct ring_buf *ring_buf_new (const size_t size);
+void ring_buf_free (struct ring_buf *b);
+
+/* writer */
+char *ring_buf_write_region (struct ring_buf *b, size_t *len);
+void ring_buf_commit (struct ring_buf *b, const size_t len);
+size_t ring_buf_put (struct ring_buf *b, const char *data, size_t size);
+
+/* reader */
+char *ring_buf_read_region (struct ring_buf *b, size_t *len);
+void ring_buf_consume (struct ring_buf *b, const size_t len);
+size_t ring_buf_get (struct ring_buf *b, char *user_buf, size_t user_buf_size);
+void ring_buf_clear (struct ring_buf *b);
+
+size_t ring_buf_get_fill (const struct ring_buf *b);
+size_t ring_buf_get_space (const struct ring_buf *b);
+size_t ring_buf_get_size (const struct ring_buf *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,7 +15,11 @@
 
 #include <stdio.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
 #ifdef HAVE_GETRLIMIT
 # include <sys/resource.h>
 #endif
@@ -42,6 +46,7 @@
 #include "server.h"
 #include "playlist.h"
 #include "tags_cache.h"
+#include "library.h"
 #include "files.h"
 #include "softmixer.h"
 #include "equalizer.h"
@@ -49,19 +54,66 @@
 #define SERVER_LOG	"mocp_server_log"
 #define PID_FILE	"pid"
 
+/* Events the server waits for on a descriptor. */
+#define WATCH_READ	0x01
+#define WATCH_WRITE	0x02
+
+/* Maximum number of ready descriptors handled in one loop iteration. */
+#define READY_MAX	64
+
 struct client
 {
-	int socket; 		/* -1 if inactive */
+	int socket; 		/* -1 if disconnected */
+	int id;			/* index in clients[], also used by the tags
+				   cache */
 	int wants_plist_events;	/* requested playlist events? */
 	struct event_queue events;
 	pthread_mutex_t events_mtx;
 	int requests_plist;	/* is the client waiting for the playlist? */
 	int can_send_plist;	/* can this client send a playlist? */
-	int lock;		/* is this client locking us? */
+	struct plist_relay *relay; /* the playlist the client is sending or
+				      NULL */
+	struct packet_buf *response; /* response to the command being handled
+					or NULL */
 	int serial;		/* used for generating unique serial numbers */
+	int watched;		/* WATCH_* flags the socket is watched for */
+	int pending;		/* is it on the pending_clients list? */
+	struct client *next_pending;
+	struct client *next_sending;	/* used by send_pending_events() */
+	struct client *next_closed;
 };
 
-static struct client clients[CLIENTS_MAX];
+/* Connected clients indexed by their ids, NULL for unused ids.  Only the
+ * server thread changes the table, with clients_mtx locked; other threads
+ * lock it while using the clients. */
+static struct client **clients = NULL;
+static int clients_num = 0;		/* size of clients[] */
+static pthread_mutex_t clients_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Clients with events queued since the server last tried to send them
+ * (protected by clients_mtx). */
+static struct client *pending_clients = NULL;
+
+/* Clients disconnected while handling the ready descriptors, they are
+ * freed before waiting for more so these descriptors can refer to them. */
+static struct client *closed_clients = NULL;
+
+/* The client holding the lock or NULL. */
+static struct client *locking = NULL;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#else
+/* Watched descriptors and what they are watched for. */
+static struct pollfd *poll_fds = NULL;
+static void **poll_ptrs = NULL;
+static int poll_num = 0;
+static int poll_allocated = 0;
+#endif
+
+/* Tags of the watched descriptors other than the clients' sockets. */
+static int listen_tag;
+static int wake_up_tag;
 
 /* Thread ID of the server thread. */
 static pthread_t server_tid;
@@ -87,6 +139,9 @@ static struct {
 
 static struct tags_cache *tags_cache;
 
+/* Index of the music directory. */
+static struct library *library;
+
 extern char **environ;
 
 static void write_pid_file ()
@@ -130,74 +185,238 @@ static void sig_exit (int sig)
 		pthread_kill (server_tid, sig);
 }
 
-static void clients_init ()
+#ifdef HAVE_SYS_EPOLL_H
+static void watch_init ()
+{
+	epoll_fd = epoll_create (READY_MAX);
+	if (epoll_fd == -1)
+		fatal ("epoll_create() failed: %s", strerror(errno));
+}
+
+static void watch_cleanup ()
+{
+	close (epoll_fd);
+	epoll_fd = -1;
+}
+
+/* Change the events the descriptor is watched for from old to new (0 if
+ * not watched).  ptr identifies the descriptor when it is ready. */
+static void watch_fd (const int fd, void *ptr, const int old, const int new)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (old == new)
+		return;
+
+	ev.events = (new & WATCH_READ ? EPOLLIN : 0)
+		| (new & WATCH_WRITE ? EPOLLOUT : 0);
+	ev.data.ptr = ptr;
+
+	if (!old)
+		op = EPOLL_CTL_ADD;
+	else if (!new)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+
+	if (epoll_ctl(epoll_fd, op, fd, &ev) == -1)
+		fatal ("epoll_ctl() failed: %s", strerror(errno));
+}
+
+/* Wait for watched descriptors to be ready, fill ptrs and events (WATCH_*)
+ * for them.  Return their number or -1 on error. */
+static int watch_wait (void **ptrs, int *events)
+{
+	struct epoll_event ev[READY_MAX];
+	int i, n;
+
+	n = epoll_wait (epoll_fd, ev, READY_MAX, -1);
+
+	for (i = 0; i < n; i++) {
+		ptrs[i] = ev[i].data.ptr;
+		events[i] = 0;
+
+		/* As select() does, report a closed connection as ready
+		 * for anything; reading or writing will then fail. */
+		if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			events[i] |= WATCH_READ;
+		if (ev[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			events[i] |= WATCH_WRITE;
+	}
+
+	return n;
+}
+#else
+static void watch_init ()
+{
+}
+
+static void watch_cleanup ()
+{
+	free (poll_fds);
+	free (poll_ptrs);
+	poll_fds = NULL;
+	poll_ptrs = NULL;
+	poll_num = poll_allocated = 0;
+}
+
+static void watch_fd (const int fd, void *ptr, const int old, const int new)
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++) {
-		clients[i].socket = -1;
-		pthread_mutex_init (&clients[i].events_mtx, NULL);
+	if (old == new)
+		return;
+
+	for (i = 0; i < poll_num && poll_fds[i].fd != fd; i++)
+		;
+
+	if (!new) {
+		assert (i < poll_num);
+		poll_num -= 1;
+		poll_fds[i] = poll_fds[poll_num];
+		poll_ptrs[i] = poll_ptrs[poll_num];
+		return;
+	}
+
+	if (i == poll_num) {
+		if (poll_num == poll_allocated) {
+			poll_allocated = poll_allocated ? poll_allocated * 2 : 16;
+			poll_fds = (struct pollfd *)xrealloc (poll_fds,
+					poll_allocated * sizeof (struct pollfd));
+			poll_ptrs = (void **)xrealloc (poll_ptrs,
+					poll_allocated * sizeof (void *));
+		}
+		poll_num += 1;
 	}
+
+	poll_fds[i].fd = fd;
+	poll_fds[i].events = (new & WATCH_READ ? POLLIN : 0)
+		| (new & WATCH_WRITE ? POLLOUT : 0);
+	poll_ptrs[i] = ptr;
 }
 
-static void clients_cleanup ()
+static int watch_wait (void **ptrs, int *events)
 {
-	int i, rc;
+	int i, n;
 
-	for (i = 0; i < CLIENTS_MAX; i++) {
-		clients[i].socket = -1;
-		rc = pthread_mutex_destroy (&clients[i].events_mtx);
-		if (rc != 0)
-			logit ("Can't destroy events mutex: %s", strerror (rc));
+	if (poll(poll_fds, poll_num, -1) == -1)
+		return -1;
+
+	for (i = 0, n = 0; i < poll_num && n < READY_MAX; i++) {
+		short ev = poll_fds[i].revents;
+
+		if (!ev)
+			continue;
+
+		ptrs[n] = poll_ptrs[i];
+		events[n] = 0;
+		if (ev & (POLLIN | POLLHUP | POLLERR))
+			events[n] |= WATCH_READ;
+		if (ev & (POLLOUT | POLLHUP | POLLERR))
+			events[n] |= WATCH_WRITE;
+		n++;
 	}
+
+	return n;
+}
+#endif
+
+/* Watch the client's socket for commands unless another client holds the
+ * lock, and for writing only while there are events to send.  The rest of
+ * a playlist being sent is read regardless of the lock. */
+static void watch_client (struct client *cli)
+{
+	int watch = 0;
+
+	if (!locking || locking == cli || cli->relay)
+		watch |= WATCH_READ;
+
+	LOCK (cli->events_mtx);
+	if (!event_queue_empty(&cli->events))
+		watch |= WATCH_WRITE;
+	UNLOCK (cli->events_mtx);
+
+	watch_fd (cli->socket, cli, cli->watched, watch);
+	cli->watched = watch;
 }
 
-/* Add a client to the list, return 1 if ok, 0 on error (max clients exceeded) */
-static int add_client (int sock)
+static void watch_all_clients ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket == -1) {
-			clients[i].wants_plist_events = 0;
-			LOCK (clients[i].events_mtx);
-			event_queue_free (&clients[i].events);
-			event_queue_init (&clients[i].events);
-			UNLOCK (clients[i].events_mtx);
-			clients[i].socket = sock;
-			clients[i].requests_plist = 0;
-			clients[i].can_send_plist = 0;
-			clients[i].lock = 0;
-			tags_cache_clear_queue (tags_cache, i);
-			return 1;
-		}
+	for (i = 0; i < clients_num; i++)
+		if (clients[i])
+			watch_client (clients[i]);
+}
 
-	return 0;
+static void clients_init ()
+{
+	watch_init ();
+}
+
+static void clients_cleanup ()
+{
+	free (clients);
+	clients = NULL;
+	clients_num = 0;
+	watch_cleanup ();
 }
 
-/* Return index of a client that has a lock acquired. Return -1 if there is no
- * lock. */
-static int locking_client ()
+/* Add a client to the table using the lowest free id. */
+static void add_client (int sock)
 {
+	struct client *cli;
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1 && clients[i].lock)
-			return i;
-	return -1;
+	cli = (struct client *)xmalloc (sizeof(struct client));
+	cli->socket = sock;
+	cli->wants_plist_events = 0;
+	event_queue_init (&cli->events);
+	pthread_mutex_init (&cli->events_mtx, NULL);
+	cli->requests_plist = 0;
+	cli->can_send_plist = 0;
+	cli->relay = NULL;
+	cli->response = NULL;
+	cli->serial = 0;
+	cli->watched = 0;
+	cli->pending = 0;
+	cli->next_pending = NULL;
+	cli->next_sending = NULL;
+	cli->next_closed = NULL;
+
+	LOCK (clients_mtx);
+	for (i = 0; i < clients_num && clients[i]; i++)
+		;
+	if (i == clients_num) {
+		clients_num = clients_num ? clients_num * 2 : 8;
+		clients = (struct client **)xrealloc (clients,
+				clients_num * sizeof(struct client *));
+		memset (clients + i, 0,
+				(clients_num - i) * sizeof(struct client *));
+	}
+	cli->id = i;
+	clients[i] = cli;
+	UNLOCK (clients_mtx);
+
+	tags_cache_clear_queue (tags_cache, cli->id);
+	watch_client (cli);
+
+	logit ("Client %d connected with fd %d", cli->id, sock);
 }
 
 /* Acquire a lock for this client. Return 0 on error. */
 static int client_lock (struct client *cli)
 {
-	if (cli->lock) {
+	if (locking == cli) {
 		logit ("Client wants deadlock");
 		return 0;
 	}
 
-	assert (locking_client() == -1);
+	assert (locking == NULL);
 
-	cli->lock = 1;
+	locking = cli;
+	watch_all_clients ();
 	logit ("Lock acquired for client with fd %d", cli->socket);
 	return 1;
 }
@@ -205,40 +424,95 @@ static int client_lock (struct client *cli)
 /* Return != 0 if this client holds a lock. */
 static int is_locking (const struct client *cli)
 {
-	return cli->lock;
+	return locking == cli;
 }
 
 /* Release the lock hold by the client. Return 0 on error. */
 static int client_unlock (struct client *cli)
 {
-	if (!cli->lock) {
+	if (!is_locking(cli)) {
 		logit ("Client wants to unlock when there is no lock");
 		return 0;
 	}
 
-	cli->lock = 0;
+	locking = NULL;
+	watch_all_clients ();
 	logit ("Lock released by client with fd %d", cli->socket);
 	return 1;
 }
 
-/* Return the client index from the clients table. */
-static int client_index (const struct client *cli)
+/* Put the client on the list of clients to send events to.  Must be called
+ * with clients_mtx locked. */
+static void set_pending (struct client *cli)
 {
-	int i;
-
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket == cli->socket)
-			return i;
-	return -1;
+	if (!cli->pending) {
+		cli->pending = 1;
+		cli->next_pending = pending_clients;
+		pending_clients = cli;
+	}
 }
 
+/* Close the client's connection and remove it from the table.  Does
+ * nothing if the client was already disconnected. */
 static void del_client (struct client *cli)
 {
+	struct client **p;
+
+	if (cli->socket == -1)
+		return;
+
+	LOCK (clients_mtx);
+	clients[cli->id] = NULL;
+	if (cli->pending) {
+		for (p = &pending_clients; *p != cli; p = &(*p)->next_pending)
+			assert (*p != NULL);
+		*p = cli->next_pending;
+		cli->pending = 0;
+	}
+	UNLOCK (clients_mtx);
+
+	watch_fd (cli->socket, cli, cli->watched, 0);
+	cli->watched = 0;
+	close (cli->socket);
 	cli->socket = -1;
+
 	LOCK (cli->events_mtx);
 	event_queue_free (&cli->events);
-	tags_cache_clear_queue (tags_cache, client_index(cli));
 	UNLOCK (cli->events_mtx);
+	tags_cache_clear_queue (tags_cache, cli->id);
+
+	if (cli->relay) {
+		plist_relay_free (cli->relay);
+		cli->relay = NULL;
+	}
+
+	if (cli->response) {
+		packet_buf_free (cli->response);
+		cli->response = NULL;
+	}
+
+	if (locking == cli) {
+		locking = NULL;
+		watch_all_clients ();
+	}
+
+	cli->next_closed = closed_clients;
+	closed_clients = cli;
+}
+
+static void free_closed_clients ()
+{
+	struct client *cli;
+
+	while ((cli = closed_clients)) {
+		int rc;
+
+		closed_clients = cli->next_closed;
+		rc = pthread_mutex_destroy (&cli->events_mtx);
+		if (rc != 0)
+			logit ("Can't destroy events mutex: %s", strerror (rc));
+		free (cli);
+	}
 }
 
 /* Check if the process with given PID exists. Return != 0 if so. */
@@ -372,8 +646,10 @@ int server_init (int debugging, int foreground)
 
 	clients_init ();
 	audio_initialize ();
-	tags_cache = tags_cache_new (options_get_int("TagsCacheSize"));
+	tags_cache = tags_cache_new (options_get_int("TagsCacheSize"),
+	                             options_get_int("TagsReaderThreads"));
 	tags_cache_load (tags_cache, create_file_name("cache"));
+	library = library_new (tags_cache);
 
 	server_tid = pthread_self ();
 	thread_signal (SIGTERM, sig_exit);
@@ -394,33 +670,61 @@ int server_init (int debugging, int foreground)
 	return server_sock;
 }
 
-/* Send EV_DATA and the integer value. Return 0 on error. */
-static int send_data_int (const struct client *cli, const int data)
+/* Return the buffer for the response to the command being handled.  The
+ * response is queued for sending when the command is done. */
+static struct packet_buf *response_buf (struct client *cli)
 {
 	assert (cli->socket != -1);
 
-	if (!send_int(cli->socket, EV_DATA) || !send_int(cli->socket, data))
-		return 0;
+	if (!cli->response)
+		cli->response = packet_buf_new ();
 
-	return 1;
+	return cli->response;
 }
 
-/* Send EV_DATA and the boolean value. Return 0 on error. */
-static int send_data_bool (const struct client *cli, const bool data)
+/* Queue the response to the command for sending after the events
+ * queued before. */
+static void queue_response (struct client *cli)
 {
-	assert (cli->socket != -1);
+	struct event_packet *packet;
 
-	if (!send_int(cli->socket, EV_DATA) ||
-	    !send_int(cli->socket, data ? 1 : 0))
-		return 0;
+	if (!cli->response)
+		return;
+
+	packet = event_packet_from_buf (EV_DATA, cli->response);
+	cli->response = NULL;
+
+	LOCK (cli->events_mtx);
+	event_push_packet (&cli->events, packet);
+	UNLOCK (cli->events_mtx);
+
+	event_packet_unref (packet);
+}
+
+/* Add EV_DATA and the integer value to the response. */
+static int send_data_int (struct client *cli, const int data)
+{
+	packet_buf_add_int (response_buf (cli), EV_DATA);
+	packet_buf_add_int (cli->response, data);
 
 	return 1;
 }
 
-/* Send EV_DATA and the string value. Return 0 on error. */
-static int send_data_str (const struct client *cli, const char *str) {
-	if (!send_int(cli->socket, EV_DATA) || !send_str(cli->socket, str))
-		return 0;
+/* Add EV_DATA and the boolean value to the response. */
+static int send_data_bool (struct client *cli, const bool data)
+{
+	packet_buf_add_int (response_buf (cli), EV_DATA);
+	packet_buf_add_int (cli->response, data ? 1 : 0);
+
+	return 1;
+}
+
+/* Add EV_DATA and the string value to the response. */
+static int send_data_str (struct client *cli, const char *str)
+{
+	packet_buf_add_int (response_buf (cli), EV_DATA);
+	packet_buf_add_str (cli->response, str);
+
 	return 1;
 }
 
@@ -599,10 +903,14 @@ static inline bool is_plist_event (const int event)
 	return result;
 }
 
+/* Add the event to the queues of all clients.  It is serialized only
+ * once and the packet is shared by the queues, the data remains owned by
+ * the caller. */
 static void add_event_all (const int event, const void *data)
 {
 	int i;
 	int added = 0;
+	struct event_packet *packet = NULL;
 
 	if (event == EV_STATE) {
 		switch (audio_get_state()) {
@@ -615,39 +923,29 @@ static void add_event_all (const int event, const void *data)
 		}
 	}
 
-	for (i = 0; i < CLIENTS_MAX; i++) {
-		void *data_copy = NULL;
+	LOCK (clients_mtx);
+	for (i = 0; i < clients_num; i++) {
+		struct client *cli = clients[i];
 
-		if (clients[i].socket == -1)
+		if (!cli)
 			continue;
 
-		if (!clients[i].wants_plist_events && is_plist_event (event))
+		if (!cli->wants_plist_events && is_plist_event (event))
 			continue;
 
-		if (data) {
-			if (event == EV_PLIST_ADD
-					|| event == EV_QUEUE_ADD) {
-				data_copy = plist_new_item ();
-				plist_item_copy (data_copy, data);
-			}
-			else if (event == EV_PLIST_DEL
-					|| event == EV_QUEUE_DEL
-					|| event == EV_STATUS_MSG
-					|| event == EV_SRV_ERROR) {
-				data_copy = xstrdup (data);
-			}
-			else if (event == EV_PLIST_MOVE
-					|| event == EV_QUEUE_MOVE)
-				data_copy = move_ev_data_dup (
-						(struct move_ev_data *)
-						data);
-			else
-				logit ("Unhandled data!");
-		}
+		if (!packet)
+			packet = event_packet_new (event, data);
 
-		add_event (&clients[i], event, data_copy);
+		LOCK (cli->events_mtx);
+		event_push_packet (&cli->events, packet);
+		UNLOCK (cli->events_mtx);
+		set_pending (cli);
 		added++;
 	}
+	UNLOCK (clients_mtx);
+
+	if (packet)
+		event_packet_unref (packet);
 
 	if (added)
 		wake_up_server ();
@@ -670,20 +968,39 @@ static int flush_events (struct client *cli)
 	return st != NB_IO_ERR ? 1 : 0;
 }
 
-/* Send events to clients whose sockets are ready to write. */
-static void send_events (fd_set *fds)
+/* Try to send the events queued for the client and watch its socket for
+ * writing if some are left. */
+static void send_events (struct client *cli)
 {
-	int i;
+	debug ("Flushing events for client %d", cli->id);
+	if (!flush_events (cli))
+		del_client (cli);
+	else
+		watch_client (cli);
+}
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1
-				&& FD_ISSET(clients[i].socket, fds)) {
-			debug ("Flushing events for client %d", i);
-			if (!flush_events (&clients[i])) {
-				close (clients[i].socket);
-				del_client (&clients[i]);
-			}
-		}
+/* Send events to clients which got them from other threads since the last
+ * iteration of the server loop. */
+static void send_pending_events ()
+{
+	struct client *cli, *sending;
+
+	/* Other threads can put the clients on the list again as soon as we
+	 * unlock, so link them through next_sending. */
+	LOCK (clients_mtx);
+	sending = pending_clients;
+	for (cli = pending_clients; cli; cli = cli->next_pending) {
+		cli->pending = 0;
+		cli->next_sending = cli->next_pending;
+	}
+	pending_clients = NULL;
+	UNLOCK (clients_mtx);
+
+	while ((cli = sending)) {
+		sending = cli->next_sending;
+		if (cli->socket != -1)
+			send_events (cli);
+	}
 }
 
 /* End playing and cleanup. */
@@ -691,6 +1008,8 @@ static void server_shutdown ()
 {
 	logit ("Server exiting...");
 	audio_exit ();
+	library_free (library);
+	library = NULL;
 	tags_cache_save (tags_cache, create_file_name("tags_cache"));
 	tags_cache_free (tags_cache);
 	tags_cache = NULL;
@@ -702,14 +1021,6 @@ static void server_shutdown ()
 	log_close ();
 }
 
-/* Send EV_BUSY message and close the connection. */
-static void busy (int sock)
-{
-	logit ("Closing connection due to maximum number of clients reached");
-	send_int (sock, EV_BUSY);
-	close (sock);
-}
-
 /* Handle CMD_LIST_ADD, return 1 if ok or 0 on error. */
 static int req_list_add (struct client *cli)
 {
@@ -928,20 +1239,20 @@ static int req_queue_del (const struct client *cli)
 
 /* Return the index of the first client able to send the playlist or -1 if
  * there isn't any. */
-static int find_sending_plist ()
+static struct client *find_sending_plist ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1 && clients[i].can_send_plist)
-			return i;
-	return -1;
+	for (i = 0; i < clients_num; i++)
+		if (clients[i] && clients[i]->can_send_plist)
+			return clients[i];
+	return NULL;
 }
 
 /* Handle CMD_GET_PLIST. Return 0 on error. */
 static int get_client_plist (struct client *cli)
 {
-	int first;
+	struct client *first;
 
 	debug ("Client with fd %d requests the playlist", cli->socket);
 
@@ -952,7 +1263,7 @@ static int get_client_plist (struct client *cli)
 	cli->requests_plist = 1;
 
 	first = find_sending_plist ();
-	if (first == -1) {
+	if (!first) {
 		debug ("No clients with the playlist");
 		cli->requests_plist = 0;
 		if (!send_data_int(cli, 0))
@@ -963,93 +1274,77 @@ static int get_client_plist (struct client *cli)
 	if (!send_data_int(cli, 1))
 		return 0;
 
-	if (!send_int(clients[first].socket, EV_SEND_PLIST))
-		return 0;
+	/* Queue the request so it can't get in the middle of an event
+	 * being sent. */
+	add_event (first, EV_SEND_PLIST, NULL);
+	send_events (first);
 
-	return 1;
+	return first->socket != -1 ? 1 : 0;
 }
 
 /* Find the client requesting the playlist. */
-static int find_cli_requesting_plist ()
+static struct client *find_cli_requesting_plist ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].requests_plist)
-			return i;
-	return -1;
+	for (i = 0; i < clients_num; i++)
+		if (clients[i] && clients[i]->requests_plist)
+			return clients[i];
+	return NULL;
 }
 
-/* Handle CMD_SEND_PLIST. Some client requested to get the playlist, so we asked
- * another client to send it (EV_SEND_PLIST). */
-static int req_send_plist (struct client *cli)
+/* Receive the part of the playlist the client is sending that is
+ * available now.  When it's complete, queue it for the client which
+ * requested it.  Return 0 on error. */
+static int recv_plist_relay (struct client *cli)
 {
-	int requesting = find_cli_requesting_plist ();
-	int send_fd;
-	struct plist_item *item;
-	int serial;
+	struct client *requesting;
+	struct event_packet *packet;
 
-	debug ("Client with fd %d wants to send its playlists", cli->socket);
-
-	if (requesting == -1) {
-		logit ("No clients are requesting the playlist");
-		send_fd = -1;
-	}
-	else {
-		send_fd = clients[requesting].socket;
-		if (!send_int(send_fd, EV_DATA)) {
-			logit ("Error while sending response; disconnecting the client");
-			close (send_fd);
-			del_client (&clients[requesting]);
-			send_fd = -1;
-		}
+	switch (plist_relay_recv(cli->socket, cli->relay)) {
+		case NB_IO_BLOCK:
+			return 1;
+		case NB_IO_ERR:
+			logit ("Error while receiving the playlist");
+			plist_relay_free (cli->relay);
+			cli->relay = NULL;
+			return 0;
+		case NB_IO_OK:
+			break;
 	}
 
-	if (!get_int(cli->socket, &serial)) {
-		logit ("Error while getting serial");
-		return 0;
+	logit ("Playlist received");
+	packet = plist_relay_packet (cli->relay);
+	cli->relay = NULL;
+
+	/* Even if no clients are requesting the playlist, we must have read
+	 * it, because there is no way to say that we don't need it. */
+	requesting = find_cli_requesting_plist ();
+	if (requesting) {
+		LOCK (requesting->events_mtx);
+		event_push_packet (&requesting->events, packet);
+		UNLOCK (requesting->events_mtx);
+		requesting->requests_plist = 0;
+		send_events (requesting);
 	}
+	else
+		logit ("No clients are requesting the playlist");
 
-	if (send_fd != -1 && !send_int(send_fd, serial)) {
-		error ("Error while sending serial; disconnecting the client");
-		close (send_fd);
-		del_client (&clients[requesting]);
-		send_fd = -1;
-	}
+	event_packet_unref (packet);
 
-	/* Even if no clients are requesting the playlist, we must read it,
-	 * because there is no way to say that we don't need it. */
-	while ((item = recv_item(cli->socket)) && item->file[0]) {
-		if (send_fd != -1 && !send_item(send_fd, item)) {
-			logit ("Error while sending item; disconnecting the client");
-			close (send_fd);
-			del_client (&clients[requesting]);
-			send_fd = -1;
-		}
-		plist_free_item_fields (item);
-		free (item);
-	}
-
-	if (item) {
-		plist_free_item_fields (item);
-		free (item);
-		logit ("Playlist sent");
-	}
-	else
-		logit ("Error while receiving item");
+	return 1;
+}
 
-	if (send_fd != -1 && !send_item (send_fd, NULL)) {
-		logit ("Error while sending end of playlist mark; "
-		       "disconnecting the client");
-		close (send_fd);
-		del_client (&clients[requesting]);
-		return 0;
-	}
+/* Handle CMD_SEND_PLIST. Some client requested to get the playlist, so we asked
+ * another client to send it (EV_SEND_PLIST).  The playlist is received as it
+ * comes in without blocking the server and sent on as a whole. */
+static int req_send_plist (struct client *cli)
+{
+	debug ("Client with fd %d wants to send its playlists", cli->socket);
 
-	if (requesting != -1)
-		clients[requesting].requests_plist = 0;
+	cli->relay = plist_relay_new ();
 
-	return item ? 1 : 0;
+	return recv_plist_relay (cli);
 }
 
 /* Client requested we send the queue so we get it from audio.c and
@@ -1058,39 +1353,23 @@ static int req_send_queue (struct client *cli)
 {
 	int i;
 	struct plist *queue;
+	struct packet_buf *b;
 
 	logit ("Client with fd %d wants queue... sending it", cli->socket);
 
-	if (!send_int(cli->socket, EV_DATA)) {
-		logit ("Error while sending response; disconnecting the client");
-		close (cli->socket);
-		del_client (cli);
-		return 0;
-	}
+	b = response_buf (cli);
+	packet_buf_add_int (b, EV_DATA);
 
 	queue = audio_queue_get_contents ();
 
 	for (i = 0; i < queue->num; i++)
-		if (!plist_deleted(queue, i)) {
-			if(!send_item(cli->socket, &queue->items[i])){
-				logit ("Error sending queue; disconnecting the client");
-				close (cli->socket);
-				del_client (cli);
-				free (queue);
-				return 0;
-			}
-		}
+		if (!plist_deleted(queue, i))
+			packet_buf_add_item (b, &queue->items[i]);
 
 	plist_free (queue);
 	free (queue);
 
-	if (!send_item (cli->socket, NULL)) {
-		logit ("Error while sending end of playlist mark; "
-		       "disconnecting the client");
-		close (cli->socket);
-		del_client (cli);
-		return 0;
-	}
+	packet_buf_add_item (b, NULL);
 
 	logit ("Queue sent");
 	return 1;
@@ -1183,13 +1462,13 @@ static int gen_serial (const struct client *cli)
 	int serial;
 
 	/* Each client must always get a different serial number, so we use
-	 * also the client index to generate it. It must also not be used by
+	 * also the client id to generate it. It must also not be used by
 	 * our playlist to not confuse clients.
 	 * There can be 256 different serial number per client, but it's
 	 * enough since clients use only two playlists. */
 
 	do {
-		serial = (seed << 8) | client_index(cli);
+		serial = (cli->id << 8) | seed;
 		seed = (seed + 1) & 0xFF;
 	} while (serial == audio_plist_get_serial());
 
@@ -1212,25 +1491,18 @@ static int send_serial (struct client *cli)
 static int req_get_tags (struct client *cli)
 {
 	struct file_tags *tags;
-	int res = 1;
 
 	debug ("Sending tags to client with fd %d...", cli->socket);
 
-	if (!send_int(cli->socket, EV_DATA)) {
-		logit ("Error when sending EV_DATA");
-		return 0;
-	}
+	packet_buf_add_int (response_buf (cli), EV_DATA);
 
 	tags = audio_get_curr_tags ();
-	if (!send_tags(cli->socket, tags)) {
-		logit ("Error when sending tags");
-		res = 0;
-	}
+	packet_buf_add_tags (cli->response, tags);
 
 	if (tags)
 		tags_free (tags);
 
-	return res;
+	return 1;
 }
 
 /* Handle CMD_GET_MIXER_CHANNEL_NAME. Return 0 on error. */
@@ -1331,37 +1603,106 @@ void req_toggle_make_mono()
 }
 
 /* Handle CMD_GET_FILE_TAGS. Return 0 on error. */
-static int get_file_tags (const int cli_id)
+static int get_file_tags (struct client *cli)
 {
 	char *file;
 	int tags_sel;
 
-	if (!(file = get_str(clients[cli_id].socket)))
+	if (!(file = get_str(cli->socket)))
 		return 0;
-	if (!get_int(clients[cli_id].socket, &tags_sel)) {
+	if (!get_int(cli->socket, &tags_sel)) {
 		free (file);
 		return 0;
 	}
 
-	tags_cache_add_request (tags_cache, file, tags_sel, cli_id);
+	tags_cache_add_request (tags_cache, file, tags_sel, cli->id);
+	free (file);
+
+	return 1;
+}
+
+static int abort_tags_requests (struct client *cli)
+{
+	char *file;
+
+	if (!(file = get_str(cli->socket)))
+		return 0;
+
+	tags_cache_clear_up_to (tags_cache, file, cli->id);
 	free (file);
 
 	return 1;
 }
 
-static int abort_tags_requests (const int cli_id)
+/* Handle CMD_PRIORITIZE_TAGS. Return 0 on error. */
+static int prioritize_tags (struct client *cli)
 {
 	char *file;
 
-	if (!(file = get_str(clients[cli_id].socket)))
+	if (!(file = get_str(cli->socket)))
 		return 0;
 
-	tags_cache_clear_up_to (tags_cache, file, cli_id);
+	tags_cache_prioritize (tags_cache, file, cli->id);
 	free (file);
 
 	return 1;
 }
 
+/* Start indexing MusicDir for the library. */
+static void update_library ()
+{
+	const char *music_dir_optn;
+	char music_dir[PATH_MAX] = "/";
+
+	music_dir_optn = options_get_str ("MusicDir");
+	if (!music_dir_optn) {
+		logit ("MusicDir not defined, not indexing the library");
+		return;
+	}
+
+	resolve_path (music_dir, sizeof(music_dir), music_dir_optn);
+	if (file_type (music_dir) != F_DIR) {
+		logit ("MusicDir is not a directory, not indexing the library");
+		return;
+	}
+
+	library_update (library, music_dir);
+}
+
+/* Handle CMD_LIBRARY_QUERY: send the library state and the matching items.
+ * Return 0 on error. */
+static int req_library_query (struct client *cli)
+{
+	char *pattern;
+	int max, state, i;
+	struct plist results;
+
+	if (!(pattern = get_str(cli->socket)))
+		return 0;
+	if (!get_int(cli->socket, &max)) {
+		free (pattern);
+		return 0;
+	}
+
+	/* The library is indexed when it's first needed. */
+	if (library_state (library) == LIBRARY_EMPTY)
+		update_library ();
+
+	plist_init (&results);
+	state = library_query (library, pattern, MAX(max, 0), &results);
+	free (pattern);
+
+	send_data_int (cli, state);
+
+	for (i = 0; i < results.num; i++)
+		packet_buf_add_item (cli->response, &results.items[i]);
+	packet_buf_add_item (cli->response, NULL);
+
+	plist_free (&results);
+
+	return 1;
+}
+
 /* Handle CMD_LIST_MOVE. Return 0 on error. */
 static int req_list_move (struct client *cli)
 {
@@ -1412,15 +1753,13 @@ static int req_queue_move (const struct client *cli)
 }
 
 /* Receive a command from the client and execute it. */
-static void handle_command (const int client_id)
+static void handle_command (struct client *cli)
 {
 	int cmd;
 	int err = 0;
-	struct client *cli = &clients[client_id];
 
 	if (!get_int(cli->socket, &cmd)) {
 		logit ("Failed to get command from the client");
-		close (cli->socket);
 		del_client (cli);
 		return;
 	}
@@ -1444,7 +1783,6 @@ static void handle_command (const int client_id)
 			break;
 		case CMD_DISCONNECT:
 			logit ("Client disconnected");
-			close (cli->socket);
 			del_client (cli);
 			break;
 		case CMD_PAUSE:
@@ -1499,8 +1837,7 @@ static void handle_command (const int client_id)
 			audio_prev ();
 			break;
 		case CMD_PING:
-			if (!send_int(cli->socket, EV_PONG))
-				err = 1;
+			packet_buf_add_int (response_buf (cli), EV_PONG);
 			break;
 		case CMD_GET_OPTION:
 			if (!send_option(cli))
@@ -1579,11 +1916,15 @@ static void handle_command (const int client_id)
 				err = 1;
 			break;
 		case CMD_GET_FILE_TAGS:
-			if (!get_file_tags(client_id))
+			if (!get_file_tags(cli))
 				err = 1;
 			break;
 		case CMD_ABORT_TAGS_REQUESTS:
-			if (!abort_tags_requests(client_id))
+			if (!abort_tags_requests(cli))
+				err = 1;
+			break;
+		case CMD_PRIORITIZE_TAGS:
+			if (!prioritize_tags(cli))
 				err = 1;
 			break;
 		case CMD_LIST_MOVE:
@@ -1626,6 +1967,13 @@ static void handle_command (const int client_id)
 			if (!req_send_queue(cli))
 				err = 1;
 			break;
+		case CMD_LIBRARY_QUERY:
+			if (!req_library_query(cli))
+				err = 1;
+			break;
+		case CMD_LIBRARY_UPDATE:
+			update_library ();
+			break;
 		default:
 			logit ("Bad command (0x%x) from the client", cmd);
 			err = 1;
@@ -1633,58 +1981,38 @@ static void handle_command (const int client_id)
 
 	if (err) {
 		logit ("Closing client connection due to error");
-		close (cli->socket);
 		del_client (cli);
 	}
 }
 
-/* Add clients file descriptors to fds. */
-static void add_clients_fds (fd_set *read, fd_set *write)
-{
-	int i;
-
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1) {
-			if (locking_client() == -1 || is_locking(&clients[i]))
-				FD_SET (clients[i].socket, read);
-
-			LOCK (clients[i].events_mtx);
-			if (!event_queue_empty(&clients[i].events))
-				FD_SET (clients[i].socket, write);
-			UNLOCK (clients[i].events_mtx);
-		}
-}
-
-/* Return the maximum fd from clients and the argument. */
-static int max_fd (int max)
+/* Handle a client whose socket is ready. */
+static void handle_client (struct client *cli, const int events)
 {
-	int i;
+	if (events & WATCH_WRITE)
+		send_events (cli);
 
-	if (wake_up_pipe[0] > max)
-		max = wake_up_pipe[0];
-
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket > max)
-			max = clients[i].socket;
-	return max;
-}
-
-/* Handle clients whose fds are ready to read. */
-static void handle_clients (fd_set *fds)
-{
-	int i;
-
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1
-				&& FD_ISSET(clients[i].socket, fds)) {
-			if (locking_client() == -1
-					|| is_locking(&clients[i]))
-				handle_command (i);
-			else
-				debug ("Not getting a command from client with"
-						" fd %d because of lock",
-						clients[i].socket);
+	if (cli->socket != -1 && (events & WATCH_READ) && cli->relay) {
+		if (!recv_plist_relay (cli))
+			del_client (cli);
+		else if (!cli->relay)
+			watch_client (cli);
+	}
+	else if (cli->socket != -1 && (events & WATCH_READ)) {
+		if (!locking || is_locking(cli)) {
+			handle_command (cli);
+
+			/* Send the response with any events queued in the
+			 * meantime, the command could also change the
+			 * lock. */
+			if (cli->socket != -1) {
+				queue_response (cli);
+				send_events (cli);
+			}
 		}
+		else
+			debug ("Not getting a command from client with"
+					" fd %d because of lock", cli->socket);
+	}
 }
 
 /* Close all client connections sending EV_EXIT. */
@@ -1692,12 +2020,13 @@ static void close_clients ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1) {
-			send_int (clients[i].socket, EV_EXIT);
-			close (clients[i].socket);
-			del_client (&clients[i]);
+	for (i = 0; i < clients_num; i++)
+		if (clients[i]) {
+			send_int (clients[i]->socket, EV_EXIT);
+			del_client (clients[i]);
 		}
+
+	free_closed_clients ();
 }
 
 /* Handle incoming connections */
@@ -1711,30 +2040,31 @@ void server_loop (int list_sock)
 
 	log_circular_start ();
 
+	watch_fd (list_sock, &listen_tag, 0, WATCH_READ);
+	watch_fd (wake_up_pipe[0], &wake_up_tag, 0, WATCH_READ);
+
 	do {
-		int res;
-		fd_set fds_write, fds_read;
+		int i, res;
+		void *ready[READY_MAX];
+		int events[READY_MAX];
 
-		FD_ZERO (&fds_read);
-		FD_ZERO (&fds_write);
-		FD_SET (list_sock, &fds_read);
-		FD_SET (wake_up_pipe[0], &fds_read);
-		add_clients_fds (&fds_read, &fds_write);
+		send_pending_events ();
+		free_closed_clients ();
 
 		if (!server_quit)
-			res = select (max_fd(list_sock)+1, &fds_read,
-					&fds_write, NULL, NULL);
+			res = watch_wait (ready, events);
 		else
 			res = 0;
 
 		if (res == -1 && errno != EINTR && !server_quit) {
 			int err = errno;
 
-			logit ("select() failed: %s", strerror(err));
-			fatal ("select() failed: %s", strerror(err));
+			logit ("Waiting for events failed: %s", strerror(err));
+			fatal ("Waiting for events failed: %s", strerror(err));
 		}
-		else if (!server_quit && res >= 0) {
-			if (FD_ISSET(list_sock, &fds_read)) {
+
+		for (i = 0; !server_quit && i < res; i++) {
+			if (ready[i] == &listen_tag) {
 				int client_sock;
 
 				debug ("accept()ing connection...");
@@ -1745,21 +2075,26 @@ void server_loop (int list_sock)
 				if (client_sock == -1)
 					fatal ("accept() failed: %s", strerror(errno));
 				logit ("Incoming connection");
-				if (!add_client(client_sock))
-					busy (client_sock);
+				add_client (client_sock);
 			}
-
-			if (FD_ISSET(wake_up_pipe[0], &fds_read)) {
-				int w;
+			else if (ready[i] == &wake_up_tag) {
+				int w[64];
 
 				logit ("Got 'wake up'");
 
-				if (read(wake_up_pipe[0], &w, sizeof(w)) < 0)
+				/* Consume all wake ups written so far, the
+				 * pending events are sent at once anyway. */
+				if (read(wake_up_pipe[0], w, sizeof(w)) < 0)
 					fatal ("Can't read wake up signal: %s", strerror(errno));
 			}
+			else {
+				struct client *cli = (struct client *)ready[i];
 
-			send_events (&fds_write);
-			handle_clients (&fds_read);
+				/* It could have been disconnected while
+				 * handling the previous descriptors. */
+				if (cli->socket != -1)
+					handle_client (cli, events[i]);
+			}
 		}
 
 		if (server_quit)
@@ -1826,9 +2161,10 @@ void tags_response (const int client_id, const char *file,
 {
 	assert (file != NULL);
 	assert (tags != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (client_id >= 0);
 
-	if (clients[client_id].socket != -1) {
+	LOCK (clients_mtx);
+	if (client_id < clients_num && clients[client_id]) {
 		struct tag_ev_response *data
 			= (struct tag_ev_response *)xmalloc (
 					sizeof(struct tag_ev_response));
@@ -1836,9 +2172,13 @@ void tags_response (const int client_id, const char *file,
 		data->file = xstrdup (file);
 		data->tags = tags_dup (tags);
 
-		add_event (&clients[client_id], EV_FILE_TAGS, data);
+		add_event (clients[client_id], EV_FILE_TAGS, data);
+		set_pending (clients[client_id]);
+		UNLOCK (clients_mtx);
 		wake_up_server ();
 	}
+	else
+		UNLOCK (clients_mtx);
 }
 
 void ev_audio_start ()
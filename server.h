@@ -7,8 +7,6 @@ extern "C" {
 
 #include "playlist.h"
 
-#define CLIENTS_MAX	10
-
 int server_init (int debug, int foreground);
 void server_loop (int list_sock);
 void server_error (const char *msg);
@@ -0,0 +1,857 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Vectorised sample processing kernels.  SSE2 is used where the compiler
+ * targets it (always on x86-64), AVX2 is selected at run time if the CPU
+ * has it and NEON is used on AArch64.  Every kernel must give exactly the
+ * same result as the scalar loop it stands in for in audio_conversion.c or
+ * softmixer.c. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "simd.h"
+#include "log.h"
+
+#if defined(HAVE_SIMD) && defined(HAVE_EMMINTRIN_H) && defined(__SSE2__)
+# define USE_SSE2
+# include <emmintrin.h>
+#endif
+
+#if defined(HAVE_SIMD) && defined(HAVE_IMMINTRIN_H) \
+	&& defined(HAVE_AVX2_TARGET)
+# define USE_AVX2
+# include <immintrin.h>
+#endif
+
+#if defined(HAVE_SIMD) && defined(HAVE_ARM_NEON_H) && defined(__aarch64__)
+# define USE_NEON
+# include <arm_neon.h>
+#endif
+
+/* The largest float below 2^31.  Clamping to it before the conversion to
+ * int32 gives the same result as the explicit clipping in
+ * float_to_s16_sample(). */
+#define FLOAT_BELOW_2_31	2147483520.0f
+
+/* The scale kernels compute in float, which is exact as long as
+ * sample * percent fits in 24 bits.  SOFTMIXER_MAX is well within this. */
+
+static size_t scalar_float_to_s16 (const float *in ATTR_UNUSED,
+		int16_t *out ATTR_UNUSED, const size_t samples ATTR_UNUSED)
+{
+	return 0;
+}
+
+static size_t scalar_s16_to_float (const int16_t *in ATTR_UNUSED,
+		float *out ATTR_UNUSED, const size_t samples ATTR_UNUSED)
+{
+	return 0;
+}
+
+static size_t scalar_s32_to_s16 (const int32_t *in ATTR_UNUSED,
+		int16_t *out ATTR_UNUSED, const size_t samples ATTR_UNUSED)
+{
+	return 0;
+}
+
+static size_t scalar_scale_s16 (int16_t *buf ATTR_UNUSED,
+		const size_t samples ATTR_UNUSED, const int percent ATTR_UNUSED)
+{
+	return 0;
+}
+
+static size_t scalar_scale_float (float *buf ATTR_UNUSED,
+		const size_t samples ATTR_UNUSED,
+		const float factor ATTR_UNUSED)
+{
+	return 0;
+}
+
+static size_t scalar_mix_stereo_s16 (int16_t *buf ATTR_UNUSED,
+		const size_t samples ATTR_UNUSED)
+{
+	return 0;
+}
+
+static size_t scalar_mix_stereo_float (float *buf ATTR_UNUSED,
+		const size_t samples ATTR_UNUSED)
+{
+	return 0;
+}
+
+static size_t scalar_biquad_cascade (float *buf ATTR_UNUSED,
+		const size_t frames ATTR_UNUSED, const int lanes ATTR_UNUSED,
+		const int bands ATTR_UNUSED, const float *coef ATTR_UNUSED,
+		float *state ATTR_UNUSED)
+{
+	return 0;
+}
+
+static const struct simd_kernels scalar_kernels = {
+	"scalar",
+	scalar_float_to_s16,
+	scalar_s16_to_float,
+	scalar_s32_to_s16,
+	scalar_scale_s16,
+	scalar_scale_float,
+	scalar_mix_stereo_s16,
+	scalar_mix_stereo_float,
+	scalar_biquad_cascade
+};
+
+#ifdef USE_SSE2
+
+#ifdef HAVE_LRINTF
+# define sse2_cvt_ps_epi32 _mm_cvtps_epi32
+#else
+# define sse2_cvt_ps_epi32 _mm_cvttps_epi32
+#endif
+
+static size_t sse2_float_to_s16 (const float *in, int16_t *out,
+		const size_t samples)
+{
+	const __m128 scale = _mm_set1_ps ((float)INT32_MAX);
+	const __m128 lo = _mm_set1_ps ((float)INT32_MIN);
+	const __m128 hi = _mm_set1_ps (FLOAT_BELOW_2_31);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128 a = _mm_mul_ps (_mm_loadu_ps (in + i), scale);
+		__m128 b = _mm_mul_ps (_mm_loadu_ps (in + i + 4), scale);
+		__m128i ia, ib;
+
+		a = _mm_min_ps (_mm_max_ps (a, lo), hi);
+		b = _mm_min_ps (_mm_max_ps (b, lo), hi);
+		ia = _mm_srai_epi32 (sse2_cvt_ps_epi32 (a), 16);
+		ib = _mm_srai_epi32 (sse2_cvt_ps_epi32 (b), 16);
+		_mm_storeu_si128 ((__m128i *)(out + i),
+				_mm_packs_epi32 (ia, ib));
+	}
+
+	return i;
+}
+
+static size_t sse2_s16_to_float (const int16_t *in, float *out,
+		const size_t samples)
+{
+	const __m128 scale = _mm_set1_ps (1.0f / (INT16_MAX + 1));
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(in + i));
+		__m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+		__m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16);
+
+		_mm_storeu_ps (out + i, _mm_mul_ps (_mm_cvtepi32_ps (lo), scale));
+		_mm_storeu_ps (out + i + 4,
+				_mm_mul_ps (_mm_cvtepi32_ps (hi), scale));
+	}
+
+	return i;
+}
+
+static size_t sse2_s32_to_s16 (const int32_t *in, int16_t *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i a = _mm_loadu_si128 ((const __m128i *)(in + i));
+		__m128i b = _mm_loadu_si128 ((const __m128i *)(in + i + 4));
+
+		_mm_storeu_si128 ((__m128i *)(out + i),
+				_mm_packs_epi32 (_mm_srai_epi32 (a, 16),
+					_mm_srai_epi32 (b, 16)));
+	}
+
+	return i;
+}
+
+static inline __m128i sse2_scale_epi32 (const __m128i v, const __m128 factor)
+{
+	const __m128 hundred = _mm_set1_ps (100.0f);
+
+	return _mm_cvttps_epi32 (_mm_div_ps (_mm_mul_ps (_mm_cvtepi32_ps (v),
+					factor), hundred));
+}
+
+static size_t sse2_scale_s16 (int16_t *buf, const size_t samples,
+		const int percent)
+{
+	const __m128 factor = _mm_set1_ps ((float)percent);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(buf + i));
+		__m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+		__m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16);
+
+		_mm_storeu_si128 ((__m128i *)(buf + i),
+				_mm_packs_epi32 (sse2_scale_epi32 (lo, factor),
+					sse2_scale_epi32 (hi, factor)));
+	}
+
+	return i;
+}
+
+static size_t sse2_scale_float (float *buf, const size_t samples,
+		const float factor)
+{
+	const __m128 f = _mm_set1_ps (factor);
+	const __m128 lo = _mm_set1_ps (-1.0f);
+	const __m128 hi = _mm_set1_ps (1.0f);
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		__m128 v = _mm_mul_ps (_mm_loadu_ps (buf + i), f);
+
+		_mm_storeu_ps (buf + i, _mm_min_ps (hi, _mm_max_ps (lo, v)));
+	}
+
+	return i;
+}
+
+static size_t sse2_mix_stereo_s16 (int16_t *buf, const size_t samples)
+{
+	const __m128i ones = _mm_set1_epi16 (1);
+	const __m128i low_half = _mm_set1_epi32 (0xffff);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(buf + i));
+		__m128i sum = _mm_madd_epi16 (v, ones);
+		__m128i mono;
+
+		/* divide by 2 rounding toward zero */
+		mono = _mm_srai_epi32 (_mm_add_epi32 (sum,
+					_mm_srli_epi32 (sum, 31)), 1);
+		mono = _mm_or_si128 (_mm_and_si128 (mono, low_half),
+				_mm_slli_epi32 (mono, 16));
+		_mm_storeu_si128 ((__m128i *)(buf + i), mono);
+	}
+
+	return i;
+}
+
+static size_t sse2_mix_stereo_float (float *buf, const size_t samples)
+{
+	const __m128 zero = _mm_setzero_ps ();
+	const __m128 half = _mm_set1_ps (0.5f);
+	const __m128 lo = _mm_set1_ps (-1.0f);
+	const __m128 hi = _mm_set1_ps (1.0f);
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		__m128 v = _mm_loadu_ps (buf + i);
+		__m128 l = _mm_shuffle_ps (v, v, _MM_SHUFFLE(2, 2, 0, 0));
+		__m128 r = _mm_shuffle_ps (v, v, _MM_SHUFFLE(3, 3, 1, 1));
+		__m128 mono;
+
+		mono = _mm_mul_ps (_mm_add_ps (_mm_add_ps (zero, l), r), half);
+		_mm_storeu_ps (buf + i, _mm_min_ps (hi, _mm_max_ps (lo, mono)));
+	}
+
+	return i;
+}
+
+/* Run the lanes [lane, lane + 4) of every frame through the filter
+ * cascade.  The expression is evaluated in the same order as in
+ * apply_biquads(). */
+static void sse2_biquad_lanes (float *buf, const size_t frames,
+		const int lanes, const int bands, const float *coef,
+		float *state, const int lane)
+{
+	const size_t n = (size_t)bands * lanes;
+	size_t f;
+
+	for (f = 0; f < frames; f++) {
+		float *frame = buf + f * lanes + lane;
+		__m128 s = _mm_loadu_ps (frame);
+		int b;
+
+		for (b = 0; b < bands; b++) {
+			const size_t i = (size_t)b * lanes + lane;
+			__m128 x1 = _mm_loadu_ps (state + i);
+			__m128 x2 = _mm_loadu_ps (state + n + i);
+			__m128 y1 = _mm_loadu_ps (state + 2 * n + i);
+			__m128 y2 = _mm_loadu_ps (state + 3 * n + i);
+			__m128 y;
+
+			y = _mm_mul_ps (s, _mm_loadu_ps (coef + i));
+			y = _mm_add_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + n + i), x1));
+			y = _mm_add_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + 2 * n + i),
+						x2));
+			y = _mm_sub_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + 3 * n + i),
+						y1));
+			y = _mm_sub_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + 4 * n + i),
+						y2));
+
+			_mm_storeu_ps (state + n + i, x1);
+			_mm_storeu_ps (state + i, s);
+			_mm_storeu_ps (state + 3 * n + i, y1);
+			_mm_storeu_ps (state + 2 * n + i, y);
+			s = y;
+		}
+
+		_mm_storeu_ps (frame, s);
+	}
+}
+
+static size_t sse2_biquad_cascade (float *buf, const size_t frames,
+		const int lanes, const int bands, const float *coef,
+		float *state)
+{
+	int lane;
+
+	if (lanes % 4)
+		return 0;
+
+	for (lane = 0; lane < lanes; lane += 4)
+		sse2_biquad_lanes (buf, frames, lanes, bands, coef, state, lane);
+
+	return frames;
+}
+
+static const struct simd_kernels sse2_kernels = {
+	"SSE2",
+	sse2_float_to_s16,
+	sse2_s16_to_float,
+	sse2_s32_to_s16,
+	sse2_scale_s16,
+	sse2_scale_float,
+	sse2_mix_stereo_s16,
+	sse2_mix_stereo_float,
+	sse2_biquad_cascade
+};
+
+#endif /* USE_SSE2 */
+
+#ifdef USE_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+#ifdef HAVE_LRINTF
+# define avx2_cvt_ps_epi32 _mm256_cvtps_epi32
+#else
+# define avx2_cvt_ps_epi32 _mm256_cvttps_epi32
+#endif
+
+/* Pack two vectors of int32 into one of int16 with saturation, keeping
+ * the sample order (_mm256_packs_epi32() works within 128-bit lanes). */
+static inline AVX2 __m256i avx2_packs_epi32 (const __m256i a, const __m256i b)
+{
+	return _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b),
+			_MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static AVX2 size_t avx2_float_to_s16 (const float *in, int16_t *out,
+		const size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps ((float)INT32_MAX);
+	const __m256 lo = _mm256_set1_ps ((float)INT32_MIN);
+	const __m256 hi = _mm256_set1_ps (FLOAT_BELOW_2_31);
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256 a = _mm256_mul_ps (_mm256_loadu_ps (in + i), scale);
+		__m256 b = _mm256_mul_ps (_mm256_loadu_ps (in + i + 8), scale);
+		__m256i ia, ib;
+
+		a = _mm256_min_ps (_mm256_max_ps (a, lo), hi);
+		b = _mm256_min_ps (_mm256_max_ps (b, lo), hi);
+		ia = _mm256_srai_epi32 (avx2_cvt_ps_epi32 (a), 16);
+		ib = _mm256_srai_epi32 (avx2_cvt_ps_epi32 (b), 16);
+		_mm256_storeu_si256 ((__m256i *)(out + i),
+				avx2_packs_epi32 (ia, ib));
+	}
+
+	return i;
+}
+
+static AVX2 size_t avx2_s16_to_float (const int16_t *in, float *out,
+		const size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps (1.0f / (INT16_MAX + 1));
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256i v = _mm256_cvtepi16_epi32 (
+				_mm_loadu_si128 ((const __m128i *)(in + i)));
+
+		_mm256_storeu_ps (out + i,
+				_mm256_mul_ps (_mm256_cvtepi32_ps (v), scale));
+	}
+
+	return i;
+}
+
+static AVX2 size_t avx2_s32_to_s16 (const int32_t *in, int16_t *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i a = _mm256_loadu_si256 ((const __m256i *)(in + i));
+		__m256i b = _mm256_loadu_si256 ((const __m256i *)(in + i + 8));
+
+		_mm256_storeu_si256 ((__m256i *)(out + i),
+				avx2_packs_epi32 (_mm256_srai_epi32 (a, 16),
+					_mm256_srai_epi32 (b, 16)));
+	}
+
+	return i;
+}
+
+static inline AVX2 __m256i avx2_scale_epi32 (const __m256i v,
+		const __m256 factor)
+{
+	const __m256 hundred = _mm256_set1_ps (100.0f);
+
+	return _mm256_cvttps_epi32 (_mm256_div_ps (_mm256_mul_ps (
+					_mm256_cvtepi32_ps (v), factor),
+				hundred));
+}
+
+static AVX2 size_t avx2_scale_s16 (int16_t *buf, const size_t samples,
+		const int percent)
+{
+	const __m256 factor = _mm256_set1_ps ((float)percent);
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i a = _mm256_cvtepi16_epi32 (
+				_mm_loadu_si128 ((const __m128i *)(buf + i)));
+		__m256i b = _mm256_cvtepi16_epi32 (
+				_mm_loadu_si128 ((const __m128i *)(buf + i + 8)));
+
+		_mm256_storeu_si256 ((__m256i *)(buf + i),
+				avx2_packs_epi32 (avx2_scale_epi32 (a, factor),
+					avx2_scale_epi32 (b, factor)));
+	}
+
+	return i;
+}
+
+static AVX2 size_t avx2_scale_float (float *buf, const size_t samples,
+		const float factor)
+{
+	const __m256 f = _mm256_set1_ps (factor);
+	const __m256 lo = _mm256_set1_ps (-1.0f);
+	const __m256 hi = _mm256_set1_ps (1.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256 v = _mm256_mul_ps (_mm256_loadu_ps (buf + i), f);
+
+		_mm256_storeu_ps (buf + i,
+				_mm256_min_ps (hi, _mm256_max_ps (lo, v)));
+	}
+
+	return i;
+}
+
+static AVX2 size_t avx2_mix_stereo_s16 (int16_t *buf, const size_t samples)
+{
+	const __m256i ones = _mm256_set1_epi16 (1);
+	const __m256i low_half = _mm256_set1_epi32 (0xffff);
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i *)(buf + i));
+		__m256i sum = _mm256_madd_epi16 (v, ones);
+		__m256i mono;
+
+		mono = _mm256_srai_epi32 (_mm256_add_epi32 (sum,
+					_mm256_srli_epi32 (sum, 31)), 1);
+		mono = _mm256_or_si256 (_mm256_and_si256 (mono, low_half),
+				_mm256_slli_epi32 (mono, 16));
+		_mm256_storeu_si256 ((__m256i *)(buf + i), mono);
+	}
+
+	return i;
+}
+
+static AVX2 size_t avx2_mix_stereo_float (float *buf, const size_t samples)
+{
+	const __m256 zero = _mm256_setzero_ps ();
+	const __m256 half = _mm256_set1_ps (0.5f);
+	const __m256 lo = _mm256_set1_ps (-1.0f);
+	const __m256 hi = _mm256_set1_ps (1.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256 v = _mm256_loadu_ps (buf + i);
+		__m256 l = _mm256_shuffle_ps (v, v, _MM_SHUFFLE(2, 2, 0, 0));
+		__m256 r = _mm256_shuffle_ps (v, v, _MM_SHUFFLE(3, 3, 1, 1));
+		__m256 mono;
+
+		mono = _mm256_mul_ps (_mm256_add_ps (_mm256_add_ps (zero, l), r),
+				half);
+		_mm256_storeu_ps (buf + i,
+				_mm256_min_ps (hi, _mm256_max_ps (lo, mono)));
+	}
+
+	return i;
+}
+
+/* The same as sse2_biquad_lanes(), but for 8 lanes at once. */
+static AVX2 void avx2_biquad_lanes (float *buf, const size_t frames,
+		const int lanes, const int bands, const float *coef,
+		float *state, const int lane)
+{
+	const size_t n = (size_t)bands * lanes;
+	size_t f;
+
+	for (f = 0; f < frames; f++) {
+		float *frame = buf + f * lanes + lane;
+		__m256 s = _mm256_loadu_ps (frame);
+		int b;
+
+		for (b = 0; b < bands; b++) {
+			const size_t i = (size_t)b * lanes + lane;
+			__m256 x1 = _mm256_loadu_ps (state + i);
+			__m256 x2 = _mm256_loadu_ps (state + n + i);
+			__m256 y1 = _mm256_loadu_ps (state + 2 * n + i);
+			__m256 y2 = _mm256_loadu_ps (state + 3 * n + i);
+			__m256 y;
+
+			y = _mm256_mul_ps (s, _mm256_loadu_ps (coef + i));
+			y = _mm256_add_ps (y, _mm256_mul_ps (
+						_mm256_loadu_ps (coef + n + i), x1));
+			y = _mm256_add_ps (y, _mm256_mul_ps (
+						_mm256_loadu_ps (coef + 2 * n + i), x2));
+			y = _mm256_sub_ps (y, _mm256_mul_ps (
+						_mm256_loadu_ps (coef + 3 * n + i), y1));
+			y = _mm256_sub_ps (y, _mm256_mul_ps (
+						_mm256_loadu_ps (coef + 4 * n + i), y2));
+
+			_mm256_storeu_ps (state + n + i, x1);
+			_mm256_storeu_ps (state + i, s);
+			_mm256_storeu_ps (state + 3 * n + i, y1);
+			_mm256_storeu_ps (state + 2 * n + i, y);
+			s = y;
+		}
+
+		_mm256_storeu_ps (frame, s);
+	}
+}
+
+/* Four lane version for the remainder, using the AVX encoding of the SSE
+ * instructions. */
+static AVX2 void avx2_biquad_lanes_4 (float *buf, const size_t frames,
+		const int lanes, const int bands, const float *coef,
+		float *state, const int lane)
+{
+	const size_t n = (size_t)bands * lanes;
+	size_t f;
+
+	for (f = 0; f < frames; f++) {
+		float *frame = buf + f * lanes + lane;
+		__m128 s = _mm_loadu_ps (frame);
+		int b;
+
+		for (b = 0; b < bands; b++) {
+			const size_t i = (size_t)b * lanes + lane;
+			__m128 x1 = _mm_loadu_ps (state + i);
+			__m128 x2 = _mm_loadu_ps (state + n + i);
+			__m128 y1 = _mm_loadu_ps (state + 2 * n + i);
+			__m128 y2 = _mm_loadu_ps (state + 3 * n + i);
+			__m128 y;
+
+			y = _mm_mul_ps (s, _mm_loadu_ps (coef + i));
+			y = _mm_add_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + n + i), x1));
+			y = _mm_add_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + 2 * n + i),
+						x2));
+			y = _mm_sub_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + 3 * n + i),
+						y1));
+			y = _mm_sub_ps (y, _mm_mul_ps (_mm_loadu_ps (coef + 4 * n + i),
+						y2));
+
+			_mm_storeu_ps (state + n + i, x1);
+			_mm_storeu_ps (state + i, s);
+			_mm_storeu_ps (state + 3 * n + i, y1);
+			_mm_storeu_ps (state + 2 * n + i, y);
+			s = y;
+		}
+
+		_mm_storeu_ps (frame, s);
+	}
+}
+
+static AVX2 size_t avx2_biquad_cascade (float *buf, const size_t frames,
+		const int lanes, const int bands, const float *coef,
+		float *state)
+{
+	int lane;
+
+	if (lanes % 4)
+		return 0;
+
+	for (lane = 0; lane + 8 <= lanes; lane += 8)
+		avx2_biquad_lanes (buf, frames, lanes, bands, coef, state, lane);
+	if (lane < lanes)
+		avx2_biquad_lanes_4 (buf, frames, lanes, bands, coef, state,
+				lane);
+
+	return frames;
+}
+
+static const struct simd_kernels avx2_kernels = {
+	"AVX2",
+	avx2_float_to_s16,
+	avx2_s16_to_float,
+	avx2_s32_to_s16,
+	avx2_scale_s16,
+	avx2_scale_float,
+	avx2_mix_stereo_s16,
+	avx2_mix_stereo_float,
+	avx2_biquad_cascade
+};
+
+#endif /* USE_AVX2 */
+
+#ifdef USE_NEON
+
+#ifdef HAVE_LRINTF
+# define neon_cvt_s32_f32 vcvtnq_s32_f32
+#else
+# define neon_cvt_s32_f32 vcvtq_s32_f32
+#endif
+
+static size_t neon_float_to_s16 (const float *in, int16_t *out,
+		const size_t samples)
+{
+	const float32x4_t lo = vdupq_n_f32 ((float)INT32_MIN);
+	const float32x4_t hi = vdupq_n_f32 (FLOAT_BELOW_2_31);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		float32x4_t a = vmulq_n_f32 (vld1q_f32 (in + i),
+				(float)INT32_MAX);
+		float32x4_t b = vmulq_n_f32 (vld1q_f32 (in + i + 4),
+				(float)INT32_MAX);
+
+		a = vminq_f32 (vmaxq_f32 (a, lo), hi);
+		b = vminq_f32 (vmaxq_f32 (b, lo), hi);
+		vst1q_s16 (out + i, vcombine_s16 (
+					vshrn_n_s32 (neon_cvt_s32_f32 (a), 16),
+					vshrn_n_s32 (neon_cvt_s32_f32 (b), 16)));
+	}
+
+	return i;
+}
+
+static size_t neon_s16_to_float (const int16_t *in, float *out,
+		const size_t samples)
+{
+	const float scale = 1.0f / (INT16_MAX + 1);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int16x8_t v = vld1q_s16 (in + i);
+
+		vst1q_f32 (out + i, vmulq_n_f32 (vcvtq_f32_s32 (
+						vmovl_s16 (vget_low_s16 (v))),
+					scale));
+		vst1q_f32 (out + i + 4, vmulq_n_f32 (vcvtq_f32_s32 (
+						vmovl_s16 (vget_high_s16 (v))),
+					scale));
+	}
+
+	return i;
+}
+
+static size_t neon_s32_to_s16 (const int32_t *in, int16_t *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8)
+		vst1q_s16 (out + i, vcombine_s16 (
+					vshrn_n_s32 (vld1q_s32 (in + i), 16),
+					vshrn_n_s32 (vld1q_s32 (in + i + 4), 16)));
+
+	return i;
+}
+
+static inline int16x4_t neon_scale_s16x4 (const int16x4_t v,
+		const float factor)
+{
+	float32x4_t f = vmulq_n_f32 (vcvtq_f32_s32 (vmovl_s16 (v)), factor);
+
+	return vqmovn_s32 (vcvtq_s32_f32 (vdivq_f32 (f, vdupq_n_f32 (100.0f))));
+}
+
+static size_t neon_scale_s16 (int16_t *buf, const size_t samples,
+		const int percent)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int16x8_t v = vld1q_s16 (buf + i);
+
+		vst1q_s16 (buf + i, vcombine_s16 (
+					neon_scale_s16x4 (vget_low_s16 (v), percent),
+					neon_scale_s16x4 (vget_high_s16 (v), percent)));
+	}
+
+	return i;
+}
+
+static size_t neon_scale_float (float *buf, const size_t samples,
+		const float factor)
+{
+	const float32x4_t lo = vdupq_n_f32 (-1.0f);
+	const float32x4_t hi = vdupq_n_f32 (1.0f);
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		float32x4_t v = vmulq_n_f32 (vld1q_f32 (buf + i), factor);
+
+		vst1q_f32 (buf + i, vminq_f32 (hi, vmaxq_f32 (lo, v)));
+	}
+
+	return i;
+}
+
+static size_t neon_mix_stereo_s16 (int16_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int32x4_t sum = vpaddlq_s16 (vld1q_s16 (buf + i));
+		int32x4_t sign = vreinterpretq_s32_u32 (vshrq_n_u32 (
+					vreinterpretq_u32_s32 (sum), 31));
+		int16x4_t mono = vmovn_s32 (vshrq_n_s32 (vaddq_s32 (sum, sign), 1));
+		int16x4x2_t both = vzip_s16 (mono, mono);
+
+		vst1q_s16 (buf + i, vcombine_s16 (both.val[0], both.val[1]));
+	}
+
+	return i;
+}
+
+static size_t neon_mix_stereo_float (float *buf, const size_t samples)
+{
+	const float32x4_t lo = vdupq_n_f32 (-1.0f);
+	const float32x4_t hi = vdupq_n_f32 (1.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		float32x4x2_t v = vld2q_f32 (buf + i);
+		float32x4_t mono;
+
+		mono = vaddq_f32 (vaddq_f32 (vdupq_n_f32 (0.0f), v.val[0]),
+				v.val[1]);
+		mono = vmulq_n_f32 (mono, 0.5f);
+		mono = vminq_f32 (hi, vmaxq_f32 (lo, mono));
+		v.val[0] = mono;
+		v.val[1] = mono;
+		vst2q_f32 (buf + i, v);
+	}
+
+	return i;
+}
+
+static void neon_biquad_lanes (float *buf, const size_t frames,
+		const int lanes, const int bands, const float *coef,
+		float *state, const int lane)
+{
+	const size_t n = (size_t)bands * lanes;
+	size_t f;
+
+	for (f = 0; f < frames; f++) {
+		float *frame = buf + f * lanes + lane;
+		float32x4_t s = vld1q_f32 (frame);
+		int b;
+
+		for (b = 0; b < bands; b++) {
+			const size_t i = (size_t)b * lanes + lane;
+			float32x4_t x1 = vld1q_f32 (state + i);
+			float32x4_t x2 = vld1q_f32 (state + n + i);
+			float32x4_t y1 = vld1q_f32 (state + 2 * n + i);
+			float32x4_t y2 = vld1q_f32 (state + 3 * n + i);
+			float32x4_t y;
+
+			/* separate multiplies and adds, not vmlaq_f32(), which may
+			 * be fused */
+			y = vmulq_f32 (s, vld1q_f32 (coef + i));
+			y = vaddq_f32 (y, vmulq_f32 (vld1q_f32 (coef + n + i), x1));
+			y = vaddq_f32 (y, vmulq_f32 (vld1q_f32 (coef + 2 * n + i), x2));
+			y = vsubq_f32 (y, vmulq_f32 (vld1q_f32 (coef + 3 * n + i), y1));
+			y = vsubq_f32 (y, vmulq_f32 (vld1q_f32 (coef + 4 * n + i), y2));
+
+			vst1q_f32 (state + n + i, x1);
+			vst1q_f32 (state + i, s);
+			vst1q_f32 (state + 3 * n + i, y1);
+			vst1q_f32 (state + 2 * n + i, y);
+			s = y;
+		}
+
+		vst1q_f32 (frame, s);
+	}
+}
+
+static size_t neon_biquad_cascade (float *buf, const size_t frames,
+		const int lanes, const int bands, const float *coef,
+		float *state)
+{
+	int lane;
+
+	if (lanes % 4)
+		return 0;
+
+	for (lane = 0; lane < lanes; lane += 4)
+		neon_biquad_lanes (buf, frames, lanes, bands, coef, state, lane);
+
+	return frames;
+}
+
+static const struct simd_kernels neon_kernels = {
+	"NEON",
+	neon_float_to_s16,
+	neon_s16_to_float,
+	neon_s32_to_s16,
+	neon_scale_s16,
+	neon_scale_float,
+	neon_mix_stereo_s16,
+	neon_mix_stereo_float,
+	neon_biquad_cascade
+};
+
+#endif /* USE_NEON */
+
+const struct simd_kernels *simd = &scalar_kernels;
+
+/* Select the best kernels for this CPU. */
+void simd_init ()
+{
+	simd = &scalar_kernels;
+
+#if defined(USE_SSE2)
+	simd = &sse2_kernels;
+#elif defined(USE_NEON)
+	simd = &neon_kernels;
+#endif
+
+#ifdef USE_AVX2
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		simd = &avx2_kernels;
+#endif
+
+	logit ("Using %s sample processing", simd->name);
+}
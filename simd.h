@@ -0,0 +1,56 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#endif
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Vectorised versions of the hottest sample processing loops.  Each
+ * kernel processes as many whole vectors as fit in the buffer and returns
+ * the number of samples it has done; the caller finishes the rest with its
+ * scalar code.  The results are identical to those of the scalar code. */
+struct simd_kernels
+{
+	const char *name;
+
+	size_t (*float_to_s16) (const float *in, int16_t *out,
+			const size_t samples);
+	size_t (*s16_to_float) (const int16_t *in, float *out,
+			const size_t samples);
+	size_t (*s32_to_s16) (const int32_t *in, int16_t *out,
+			const size_t samples);
+
+	/* Softmixer: multiply by percent / 100 and clip. */
+	size_t (*scale_s16) (int16_t *buf, const size_t samples,
+			const int percent);
+	size_t (*scale_float) (float *buf, const size_t samples,
+			const float factor);
+
+	/* Mono mixing of interleaved stereo samples. */
+	size_t (*mix_stereo_s16) (int16_t *buf, const size_t samples);
+	size_t (*mix_stereo_float) (float *buf, const size_t samples);
+
+	/* Equalizer: run frames of lanes floats each through a cascade of
+	 * biquad filters in place, see apply_biquads() in equalizer.c for the
+	 * layout.  Returns the number of frames done. */
+	size_t (*biquad_cascade) (float *buf, const size_t frames,
+			const int lanes, const int bands, const float *coef,
+			float *state);
+};
+
+/* Kernels for the CPU we run on, selected by simd_init(). */
+extern const struct simd_kernels *simd;
+
+void simd_init ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
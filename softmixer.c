@@ -30,6 +30,7 @@
 #include "audio.h"
 #include "audio_conversion.h"
 #include "softmixer.h"
+#include "simd.h"
 #include "options.h"
 #include "files.h"
 #include "log.h"
@@ -408,7 +409,7 @@ static void process_buffer_s16(int16_t *buf, size_t samples)
 
   debug ("mixing");
 
-  for(i=0; i<samples; i++)
+  for(i=simd->scale_s16(buf, samples, mixer_real); i<samples; i++)
   {
     int32_t tmp = buf[i];
     tmp *= mixer_real;
@@ -458,7 +459,7 @@ static void process_buffer_float(float *buf, size_t samples)
 
   debug ("mixing");
 
-  for(i=0; i<samples; i++)
+  for(i=simd->scale_float(buf, samples, mixer_realf); i<samples; i++)
   {
     float tmp = buf[i];
     tmp *= mixer_realf;
@@ -561,6 +562,12 @@ static void mix_mono_s16(int16_t *buf, int channels, size_t samples)
 
   assert (channels > 1);
 
+  if(channels == 2)
+  {
+    i = simd->mix_stereo_s16(buf, samples);
+    buf += i;
+  }
+
   while(i < samples)
   {
     int32_t mono = 0;
@@ -645,6 +652,12 @@ static void mix_mono_float(float *buf, int channels, size_t samples)
 
   assert (channels > 1);
 
+  if(channels == 2)
+  {
+    i = simd->mix_stereo_float(buf, samples);
+    buf += i;
+  }
+
   while(i < samples)
   {
     float mono = 0.0f;
@@ -14,6 +14,8 @@
 #endif
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +41,7 @@
 #include "tags_cache.h"
 #include "log.h"
 #include "audio.h"
+#include "tags_store.h"
 
 #ifdef HAVE_DB_H
 # define DB_ONLY
@@ -47,7 +50,11 @@
 #endif
 
 /* The name of the tags database in the cache directory. */
-#define TAGS_DB "tags.db"
+#ifdef HAVE_DB_H
+# define TAGS_DB "tags.db"
+#else
+# define TAGS_DB "tags.log"
+#endif
 
 /* The name of the version tag file in the cache directory. */
 #define MOC_VERSION_TAG "moc_version_tag"
@@ -62,24 +69,109 @@
  * temporarily set it to zero to disable cache activity during structural
  * changes which require multiple commits.
  */
-#define CACHE_DB_FORMAT_VERSION	1
-
-/* How frequently to flush the tags database to disk.  A value of zero
- * disables flushing. */
-#define DB_SYNC_COUNT 5
+#define CACHE_DB_FORMAT_VERSION	2
+
+/* Updates of the tags database are flushed to disk in groups: when this
+ * many have accumulated, when the oldest is DB_SYNC_INTERVAL seconds old
+ * or when the readers run out of requests.  A value of zero disables
+ * flushing (the database is still flushed when closed). */
+#define DB_SYNC_COUNT 500
+#define DB_SYNC_INTERVAL 30
+
+/* Priorities of the requests: the ones for files which the client shows
+ * on the screen are read first. */
+#define REQUEST_PRIO_NORMAL	0
+#define REQUEST_PRIO_VISIBLE	1
+#define REQUEST_PRIORITIES	2
+
+/* Request for reading tags of a file.  There is only one for each file
+ * at a time, shared by all clients which want the tags. */
+struct tags_request
+{
+	char *file;		/* file that this request is for (malloc()ed) */
+	int tags_sel;		/* which tags to read (TAGS_*) */
+	int in_flight;		/* is it being read by a reader thread? */
+	struct request_waiter *waiters;
+};
 
-/* Element of a requests queue. */
-struct request_queue_node
+/* A client waiting for the result of a request. */
+struct request_waiter
 {
-	struct request_queue_node *next;
-	char *file; /* file that this request is for (malloc()ed) */
-	int tags_sel; /* which tags to read (TAGS_*) */
+	struct tags_request *req;
+	struct request_waiter *next_waiter; /* of the same request */
+	int client_id;
+	int priority;		/* REQUEST_PRIO_* */
+	int queued;		/* is it in the client's queue? */
+	unsigned long seq;	/* order of the requests in the queue */
+	struct request_waiter *prev; /* in the client's queue */
+	struct request_waiter *next;
 };
 
+/* Requests of a client waiting to be read, one FIFO list for each
+ * priority. */
 struct request_queue
 {
-	struct request_queue_node *head;
-	struct request_queue_node *tail;
+	struct request_waiter *head[REQUEST_PRIORITIES];
+	struct request_waiter *tail[REQUEST_PRIORITIES];
+	unsigned long seq;	/* sequence number of the last request */
+};
+
+/* Upper limit of the number of reader threads. */
+#define READERS_MAX 32
+
+/* Entry of the in-memory index of the records in the cache DB, which
+ * keeps them in order of access time so the least recently used one can
+ * be found without reading the whole DB.
+ *
+ * A record's atime is written only when the record is stored.  Cache hits
+ * move the entry here but don't rewrite the record, as that would turn
+ * every read into a DB write, so the recency of hits lasts only until the
+ * server exits: the next index is ordered by the time the records were
+ * stored. */
+struct lru_node
+{
+	struct lru_node *older;
+	struct lru_node *newer;
+	time_t atime;
+	char file[FLEXIBLE_ARRAY_MEMBER];
+};
+
+struct lru_index
+{
+	struct rb_tree *search_tree;	/* lru_nodes by file name */
+	struct lru_node *oldest;
+	struct lru_node *newest;
+	int nitems;
+};
+
+/* Number of shards of the in-memory tags cache and its total size. */
+#define HOT_SHARDS 16
+#define HOT_TIER_SIZE 4096
+
+/* Tags of a file kept in memory. */
+struct hot_entry
+{
+	struct hot_entry *older;
+	struct hot_entry *newer;
+	time_t mtime;			/* modification time the tags are for */
+	struct file_tags *tags;
+	char file[FLEXIBLE_ARRAY_MEMBER];
+};
+
+struct hot_shard
+{
+	pthread_mutex_t mutex;		/* protects this shard */
+	struct rb_tree *tree;		/* hot_entries by file name */
+	struct hot_entry *oldest;
+	struct hot_entry *newest;
+	int nitems;
+};
+
+struct tags_reader
+{
+	struct tags_cache *c;
+	int id;			/* index in c->readers */
+	pthread_t tid;
 };
 
 struct tags_cache
@@ -88,292 +180,969 @@ struct tags_cache
 #ifdef HAVE_DB_H
 	DB_ENV *db_env;
 	DB *db;
-	u_int32_t locker;
+	u_int32_t locker;	/* locker for requests made by the server */
+	u_int32_t *reader_lockers; /* lockers of the reader threads */
+#else
+	struct tags_store *store; /* the built-in store used instead */
 #endif
+	struct lru_index lru;	/* protected by mutex */
 
 	int max_items;		/* maximum number of items in the cache. */
-	struct request_queue queues[CLIENTS_MAX]; /* requests queues for each
-						     client */
-	int stop_reader_thread; /* request for stopping read thread (if
+	struct request_queue *queues; /* requests queues for each client
+					 indexed by client id */
+	int nqueues;		/* size of queues */
+	int curr_queue;		/* index of the queue from where the next
+				   request will be taken */
+	struct rb_tree *pending; /* queued tags_requests by file */
+	struct rb_tree *in_flight; /* tags_requests being read by file */
+	int stop_reader_thread; /* request for stopping read threads (if
 				   non-zero) */
 	pthread_cond_t request_cond; /* condition for signalizing new
 					requests */
 	pthread_mutex_t mutex; /* mutex for all above data (except db because
 				  it's thread-safe) */
-	pthread_t reader_thread; /* tid of the reading thread */
+	int nreaders;		/* number of reading threads */
+	struct tags_reader *readers;
+	int sync_count;		/* updates since the last DB sync */
+	time_t sync_time;	/* time of the first of them */
+	struct hot_shard hot[HOT_SHARDS]; /* recently used tags */
+	int hot_max;		/* maximum number of entries in a shard */
 };
 
 struct cache_record
 {
 	time_t mod_time;		/* last modification time of the file */
 	time_t atime;			/* Time of last access. */
+	int filled;			/* TAGS_* present in the record */
+	int time;			/* time of the file if TAGS_TIME */
 	struct file_tags *tags;
 };
 
-static void request_queue_init (struct request_queue *q)
+static int lru_compare (const void *a, const void *b,
+                        const void *unused ATTR_UNUSED)
 {
-	assert (q != NULL);
+	const struct lru_node *na = (const struct lru_node *)a;
+	const struct lru_node *nb = (const struct lru_node *)b;
 
-	q->head = NULL;
-	q->tail = NULL;
+	return strcmp (na->file, nb->file);
 }
 
-static void request_queue_clear (struct request_queue *q)
+static int lru_compare_key (const void *key, const void *data,
+                            const void *unused ATTR_UNUSED)
 {
-	assert (q != NULL);
+	const struct lru_node *n = (const struct lru_node *)data;
 
-	while (q->head) {
-		struct request_queue_node *o = q->head;
+	return strcmp ((const char *)key, n->file);
+}
+
+static void lru_init (struct lru_index *lru)
+{
+	lru->search_tree = rb_tree_new (lru_compare, lru_compare_key, NULL);
+	lru->oldest = NULL;
+	lru->newest = NULL;
+	lru->nitems = 0;
+}
 
-		q->head = q->head->next;
+static void lru_clear (struct lru_index *lru)
+{
+	while (lru->oldest) {
+		struct lru_node *n = lru->oldest;
 
-		free (o->file);
-		free (o);
+		lru->oldest = n->newer;
+		free (n);
 	}
 
-	q->tail = NULL;
+	rb_tree_clear (lru->search_tree);
+	lru->newest = NULL;
+	lru->nitems = 0;
 }
 
-/* Remove items from the queue from the beginning to the specified file. */
-static void request_queue_clear_up_to (struct request_queue *q,
-                                              const char *file)
+static void lru_destroy (struct lru_index *lru)
 {
-	int stop = 0;
+	lru_clear (lru);
+	rb_tree_free (lru->search_tree);
+	lru->search_tree = NULL;
+}
 
-	assert (q != NULL);
+static void lru_unlink (struct lru_index *lru, struct lru_node *n)
+{
+	if (n->older)
+		n->older->newer = n->newer;
+	else
+		lru->oldest = n->newer;
 
-	while (q->head && !stop) {
-		struct request_queue_node *o = q->head;
+	if (n->newer)
+		n->newer->older = n->older;
+	else
+		lru->newest = n->older;
 
-		q->head = q->head->next;
+	n->older = n->newer = NULL;
+}
 
-		if (!strcmp (o->file, file))
-			stop = 1;
+static void lru_append (struct lru_index *lru, struct lru_node *n)
+{
+	n->older = lru->newest;
+	n->newer = NULL;
+
+	if (lru->newest)
+		lru->newest->newer = n;
+	else
+		lru->oldest = n;
 
-		free (o->file);
-		free (o);
+	lru->newest = n;
+}
+
+/* Mark the file as the most recently used one, adding it to the index if
+ * it's not there.  Return non-zero if it was added. */
+static int lru_touch (struct lru_index *lru, const char *file,
+                      const time_t atime)
+{
+	struct rb_node *x;
+	struct lru_node *n;
+
+	x = rb_search (lru->search_tree, file);
+	if (!rb_is_null (x)) {
+		n = (struct lru_node *)rb_get_data (x);
+		n->atime = atime;
+		if (n != lru->newest) {
+			lru_unlink (lru, n);
+			lru_append (lru, n);
+		}
+
+		return 0;
 	}
 
-	if (!q->head)
-		q->tail = NULL;
+	n = (struct lru_node *)xmalloc (offsetof (struct lru_node, file)
+	                                + strlen (file) + 1);
+	strcpy (n->file, file);
+	n->atime = atime;
+	lru_append (lru, n);
+	rb_insert (lru->search_tree, n);
+	lru->nitems += 1;
+
+	return 1;
 }
 
-static void request_queue_add (struct request_queue *q, const char *file,
-                                                            int tags_sel)
+/* Remove the least recently used file from the index and return its name
+ * (malloc()ed), or NULL if the index is empty. */
+static char *lru_pop_oldest (struct lru_index *lru)
 {
-	assert (q != NULL);
+	struct lru_node *n = lru->oldest;
+	char *file;
+
+	if (!n)
+		return NULL;
+
+	lru_unlink (lru, n);
+	rb_delete (lru->search_tree, n->file);
+	lru->nitems -= 1;
+
+	file = xstrdup (n->file);
+	free (n);
+
+	return file;
+}
+
+static int lru_atime_cmp (const void *a, const void *b)
+{
+	const struct lru_node *na = *(struct lru_node * const *)a;
+	const struct lru_node *nb = *(struct lru_node * const *)b;
+
+	if (na->atime < nb->atime)
+		return -1;
+
+	return na->atime > nb->atime;
+}
+
+/* Recently used tags are also kept in memory in front of the DB, so
+ * repeated requests for the same files (e.g. when a directory is entered
+ * again) don't need a locked DB lookup.  The entries are spread over
+ * HOT_SHARDS independently locked shards and each shard is limited in size
+ * and keeps its entries in LRU order. */
+static unsigned int hot_hash (const char *file)
+{
+	unsigned int h = 2166136261u;
+
+	while (*file) {
+		h ^= (unsigned char)*file++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static int hot_compare (const void *a, const void *b,
+                        const void *unused ATTR_UNUSED)
+{
+	const struct hot_entry *ea = (const struct hot_entry *)a;
+	const struct hot_entry *eb = (const struct hot_entry *)b;
+
+	return strcmp (ea->file, eb->file);
+}
+
+static int hot_compare_key (const void *key, const void *data,
+                            const void *unused ATTR_UNUSED)
+{
+	const struct hot_entry *e = (const struct hot_entry *)data;
+
+	return strcmp ((const char *)key, e->file);
+}
+
+static void hot_init (struct tags_cache *c, const int max_items)
+{
+	int i;
+
+	c->hot_max = MIN(max_items, HOT_TIER_SIZE) / HOT_SHARDS;
+
+	for (i = 0; i < HOT_SHARDS; i += 1) {
+		struct hot_shard *s = &c->hot[i];
+
+		pthread_mutex_init (&s->mutex, NULL);
+		s->tree = rb_tree_new (hot_compare, hot_compare_key, NULL);
+		s->oldest = NULL;
+		s->newest = NULL;
+		s->nitems = 0;
+	}
+}
+
+static void hot_destroy (struct tags_cache *c)
+{
+	int i, rc;
+
+	for (i = 0; i < HOT_SHARDS; i += 1) {
+		struct hot_shard *s = &c->hot[i];
+
+		while (s->oldest) {
+			struct hot_entry *e = s->oldest;
+
+			s->oldest = e->newer;
+			tags_free (e->tags);
+			free (e);
+		}
+
+		rb_tree_free (s->tree);
+
+		rc = pthread_mutex_destroy (&s->mutex);
+		if (rc != 0)
+			logit ("Can't destroy hot shard mutex: %s", strerror (rc));
+	}
+}
+
+static void hot_unlink (struct hot_shard *s, struct hot_entry *e)
+{
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		s->oldest = e->newer;
+
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		s->newest = e->older;
+}
+
+static void hot_append (struct hot_shard *s, struct hot_entry *e)
+{
+	e->older = s->newest;
+	e->newer = NULL;
+
+	if (s->newest)
+		s->newest->newer = e;
+	else
+		s->oldest = e;
 
-	if (!q->head) {
-		q->head = (struct request_queue_node *)xmalloc (
-				sizeof(struct request_queue_node));
-		q->tail = q->head;
+	s->newest = e;
+}
+
+/* Return a copy of the tags for the file if they are in memory, were read
+ * when the file had this modification time and contain tags_sel. */
+static struct file_tags *hot_get (struct tags_cache *c, const char *file,
+                                  const time_t mtime, const int tags_sel)
+{
+	struct hot_shard *s;
+	struct rb_node *x;
+	struct file_tags *tags = NULL;
+
+	if (c->hot_max == 0 || mtime == (time_t)-1)
+		return NULL;
+
+	s = &c->hot[hot_hash (file) % HOT_SHARDS];
+
+	LOCK (s->mutex);
+	x = rb_search (s->tree, file);
+	if (!rb_is_null (x)) {
+		struct hot_entry *e = (struct hot_entry *)rb_get_data (x);
+
+		if (e->mtime == mtime
+				&& (e->tags->filled & tags_sel) == tags_sel) {
+			tags = tags_dup (e->tags);
+			if (e != s->newest) {
+				hot_unlink (s, e);
+				hot_append (s, e);
+			}
+		}
+	}
+	UNLOCK (s->mutex);
+
+	return tags;
+}
+
+/* Count a use of the file's tags served from memory, so that the DB
+ * record is not evicted as unused during this run. */
+static void hot_touch_db (struct tags_cache *c, const char *file)
+{
+	if (c->max_items) {
+		LOCK (c->mutex);
+		lru_touch (&c->lru, file, time (NULL));
+		UNLOCK (c->mutex);
+	}
+}
+
+/* Remember a copy of the tags read for the file having this modification
+ * time, dropping the least recently used entry if the shard is full. */
+static void hot_put (struct tags_cache *c, const char *file,
+                     const time_t mtime, const struct file_tags *tags)
+{
+	struct hot_shard *s;
+	struct rb_node *x;
+	struct hot_entry *e;
+
+	if (c->hot_max == 0 || mtime == (time_t)-1)
+		return;
+
+	s = &c->hot[hot_hash (file) % HOT_SHARDS];
+
+	LOCK (s->mutex);
+	x = rb_search (s->tree, file);
+	if (!rb_is_null (x)) {
+		e = (struct hot_entry *)rb_get_data (x);
+		tags_free (e->tags);
+		hot_unlink (s, e);
 	}
 	else {
-		assert (q->tail != NULL);
-		assert (q->tail->next == NULL);
+		if (s->nitems == c->hot_max) {
+			struct hot_entry *victim = s->oldest;
+
+			hot_unlink (s, victim);
+			rb_delete (s->tree, victim->file);
+			tags_free (victim->tags);
+			free (victim);
+			s->nitems -= 1;
+		}
 
-		q->tail->next = (struct request_queue_node *)xmalloc (
-				sizeof(struct request_queue_node));
-		q->tail = q->tail->next;
+		e = (struct hot_entry *)xmalloc (offsetof (struct hot_entry, file)
+		                                 + strlen (file) + 1);
+		strcpy (e->file, file);
+		rb_insert (s->tree, e);
+		s->nitems += 1;
 	}
 
-	q->tail->file = xstrdup (file);
-	q->tail->tags_sel = tags_sel;
-	q->tail->next = NULL;
+	e->mtime = mtime;
+	e->tags = tags_dup (tags);
+	hot_append (s, e);
+	UNLOCK (s->mutex);
 }
 
-static int request_queue_empty (const struct request_queue *q)
+/* Find the request for the file in the tree or return NULL. */
+static struct tags_request *request_find (struct rb_tree *tree,
+                                          const char *file)
+{
+	struct rb_node *x;
+
+	x = rb_search (tree, file);
+	if (rb_is_null (x))
+		return NULL;
+
+	return (struct tags_request *)rb_get_data (x);
+}
+
+static int request_compare (const void *a, const void *b,
+                            const void *unused ATTR_UNUSED)
+{
+	const struct tags_request *ra = (const struct tags_request *)a;
+	const struct tags_request *rb = (const struct tags_request *)b;
+
+	return strcmp (ra->file, rb->file);
+}
+
+static int request_compare_key (const void *key, const void *data,
+                                const void *unused ATTR_UNUSED)
 {
+	const struct tags_request *r = (const struct tags_request *)data;
+
+	return strcmp ((const char *)key, r->file);
+}
+
+static void request_free (struct tags_request *r)
+{
+	assert (r->waiters == NULL);
+
+	free (r->file);
+	free (r);
+}
+
+/* Return the client's waiter of the request or NULL. */
+static struct request_waiter *request_waiter (const struct tags_request *r,
+                                              const int client_id)
+{
+	struct request_waiter *w;
+
+	for (w = r->waiters; w; w = w->next_waiter) {
+		if (w->client_id == client_id)
+			break;
+	}
+
+	return w;
+}
+
+static void request_queue_init (struct request_queue *q)
+{
+	int i;
+
 	assert (q != NULL);
 
-	return q->head == NULL;
+	for (i = 0; i < REQUEST_PRIORITIES; i += 1) {
+		q->head[i] = NULL;
+		q->tail[i] = NULL;
+	}
+	q->seq = 0;
 }
 
-/* Get the file name of the first element in the queue or NULL if the queue is
- * empty. Put tags to be read in *tags_sel. Returned memory is malloc()ed. */
-static char *request_queue_pop (struct request_queue *q, int *tags_sel)
+static void request_queue_append (struct request_queue *q,
+                                  struct request_waiter *w)
 {
-	struct request_queue_node *n;
-	char *file;
+	int prio = w->priority;
+
+	w->next = NULL;
+	w->prev = q->tail[prio];
+	if (q->tail[prio])
+		q->tail[prio]->next = w;
+	else
+		q->head[prio] = w;
+	q->tail[prio] = w;
+
+	w->seq = ++q->seq;
+	w->queued = 1;
+}
+
+static void request_queue_unlink (struct request_queue *q,
+                                  struct request_waiter *w)
+{
+	int prio = w->priority;
+
+	assert (w->queued);
+
+	if (w->prev)
+		w->prev->next = w->next;
+	else
+		q->head[prio] = w->next;
+
+	if (w->next)
+		w->next->prev = w->prev;
+	else
+		q->tail[prio] = w->prev;
+
+	w->queued = 0;
+}
+
+static int request_queue_empty (const struct request_queue *q)
+{
+	int i;
 
 	assert (q != NULL);
 
-	if (q->head == NULL)
-		return NULL;
+	for (i = 0; i < REQUEST_PRIORITIES; i += 1) {
+		if (q->head[i])
+			return 0;
+	}
 
-	n = q->head;
-	q->head = n->next;
-	file = n->file;
-	*tags_sel = n->tags_sel;
-	free (n);
+	return 1;
+}
 
-	if (q->tail == n)
-		q->tail = NULL; /* the queue is empty */
+/* Return the client's queue, making room for it if this is the first
+ * request from a client with such a high id. */
+static struct request_queue *client_queue (struct tags_cache *c,
+                                           const int client_id)
+{
+	assert (client_id >= 0);
 
-	return file;
+	if (client_id >= c->nqueues) {
+		int i, n = MAX(c->nqueues * 2, client_id + 1);
+
+		c->queues = (struct request_queue *)xrealloc (c->queues,
+				n * sizeof (struct request_queue));
+		for (i = c->nqueues; i < n; i += 1)
+			request_queue_init (&c->queues[i]);
+		c->nqueues = n;
+	}
+
+	return &c->queues[client_id];
 }
 
-#ifdef HAVE_DB_H
-static size_t strlen_null (const char *s)
+/* Return the waiter which should be served first. */
+static struct request_waiter *request_queue_first (
+		const struct request_queue *q)
+{
+	int i;
+
+	for (i = REQUEST_PRIORITIES - 1; i >= 0; i -= 1) {
+		if (q->head[i])
+			return q->head[i];
+	}
+
+	return NULL;
+}
+
+/* Remove the waiter from its request and free it.  A pending request left
+ * without waiters is dropped. */
+static void request_waiter_remove (struct tags_cache *c,
+                                   struct request_waiter *w)
 {
-	return s ? strlen (s) : 0;
+	struct tags_request *r = w->req;
+	struct request_waiter **p;
+
+	if (w->queued)
+		request_queue_unlink (&c->queues[w->client_id], w);
+
+	for (p = &r->waiters; *p != w; p = &(*p)->next_waiter)
+		assert (*p != NULL);
+	*p = w->next_waiter;
+	free (w);
+
+	if (!r->waiters && !r->in_flight) {
+		rb_delete (c->pending, r->file);
+		request_free (r);
+	}
 }
-#endif
 
-#ifdef HAVE_DB_H
-static char *cache_record_serialize (const struct cache_record *rec, int *len)
+/* Add the client's request for the tags of the file.  A request for the
+ * same file already pending or being read is shared; if there is none a
+ * new one is made unless join_only is set.  Return 0 if nothing was
+ * done. */
+static int request_add (struct tags_cache *c, const char *file,
+                        const int tags_sel, const int client_id,
+                        const int priority, const int join_only)
 {
-	char *buf;
-	char *p;
-	size_t artist_len;
-	size_t album_len;
-	size_t title_len;
-
-	artist_len = strlen_null (rec->tags->artist);
-	album_len = strlen_null (rec->tags->album);
-	title_len = strlen_null (rec->tags->title);
-
-	*len = sizeof(rec->mod_time)
-		+ sizeof(rec->atime)
-		+ sizeof(size_t) * 3 /* lengths of title, artist, time. */
-		+ artist_len
-		+ album_len
-		+ title_len
-		+ sizeof(rec->tags->track)
-		+ sizeof(rec->tags->time);
+	struct tags_request *r;
+	struct request_waiter *w;
+	struct request_queue *q = client_queue (c, client_id);
+
+	/* The read in progress will do if it reads the tags we want. */
+	r = request_find (c->in_flight, file);
+	if (r && (r->tags_sel & tags_sel) == tags_sel) {
+		if (!request_waiter (r, client_id)) {
+			w = (struct request_waiter *)xmalloc (
+					sizeof (struct request_waiter));
+			w->req = r;
+			w->client_id = client_id;
+			w->priority = priority;
+			w->queued = 0;
+			w->next_waiter = r->waiters;
+			r->waiters = w;
+		}
+		debug ("Request for %s joined the read in progress", file);
+		return 1;
+	}
 
-	buf = p = (char *)xmalloc (*len);
+	r = request_find (c->pending, file);
+	if (!r) {
+		if (join_only)
+			return 0;
+
+		r = (struct tags_request *)xmalloc (sizeof (struct tags_request));
+		r->file = xstrdup (file);
+		r->tags_sel = 0;
+		r->in_flight = 0;
+		r->waiters = NULL;
+		rb_insert (c->pending, r);
+	}
+
+	r->tags_sel |= tags_sel;
+
+	/* A repeated request is moved to the end of the queue, as if it was
+	 * a new one. */
+	w = request_waiter (r, client_id);
+	if (w)
+		request_queue_unlink (q, w);
+	else {
+		w = (struct request_waiter *)xmalloc (sizeof (struct request_waiter));
+		w->req = r;
+		w->client_id = client_id;
+		w->priority = priority;
+		w->next_waiter = r->waiters;
+		r->waiters = w;
+	}
+
+	w->priority = MAX(w->priority, priority);
+	request_queue_append (q, w);
+
+	return 1;
+}
+
+/* Take the next request to read from the client's queue: it is moved to
+ * the requests in flight and removed from the queues of all clients
+ * waiting for it. */
+static struct tags_request *request_take (struct tags_cache *c,
+                                          const int client_id)
+{
+	struct request_waiter *w;
+	struct tags_request *r;
+
+	w = request_queue_first (&c->queues[client_id]);
+	assert (w != NULL);
+
+	r = w->req;
+	for (w = r->waiters; w; w = w->next_waiter) {
+		if (w->queued)
+			request_queue_unlink (&c->queues[w->client_id], w);
+	}
+
+	rb_delete (c->pending, r->file);
+	rb_insert (c->in_flight, r);
+	r->in_flight = 1;
+
+	return r;
+}
+
+/* Remove all of the client's requests queued before the one for the file
+ * (including it), or all of them if there is none for the file. */
+static void request_queue_clear_up_to (struct tags_cache *c,
+                                       const int client_id, const char *file)
+{
+	struct request_queue *q = client_queue (c, client_id);
+	struct tags_request *r;
+	struct request_waiter *w = NULL;
+	unsigned long last;
+	int i;
+
+	r = request_find (c->pending, file);
+	if (r)
+		w = request_waiter (r, client_id);
+	last = w ? w->seq : q->seq;
+
+	/* The requests are in the order of seq, except the prioritized ones
+	 * which keep their place in the order.  There are only as many of
+	 * them as the client can show at once. */
+	for (i = 0; i < REQUEST_PRIORITIES; i += 1) {
+		w = q->head[i];
+		while (w && (w->seq <= last || i != REQUEST_PRIO_NORMAL)) {
+			struct request_waiter *next = w->next;
+
+			if (w->seq <= last)
+				request_waiter_remove (c, w);
+			w = next;
+		}
+	}
+}
+
+/* Remove all the client's requests, including the ones being read. */
+static void request_queue_clear (struct tags_cache *c, const int client_id)
+{
+	struct request_queue *q = client_queue (c, client_id);
+	struct rb_node *x;
+	int i;
+
+	for (i = 0; i < REQUEST_PRIORITIES; i += 1) {
+		while (q->head[i])
+			request_waiter_remove (c, q->head[i]);
+	}
+
+	for (x = rb_min (c->in_flight); !rb_is_null (x); x = rb_next (x)) {
+		struct tags_request *r;
+		struct request_waiter *w;
+
+		r = (struct tags_request *)rb_get_data (x);
+		w = request_waiter (r, client_id);
+		if (w)
+			request_waiter_remove (c, w);
+	}
+}
+
+/* Free all the requests in the tree. */
+static void request_tree_clear (struct rb_tree *tree)
+{
+	struct rb_node *x;
+
+	for (x = rb_min (tree); !rb_is_null (x); x = rb_next (x)) {
+		struct tags_request *r;
+
+		r = (struct tags_request *)rb_get_data (x);
+		while (r->waiters) {
+			struct request_waiter *w = r->waiters;
+
+			r->waiters = w->next_waiter;
+			free (w);
+		}
+		request_free (r);
+	}
+
+	rb_tree_clear (tree);
+}
+
+/* Records of the cache DB are stored in a compact, architecture
+ * independent format.  A fixed size header comes first so that the
+ * times can be read in place, without decoding the rest:
+ *
+ *   byte 0      format of the record (CACHE_RECORD_FORMAT)
+ *   byte 1      size of the header
+ *   byte 2      TAGS_* present in the record
+ *   byte 3      reserved, 0
+ *   bytes 4-11  modification time of the file
+ *   bytes 12-19 access time
+ *   bytes 20-23 time (length) of the file
+ *
+ * All numbers are little endian.  The header is followed by the track
+ * number (zigzag varint) and artist, album and title, each as a varint of
+ * the length plus one (0 for NULL) followed by the string.  After that
+ * there can be any number of extra fields, each a varint field number, a
+ * varint length and the value; readers skip the ones they don't know, so
+ * new fields can be added without changing CACHE_DB_FORMAT_VERSION. */
+#define CACHE_RECORD_FORMAT	2
+#define CACHE_RECORD_HEADER	24
+
+static char *put_le (char *p, uint64_t val, const int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i += 1) {
+		*p++ = (char)(val & 0xff);
+		val >>= 8;
+	}
+
+	return p;
+}
+
+static uint64_t get_le (const char *p, const int bytes)
+{
+	uint64_t val = 0;
+	int i;
+
+	for (i = bytes - 1; i >= 0; i -= 1)
+		val = (val << 8) | (unsigned char)p[i];
 
-	memcpy (p, &rec->mod_time, sizeof(rec->mod_time));
-	p += sizeof(rec->mod_time);
+	return val;
+}
+
+static size_t varint_size (uint64_t val)
+{
+	size_t size = 1;
+
+	while (val >= 0x80) {
+		val >>= 7;
+		size += 1;
+	}
 
-	memcpy (p, &rec->atime, sizeof(rec->atime));
-	p += sizeof(rec->atime);
+	return size;
+}
 
-	memcpy (p, &artist_len, sizeof(artist_len));
-	p += sizeof(artist_len);
-	if (artist_len) {
-		memcpy (p, rec->tags->artist, artist_len);
-		p += artist_len;
+static char *put_varint (char *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (char)((val & 0x7f) | 0x80);
+		val >>= 7;
 	}
+	*p++ = (char)val;
+
+	return p;
+}
+
+/* Decode a varint at *p, not reading past end.  Return 0 on error. */
+static int get_varint (const char **p, const char *end, uint64_t *val)
+{
+	int shift;
 
-	memcpy (p, &album_len, sizeof(album_len));
-	p += sizeof(album_len);
-	if (album_len) {
-		memcpy (p, rec->tags->album, album_len);
-		p += album_len;
+	*val = 0;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char b = (unsigned char)*(*p)++;
+
+		*val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
 	}
 
-	memcpy (p, &title_len, sizeof(title_len));
-	p += sizeof(title_len);
-	if (title_len) {
-		memcpy (p, rec->tags->title, title_len);
-		p += title_len;
+	return 0;
+}
+
+static uint64_t zigzag (const int64_t val)
+{
+	return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static int64_t unzigzag (const uint64_t val)
+{
+	return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+static size_t str_field_size (const char *s)
+{
+	size_t len = s ? strlen (s) + 1 : 0;
+
+	return varint_size (len) + (len ? len - 1 : 0);
+}
+
+static char *put_str_field (char *p, const char *s)
+{
+	size_t len = s ? strlen (s) : 0;
+
+	p = put_varint (p, s ? len + 1 : 0);
+	memcpy (p, s, len);
+
+	return p + len;
+}
+
+/* Decode a string field at *p into a malloc()ed string, or just skip it
+ * if str is NULL.  Return 0 on error. */
+static int get_str_field (const char **p, const char *end, char **str)
+{
+	uint64_t len;
+
+	if (!get_varint (p, end, &len) || len > (uint64_t)(end - *p) + 1)
+		return 0;
+
+	if (len == 0) {
+		if (str)
+			*str = NULL;
+		return 1;
 	}
 
-	memcpy (p, &rec->tags->track, sizeof(rec->tags->track));
-	p += sizeof(rec->tags->track);
+	len -= 1;
+	if (str) {
+		*str = (char *)xmalloc (len + 1);
+		memcpy (*str, *p, len);
+		(*str)[len] = '\0';
+	}
+	*p += len;
 
-	memcpy (p, &rec->tags->time, sizeof(rec->tags->time));
-	p += sizeof(rec->tags->time);
+	return 1;
+}
+
+static char *cache_record_serialize (const struct cache_record *rec, int *len)
+{
+	char *buf;
+	char *p;
+	const struct file_tags *tags = rec->tags;
+	int filled = tags->filled & (TAGS_COMMENTS | TAGS_TIME);
+
+	*len = CACHE_RECORD_HEADER
+		+ varint_size (zigzag (tags->track))
+		+ str_field_size (tags->artist)
+		+ str_field_size (tags->album)
+		+ str_field_size (tags->title);
+
+	buf = p = (char *)xmalloc (*len);
+
+	*p++ = CACHE_RECORD_FORMAT;
+	*p++ = CACHE_RECORD_HEADER;
+	*p++ = (char)filled;
+	*p++ = 0;
+	p = put_le (p, (uint64_t)(int64_t)rec->mod_time, 8);
+	p = put_le (p, (uint64_t)(int64_t)rec->atime, 8);
+	p = put_le (p, (uint64_t)(int32_t)tags->time, 4);
+
+	p = put_varint (p, zigzag (tags->track));
+	p = put_str_field (p, tags->artist);
+	p = put_str_field (p, tags->album);
+	p = put_str_field (p, tags->title);
+
+	assert (p - buf == *len);
 
 	return buf;
 }
-#endif
 
-#ifdef HAVE_DB_H
+/* Decode the record.  If skip_tags is set only the header is read, in
+ * place and without allocating anything: rec->tags is then NULL but
+ * rec->filled and rec->time are valid. */
 static int cache_record_deserialize (struct cache_record *rec,
            const char *serialized, size_t size, int skip_tags)
 {
 	const char *p = serialized;
-	size_t bytes_left = size;
-	size_t str_len;
+	const char *end = serialized + size;
+	struct file_tags *tags;
+	uint64_t val;
 
 	assert (rec != NULL);
 	assert (serialized != NULL);
 
-	if (!skip_tags)
-		rec->tags = tags_new ();
-	else
-		rec->tags = NULL;
+	rec->tags = NULL;
 
-#define extract_num(var) \
-	do { \
-		if (bytes_left < sizeof(var)) \
-			goto err; \
-		memcpy (&var, p, sizeof(var)); \
-		bytes_left -= sizeof(var); \
-		p += sizeof(var); \
-	} while (0)
-
-#define extract_str(var) \
-	do { \
-		if (bytes_left < sizeof(str_len)) \
-			goto err; \
-		memcpy (&str_len, p, sizeof(str_len)); \
-		p += sizeof(str_len); \
-		if (bytes_left < str_len) \
-			goto err; \
-		var = xmalloc (str_len + 1); \
-		memcpy (var, p, str_len); \
-		var[str_len] = '\0'; \
-		p += str_len; \
-	} while (0)
-
-	extract_num (rec->mod_time);
-	extract_num (rec->atime);
-
-	if (!skip_tags) {
-		extract_str (rec->tags->artist);
-		extract_str (rec->tags->album);
-		extract_str (rec->tags->title);
-		extract_num (rec->tags->track);
-		extract_num (rec->tags->time);
-
-		if (rec->tags->title)
-			rec->tags->filled |= TAGS_COMMENTS;
-		else {
-			if (rec->tags->artist)
-				free (rec->tags->artist);
-			rec->tags->artist = NULL;
+	if (size < CACHE_RECORD_HEADER
+			|| p[0] != CACHE_RECORD_FORMAT
+			|| (unsigned char)p[1] < CACHE_RECORD_HEADER
+			|| (unsigned char)p[1] > size)
+		goto err;
 
-			if (rec->tags->album)
-				free (rec->tags->album);
-			rec->tags->album = NULL;
-		}
+	rec->filled = (unsigned char)p[2];
+	rec->mod_time = (time_t)(int64_t)get_le (p + 4, 8);
+	rec->atime = (time_t)(int64_t)get_le (p + 12, 8);
+	rec->time = (int32_t)get_le (p + 20, 4);
+
+	if (skip_tags)
+		return 1;
 
-		if (rec->tags->time >= 0)
-			rec->tags->filled |= TAGS_TIME;
+	p += (unsigned char)p[1];
+
+	tags = rec->tags = tags_new ();
+	tags->filled = rec->filled;
+	tags->time = rec->time;
+
+	if (!get_varint (&p, end, &val))
+		goto err;
+	tags->track = (int)unzigzag (val);
+
+	if (!get_str_field (&p, end, &tags->artist)
+			|| !get_str_field (&p, end, &tags->album)
+			|| !get_str_field (&p, end, &tags->title))
+		goto err;
+
+	/* Skip the fields added by newer versions. */
+	while (p < end) {
+		if (!get_varint (&p, end, &val) || !get_varint (&p, end, &val)
+				|| val > (uint64_t)(end - p))
+			goto err;
+		p += val;
 	}
 
 	return 1;
 
 err:
 	logit ("Cache record deserialization error at %tdB", p - serialized);
-	tags_free (rec->tags);
-	rec->tags = NULL;
+	if (rec->tags) {
+		tags_free (rec->tags);
+		rec->tags = NULL;
+	}
 	return 0;
 }
+
+/* Return the BerkeleyDB locker to be used by the given reader thread, or
+ * by the server if reader is -1.  Every thread needs its own locker as
+ * locks held by the same locker don't conflict. */
+#ifdef HAVE_DB_H
+static u_int32_t db_locker (const struct tags_cache *c, const int reader)
+{
+	assert (reader < c->nreaders);
+
+	return reader == -1 ? c->locker : c->reader_lockers[reader];
+}
 #endif
 
 /* Locked DB function prototype.
  * The function must not acquire or release DB locks. */
-#ifdef HAVE_DB_H
-typedef void *t_locked_fn (struct tags_cache *, const char *,
-                                      int, int, DBT *, DBT *);
-#endif
+typedef void *t_locked_fn (struct tags_cache *, const char *, int, int);
 
 /* This function ensures that a DB function takes place while holding a
- * database record lock.  It also provides an initialised database thang
- * for the key and record. */
-#ifdef HAVE_DB_H
+ * database record lock.
+ *
+ * The built-in store has no record locks: it is consistent by itself and
+ * two readers handling the same file at once only read it twice. */
 static void *with_db_lock (t_locked_fn fn, struct tags_cache *c,
-                           const char *file, int tags_sel, int client_id)
+                           int reader DB_ONLY, const char *file,
+                           int tags_sel, int client_id)
 {
+#ifdef HAVE_DB_H
 	int rc;
 	void *result;
 	DB_LOCK lock;
-	DBT key, record;
+	DBT key;
 
 	assert (c->db_env != NULL);
 
@@ -381,37 +1150,111 @@ static void *with_db_lock (t_locked_fn fn, struct tags_cache *c,
 	key.data = (void *) file;
 	key.size = strlen (file);
 
-	memset (&record, 0, sizeof (record));
-	record.flags = DB_DBT_MALLOC;
-
-	rc = c->db_env->lock_get (c->db_env, c->locker, 0,
+	rc = c->db_env->lock_get (c->db_env, db_locker (c, reader), 0,
 			&key, DB_LOCK_WRITE, &lock);
 	if (rc)
 		fatal ("Can't get DB lock: %s", db_strerror (rc));
 
-	result = fn (c, file, tags_sel, client_id, &key, &record);
+	result = fn (c, file, tags_sel, client_id);
 
 	rc = c->db_env->lock_put (c->db_env, &lock);
 	if (rc)
 		fatal ("Can't release DB lock: %s", db_strerror (rc));
 
-	if (record.data)
-		free (record.data);
-
 	return result;
+#else
+	assert (c->store != NULL);
+
+	return fn (c, file, tags_sel, client_id);
+#endif
+}
+
+/* Is the cache DB open? */
+static int tags_cache_db_open (const struct tags_cache *c)
+{
+#ifdef HAVE_DB_H
+	return c->db != NULL;
+#else
+	return c->store != NULL;
+#endif
 }
+
+/* Get the serialized cache record for the file (malloc()ed) and put its
+ * size in *size.  Return NULL if there is none. */
+static char *tags_cache_get_rec (struct tags_cache *c, const char *file,
+                                 size_t *size)
+{
+#ifdef HAVE_DB_H
+	DBT key, record;
+	int ret;
+
+	memset (&key, 0, sizeof (key));
+	key.data = (void *)file;
+	key.size = strlen (file);
+
+	memset (&record, 0, sizeof (record));
+	record.flags = DB_DBT_MALLOC;
+
+	ret = c->db->get (c->db, NULL, &key, &record, 0);
+	if (ret) {
+		if (ret != DB_NOTFOUND)
+			error ("Cache DB search error: %s", db_strerror (ret));
+		return NULL;
+	}
+
+	*size = record.size;
+
+	return (char *)record.data;
+#else
+	return tags_store_get (c->store, file, size);
 #endif
+}
 
+/* Store the record for the file.  Return 0 if it wasn't stored. */
+static int tags_cache_put_rec (struct tags_cache *c, const char *file,
+                               const char *data, const size_t size)
+{
 #ifdef HAVE_DB_H
+	DBT key, record;
+	int ret;
+
+	memset (&key, 0, sizeof (key));
+	key.data = (void *)file;
+	key.size = strlen (file);
+
+	memset (&record, 0, sizeof (record));
+	record.data = (void *)data;
+	record.size = size;
+
+	ret = c->db->put (c->db, NULL, &key, &record, 0);
+	if (ret) {
+		error ("DB put error: %s", db_strerror (ret));
+		return 0;
+	}
+#else
+	/* The store refuses records too big for it, these files are just
+	 * not cached. */
+	if (!tags_store_put (c->store, file, data, size)) {
+		logit ("Not caching the tags of %s", file);
+		return 0;
+	}
+#endif
+
+	return 1;
+}
+
 static void tags_cache_remove_rec (struct tags_cache *c, const char *fname)
 {
+#ifdef HAVE_DB_H
 	DBT key;
 	int ret;
+#endif
 
 	assert (fname != NULL);
 
 	debug ("Removing %s from the cache...", fname);
 
+#ifdef HAVE_DB_H
 	memset (&key, 0, sizeof(key));
 	key.data = (void *)fname;
 	key.size = strlen (fname);
@@ -420,21 +1263,86 @@ static void tags_cache_remove_rec (struct tags_cache *c, const char *fname)
 	if (ret)
 		logit ("Can't remove item for %s from the cache: %s", fname,
 				db_strerror (ret));
-}
+#else
+	if (!tags_store_del (c->store, fname))
+		logit ("Can't remove item for %s from the cache", fname);
 #endif
+}
 
-/* Remove the one element of the cache based on it's access time. */
-#ifdef HAVE_DB_H
-static void tags_cache_gc (struct tags_cache *c)
+/* Record the access to the file in the LRU index and return the name of
+ * the record to remove to keep the cache within its size limit (malloc()ed)
+ * or NULL.
+ *
+ * The record is removed without holding its DB lock, so another reader
+ * may have just stored it again; this leaves the file in the index but
+ * not in the DB, which costs nothing but a failed removal later. */
+static char *tags_cache_gc (struct tags_cache *c, const char *file,
+                            const time_t atime)
+{
+	char *victim = NULL;
+
+	LOCK (c->mutex);
+	if (lru_touch (&c->lru, file, atime) && c->lru.nitems > c->max_items)
+		victim = lru_pop_oldest (&c->lru);
+	debug ("Elements in cache: %d (limit %d)", c->lru.nitems, c->max_items);
+	UNLOCK (c->mutex);
+
+	return victim;
+}
+
+/* The LRU index being built by tags_cache_build_index(). */
+struct index_build
+{
+	struct lru_node **nodes;
+	int count;
+	int size;
+	lists_t_strs *bad;	/* records which can't be read */
+};
+
+static void index_build_add (void *data, const char *file,
+                             const char *serialized, size_t size)
+{
+	struct index_build *b = (struct index_build *)data;
+	struct cache_record rec;
+	struct lru_node *n;
+
+	if (!cache_record_deserialize (&rec, serialized, size, 1)) {
+		lists_strs_append (b->bad, file);
+		return;
+	}
+
+	n = (struct lru_node *)xmalloc (offsetof (struct lru_node, file)
+	                                + strlen (file) + 1);
+	strcpy (n->file, file);
+	n->atime = rec.atime;
+
+	if (b->count == b->size) {
+		b->size *= 2;
+		b->nodes = (struct lru_node **)xrealloc (b->nodes,
+		                  b->size * sizeof (struct lru_node *));
+	}
+	b->nodes[b->count++] = n;
+}
+
+/* Scan the DB once to build the LRU index, removing records which can't
+ * be read.  The records are ordered by the time they were stored. */
+static void tags_cache_build_index (struct tags_cache *c)
 {
+	struct index_build b;
+	int ix;
+#ifdef HAVE_DB_H
 	DBC *cur;
 	DBT key;
 	DBT serialized_cache_rec;
 	int ret;
-	char *last_referenced = NULL;
-	time_t last_referenced_atime = time (NULL) + 1;
-	int nitems = 0;
+#endif
+
+	b.count = 0;
+	b.size = 64;
+	b.nodes = (struct lru_node **)xmalloc (b.size * sizeof (struct lru_node *));
+	b.bad = lists_strs_new (4);
 
+#ifdef HAVE_DB_H
 	c->db->cursor (c->db, NULL, &cur, 0);
 
 	memset (&key, 0, sizeof(key));
@@ -444,7 +1352,7 @@ static void tags_cache_gc (struct tags_cache *c)
 	serialized_cache_rec.flags = DB_DBT_MALLOC;
 
 	while (true) {
-		struct cache_record rec;
+		char *file;
 
 #if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
 		ret = cur->c_get (cur, &key, &serialized_cache_rec, DB_NEXT);
@@ -455,28 +1363,20 @@ static void tags_cache_gc (struct tags_cache *c)
 		if (ret != 0)
 			break;
 
-		if (cache_record_deserialize (&rec, serialized_cache_rec.data,
-					serialized_cache_rec.size, 1)
-				&& rec.atime < last_referenced_atime) {
-			last_referenced_atime = rec.atime;
-
-			if (last_referenced)
-				free (last_referenced);
-			last_referenced = (char *)xmalloc (key.size + 1);
-			memcpy (last_referenced, key.data, key.size);
-			last_referenced[key.size] = '\0';
-		}
-
-		// TODO: remove objects with serialization error.
+		file = (char *)xmalloc (key.size + 1);
+		memcpy (file, key.data, key.size);
+		file[key.size] = '\0';
 
-		nitems++;
+		index_build_add (&b, file, serialized_cache_rec.data,
+		                 serialized_cache_rec.size);
 
+		free (file);
 		free (key.data);
 		free (serialized_cache_rec.data);
 	}
 
 	if (ret != DB_NOTFOUND)
-		logit ("Searching for element to remove failed (cursor): %s",
+		logit ("Reading the cache index failed (cursor): %s",
 				db_strerror (ret));
 
 #if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
@@ -484,46 +1384,75 @@ static void tags_cache_gc (struct tags_cache *c)
 #else
 	cur->close (cur);
 #endif
+#else
+	tags_store_foreach (c->store, index_build_add, &b);
+#endif
+
+	for (ix = 0; ix < lists_strs_size (b.bad); ix += 1)
+		tags_cache_remove_rec (c, lists_strs_at (b.bad, ix));
+	lists_strs_free (b.bad);
 
-	debug ("Elements in cache: %d (limit %d)", nitems, c->max_items);
+	qsort (b.nodes, b.count, sizeof (struct lru_node *), lru_atime_cmp);
 
-	if (last_referenced) {
-		if (nitems >= c->max_items)
-			tags_cache_remove_rec (c, last_referenced);
-		free (last_referenced);
+	LOCK (c->mutex);
+	lru_clear (&c->lru);
+	for (ix = 0; ix < b.count; ix += 1) {
+		lru_append (&c->lru, b.nodes[ix]);
+		rb_insert (c->lru.search_tree, b.nodes[ix]);
 	}
-	else
-		debug ("Cache empty");
+	c->lru.nitems = b.count;
+	UNLOCK (c->mutex);
+
+	free (b.nodes);
+
+	logit ("Tags cache index: %d items", b.count);
 }
-#endif
 
-/* Synchronize cache every DB_SYNC_COUNT updates. */
-#ifdef HAVE_DB_H
-static void tags_cache_sync (struct tags_cache *c)
+/* Count an update of the DB. */
+static void tags_cache_updated (struct tags_cache *c)
+{
+	LOCK (c->mutex);
+	if (c->sync_count++ == 0)
+		c->sync_time = time (NULL);
+	UNLOCK (c->mutex);
+}
+
+/* Flush the pending updates to disk if there are enough of them or they
+ * are old enough, or if there are any at all and force is set. */
+static void tags_cache_sync (struct tags_cache *c, const int force)
 {
-	static int sync_count = 0;
+	int sync;
 
 	if (DB_SYNC_COUNT == 0)
 		return;
 
-	sync_count += 1;
-	if (sync_count >= DB_SYNC_COUNT) {
-		sync_count = 0;
+	LOCK (c->mutex);
+	sync = c->sync_count > 0
+		&& (force || c->sync_count >= DB_SYNC_COUNT
+		    || time (NULL) - c->sync_time >= DB_SYNC_INTERVAL);
+	if (sync) {
+		debug ("Flushing %d cache updates", c->sync_count);
+		c->sync_count = 0;
+	}
+	UNLOCK (c->mutex);
+
+	if (sync) {
+#ifdef HAVE_DB_H
 		c->db->sync (c->db, 0);
+#else
+		tags_store_sync (c->store);
+#endif
 	}
 }
-#endif
 
 /* Add this tags object for the file to the cache. */
-#ifdef HAVE_DB_H
 static void tags_cache_add (struct tags_cache *c, const char *file,
-                                  DBT *key, struct file_tags *tags)
+                                              struct file_tags *tags)
 {
 	char *serialized_cache_rec;
 	int serial_len;
 	struct cache_record rec;
-	DBT data;
-	int ret;
+	char *victim;
 
 	assert (tags != NULL);
 
@@ -537,21 +1466,23 @@ static void tags_cache_add (struct tags_cache *c, const char *file,
 	if (!serialized_cache_rec)
 		return;
 
-	memset (&data, 0, sizeof(data));
-	data.data = serialized_cache_rec;
-	data.size = serial_len;
+	if (!tags_cache_put_rec (c, file, serialized_cache_rec, serial_len)) {
+		free (serialized_cache_rec);
+		return;
+	}
 
-	tags_cache_gc (c);
+	victim = tags_cache_gc (c, file, rec.atime);
 
-	ret = c->db->put (c->db, NULL, key, &data, 0);
-	if (ret)
-		error ("DB put error: %s", db_strerror (ret));
+	if (victim) {
+		tags_cache_remove_rec (c, victim);
+		free (victim);
+	}
 
-	tags_cache_sync (c);
+	tags_cache_updated (c);
+	tags_cache_sync (c, 0);
 
 	free (serialized_cache_rec);
 }
-#endif
 
 /* Read time tags for a file into tags structure (or create it if NULL). */
 struct file_tags *read_missing_tags (const char *file,
@@ -579,141 +1510,178 @@ struct file_tags *read_missing_tags (const char *file,
 }
 
 /* Read the selected tags for this file and add it to the cache. */
-#ifdef HAVE_DB_H
 static void *locked_read_add (struct tags_cache *c, const char *file,
-                              const int tags_sel, const int client_id,
-                              DBT *key, DBT *serialized_cache_rec)
+                              const int tags_sel,
+                              const int unused ATTR_UNUSED)
 {
-	int ret;
+	char *serialized_cache_rec;
+	size_t size;
 	struct file_tags *tags = NULL;
 
-	assert (c->db != NULL);
+	assert (tags_cache_db_open (c));
 
-	ret = c->db->get (c->db, NULL, key, serialized_cache_rec, 0);
-	if (ret && ret != DB_NOTFOUND)
-		logit ("Cache DB get error: %s", db_strerror (ret));
+	serialized_cache_rec = tags_cache_get_rec (c, file, &size);
 
 	/* If this entry is already present in the cache, we have 3 options:
-	 * we must read different tags (TAGS_*) or the tags are outdated
-	 * or this is an immediate tags read (client_id == -1) */
-	if (ret == 0) {
+	 * the tags are what we want, we must read different tags (TAGS_*)
+	 * or the tags are outdated. */
+	if (serialized_cache_rec) {
 		struct cache_record rec;
 
-		if (cache_record_deserialize (&rec, serialized_cache_rec->data,
-		                              serialized_cache_rec->size, 0)) {
-			time_t curr_mtime = get_mtime (file);
-
-			if (rec.mod_time != curr_mtime) {
+		if (cache_record_deserialize (&rec, serialized_cache_rec, size, 1)) {
+			if (rec.mod_time != get_mtime (file))
 				debug ("Tags in the cache are outdated");
-				tags_free (rec.tags);  /* remove them and reread tags */
-			}
-			else if ((rec.tags->filled & tags_sel) == tags_sel
-					&& client_id == -1) {
-				debug ("Tags are in the cache.");
-				return rec.tags;
-			}
-			else {
+			else if (cache_record_deserialize (&rec,
+			                serialized_cache_rec, size, 0)) {
+				if ((rec.tags->filled & tags_sel) == tags_sel) {
+					debug ("Tags are in the cache.");
+					LOCK (c->mutex);
+					lru_touch (&c->lru, file, time (NULL));
+					UNLOCK (c->mutex);
+					free (serialized_cache_rec);
+					return rec.tags;
+				}
+
 				debug ("Tags in the cache are not what we want");
 				tags = rec.tags;  /* read additional tags */
 			}
 		}
+
+		free (serialized_cache_rec);
 	}
 
 	tags = read_missing_tags (file, tags, tags_sel);
-	tags_cache_add (c, file, key, tags);
+	tags_cache_add (c, file, tags);
 
 	return tags;
 }
-#endif
 
-/* Read the selected tags for this file and add it to the cache.
- * If client_id != -1, the server is notified using tags_response().
- * If client_id == -1, copy of file_tags is returned. */
-static struct file_tags *tags_cache_read_add (struct tags_cache *c DB_ONLY,
-                     const char *file, int tags_sel, int client_id)
+/* Read the selected tags for this file and add it to the cache, return
+ * them (malloc()ed).  The reader is the index of the calling reader thread
+ * or -1. */
+static struct file_tags *tags_cache_read_add (struct tags_cache *c,
+                     int reader, const char *file, int tags_sel)
 {
 	struct file_tags *tags = NULL;
+	time_t mtime;
 
 	assert (file != NULL);
 
 	debug ("Getting tags for %s", file);
 
-#ifdef HAVE_DB_H
-	if (c->max_items)
-		tags = (struct file_tags *)with_db_lock (locked_read_add, c, file,
-		                                         tags_sel, client_id);
-	else
-#endif
-		tags = read_missing_tags (file, tags, tags_sel);
-
-	if (client_id != -1) {
-		tags_response (client_id, file, tags);
-		tags_free (tags);
-		tags = NULL;
+	mtime = get_mtime (file);
+	tags = hot_get (c, file, mtime, tags_sel);
+	if (tags) {
+		debug ("Tags are in memory");
+		hot_touch_db (c, file);
 	}
+	else {
+		if (c->max_items)
+			tags = (struct file_tags *)with_db_lock (locked_read_add, c,
+			                      reader, file, tags_sel, -1);
+		else
+			tags = read_missing_tags (file, tags, tags_sel);
 
-	/* TODO: Remove the oldest items from the cache if we exceeded the maximum
-	 * cache size */
+		hot_put (c, file, mtime, tags);
+	}
 
 	return tags;
 }
 
-static void *reader_thread (void *cache_ptr)
+static void *reader_thread (void *reader_ptr)
 {
+	struct tags_reader *reader;
 	struct tags_cache *c;
-	int curr_queue = 0; /* index of the queue from where
-	                       we will get the next request */
 
-	logit ("Tags reader thread started");
+	assert (reader_ptr != NULL);
 
-	assert (cache_ptr != NULL);
+	reader = (struct tags_reader *)reader_ptr;
+	c = reader->c;
 
-	c = (struct tags_cache *)cache_ptr;
+	logit ("Tags reader thread %d started", reader->id);
 
 	LOCK (c->mutex);
 
 	while (!c->stop_reader_thread) {
 		int i;
-		char *request_file;
-		int tags_sel = 0;
+		struct tags_request *r;
+		struct request_waiter *w, *waiters;
+		struct file_tags *tags;
 
 		/* Find the queue with a request waiting.  Begin searching at
 		 * curr_queue: we want to get one request from each queue,
-		 * and then move to the next non-empty queue. */
-		i = curr_queue;
-		while (i < CLIENTS_MAX && request_queue_empty (&c->queues[i]))
+		 * and then move to the next non-empty queue.  curr_queue is
+		 * shared by all readers, so the clients are served fairly
+		 * whichever reader takes the request. */
+		i = c->curr_queue;
+		while (i < c->nqueues && request_queue_empty (&c->queues[i]))
 			i++;
-		if (i == CLIENTS_MAX) {
+		if (i >= c->nqueues) {
 			i = 0;
-			while (i < curr_queue && request_queue_empty (&c->queues[i]))
+			while (i < c->curr_queue
+					&& request_queue_empty (&c->queues[i]))
 				i++;
 
-			if (i == curr_queue) {
+			if (i == c->curr_queue) {
+				/* A good moment to write out the last group of
+				 * updates. */
+				if (c->sync_count > 0 && tags_cache_db_open (c)) {
+					UNLOCK (c->mutex);
+					tags_cache_sync (c, 1);
+					LOCK (c->mutex);
+					continue;
+				}
 				debug ("All queues empty, waiting");
 				pthread_cond_wait (&c->request_cond, &c->mutex);
 				continue;
 			}
 		}
-		curr_queue = i;
 
-		request_file = request_queue_pop (&c->queues[curr_queue], &tags_sel);
+		r = request_take (c, i);
+		c->curr_queue = (i + 1) % c->nqueues;
+		UNLOCK (c->mutex);
+
+		tags = tags_cache_read_add (c, reader->id, r->file, r->tags_sel);
+
+		/* Answer all the clients which have asked for the file in
+		 * the meantime. */
+		LOCK (c->mutex);
+		rb_delete (c->in_flight, r->file);
+		waiters = r->waiters;
+		r->waiters = NULL;
 		UNLOCK (c->mutex);
 
-		tags_cache_read_add (c, request_file, tags_sel, curr_queue);
-		free (request_file);
+		while ((w = waiters)) {
+			waiters = w->next_waiter;
+			tags_response (w->client_id, r->file, tags);
+			free (w);
+		}
+		request_free (r);
+		tags_free (tags);
 
 		LOCK (c->mutex);
-		curr_queue = (curr_queue + 1) % CLIENTS_MAX;
 	}
 
 	UNLOCK (c->mutex);
 
-	logit ("Exiting tags reader thread");
+	logit ("Exiting tags reader thread %d", reader->id);
 
 	return NULL;
 }
 
-struct tags_cache *tags_cache_new (size_t max_size)
+/* Return the number of reader threads to use for the TagsReaderThreads
+ * option value. */
+static int tags_readers_count (int readers)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	if (readers == 0)
+		readers = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+	return CLAMP(1, readers, READERS_MAX);
+}
+
+struct tags_cache *tags_cache_new (size_t max_size, int readers)
 {
 	int i, rc;
 	struct tags_cache *result;
@@ -723,26 +1691,49 @@ struct tags_cache *tags_cache_new (size_t max_size)
 #ifdef HAVE_DB_H
 	result->db_env = NULL;
 	result->db = NULL;
+	result->reader_lockers = NULL;
+#else
+	result->store = NULL;
 #endif
+	lru_init (&result->lru);
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		request_queue_init (&result->queues[i]);
+	result->queues = NULL;
+	result->nqueues = 0;
+	result->curr_queue = 0;
+	result->pending = rb_tree_new (request_compare, request_compare_key,
+	                               NULL);
+	result->in_flight = rb_tree_new (request_compare, request_compare_key,
+	                                 NULL);
 
 #if CACHE_DB_FORMAT_VERSION
 	result->max_items = max_size;
 #else
 	result->max_items = 0;
 #endif
+	hot_init (result, result->max_items);
 	result->stop_reader_thread = 0;
+	result->sync_count = 0;
+	result->sync_time = 0;
 	pthread_mutex_init (&result->mutex, NULL);
 
 	rc = pthread_cond_init (&result->request_cond, NULL);
 	if (rc != 0)
 		fatal ("Can't create request_cond: %s", strerror (rc));
 
-	rc = pthread_create (&result->reader_thread, NULL, reader_thread, result);
-	if (rc != 0)
-		fatal ("Can't create tags cache thread: %s", strerror (rc));
+	result->nreaders = tags_readers_count (readers);
+	result->readers = (struct tags_reader *)xcalloc (result->nreaders,
+	                                        sizeof (struct tags_reader));
+	logit ("Using %d tags reader threads", result->nreaders);
+
+	for (i = 0; i < result->nreaders; i++) {
+		result->readers[i].c = result;
+		result->readers[i].id = i;
+
+		rc = pthread_create (&result->readers[i].tid, NULL, reader_thread,
+		                     &result->readers[i]);
+		if (rc != 0)
+			fatal ("Can't create tags cache thread: %s", strerror (rc));
+	}
 
 	return result;
 }
@@ -755,9 +1746,19 @@ void tags_cache_free (struct tags_cache *c)
 
 	LOCK (c->mutex);
 	c->stop_reader_thread = 1;
-	pthread_cond_signal (&c->request_cond);
+	pthread_cond_broadcast (&c->request_cond);
 	UNLOCK (c->mutex);
 
+	/* The readers may be using the DB, so wait for them first. */
+	for (i = 0; i < c->nreaders; i++) {
+		rc = pthread_join (c->readers[i].tid, NULL);
+		if (rc != 0)
+			fatal ("pthread_join() on cache reader thread failed: %s",
+			        strerror (rc));
+	}
+
+	free (c->readers);
+
 #ifdef HAVE_DB_H
 	if (c->db) {
 #ifndef NDEBUG
@@ -768,11 +1769,20 @@ void tags_cache_free (struct tags_cache *c)
 		c->db->close (c->db, 0);
 		c->db = NULL;
 	}
+#else
+	if (c->store) {
+		tags_store_close (c->store);
+		c->store = NULL;
+	}
 #endif
 
 #ifdef HAVE_DB_H
 	if (c->db_env) {
 		c->db_env->lock_id_free (c->db_env, c->locker);
+		if (c->reader_lockers) {
+			for (i = 0; i < c->nreaders; i++)
+				c->db_env->lock_id_free (c->db_env, c->reader_lockers[i]);
+		}
 #ifndef NDEBUG
 		c->db_env->set_errcall (c->db_env, NULL);
 		c->db_env->set_msgcall (c->db_env, NULL);
@@ -781,15 +1791,18 @@ void tags_cache_free (struct tags_cache *c)
 		c->db_env->close (c->db_env, 0);
 		c->db_env = NULL;
 	}
+	free (c->reader_lockers);
+	c->reader_lockers = NULL;
 #endif
+	lru_destroy (&c->lru);
 
-	rc = pthread_join (c->reader_thread, NULL);
-	if (rc != 0)
-		fatal ("pthread_join() on cache reader thread failed: %s",
-		        strerror (rc));
+	request_tree_clear (c->pending);
+	rb_tree_free (c->pending);
+	request_tree_clear (c->in_flight);
+	rb_tree_free (c->in_flight);
+	free (c->queues);
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		request_queue_clear (&c->queues[i]);
+	hot_destroy (c);
 
 	rc = pthread_mutex_destroy (&c->mutex);
 	if (rc != 0)
@@ -801,75 +1814,134 @@ void tags_cache_free (struct tags_cache *c)
 	free (c);
 }
 
-#ifdef HAVE_DB_H
-static void *locked_add_request (struct tags_cache *c, const char *file,
-                                 int tags_sel, int client_id,
-                                 DBT *key, DBT *serialized_cache_rec)
+/* Decode the DB record of the file into rec if it holds up-to-date tags
+ * including the selected ones.  Return 0 if there is no such record.
+ * Nothing is written to the DB. */
+static int cache_record_find (struct tags_cache *c, const char *file,
+                              const int tags_sel, struct cache_record *rec)
 {
-	int db_ret;
-	struct cache_record rec;
-
-	assert (c->db);
+	char *serialized_cache_rec;
+	size_t size;
+	int found;
 
-	db_ret = c->db->get (c->db, NULL, key, serialized_cache_rec, 0);
+	assert (tags_cache_db_open (c));
 
-	if (db_ret == DB_NOTFOUND)
-		return NULL;
+	serialized_cache_rec = tags_cache_get_rec (c, file, &size);
+	if (!serialized_cache_rec)
+		return 0;
 
-	if (db_ret) {
-		error ("Cache DB search error: %s", db_strerror (db_ret));
-		return NULL;
+	/* Check the header first, the tags are decoded only if they are
+	 * going to be used. */
+	found = cache_record_deserialize (rec, serialized_cache_rec, size, 1);
+	if (found && (rec->mod_time != get_mtime (file)
+				|| (rec->filled & tags_sel) != tags_sel)) {
+		debug ("Found outdated or incomplete tags in the cache");
+		found = 0;
 	}
 
-	if (cache_record_deserialize (&rec, serialized_cache_rec->data,
-				serialized_cache_rec->size, 0)) {
-		if (rec.mod_time == get_mtime (file)
-				&& (rec.tags->filled & tags_sel) == tags_sel) {
-			tags_response (client_id, file, rec.tags);
-			tags_free (rec.tags);
-			debug ("Tags are present in the cache");
-			return (void *)1;
-		}
+	if (found)
+		found = cache_record_deserialize (rec, serialized_cache_rec,
+		                                  size, 0);
 
-		tags_free (rec.tags);
-		debug ("Found outdated or incomplete tags in the cache");
-	}
+	free (serialized_cache_rec);
 
-	return NULL;
+	return found;
+}
+
+static void *locked_add_request (struct tags_cache *c, const char *file,
+                                 int tags_sel, int client_id)
+{
+	struct cache_record rec;
+
+	if (!cache_record_find (c, file, tags_sel, &rec))
+		return NULL;
+
+	LOCK (c->mutex);
+	lru_touch (&c->lru, file, time (NULL));
+	UNLOCK (c->mutex);
+	hot_put (c, file, rec.mod_time, rec.tags);
+	tags_response (client_id, file, rec.tags);
+	tags_free (rec.tags);
+	debug ("Tags are present in the cache");
+
+	return (void *)1;
 }
-#endif
 
 void tags_cache_add_request (struct tags_cache *c, const char *file,
                                         int tags_sel, int client_id)
 {
 	void *rc = NULL;
+	struct file_tags *tags;
 
 	assert (c != NULL);
 	assert (file != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (client_id >= 0);
 
 	debug ("Request for tags for '%s' from client %d", file, client_id);
 
-#ifdef HAVE_DB_H
-	if (c->max_items)
-		rc = with_db_lock (locked_add_request, c, file, tags_sel, client_id);
-#endif
+	tags = hot_get (c, file, get_mtime (file), tags_sel);
+	if (tags) {
+		debug ("Tags are in memory");
+		hot_touch_db (c, file);
+		tags_response (client_id, file, tags);
+		tags_free (tags);
+		return;
+	}
+
+	/* If the file is being read or waits to be read already, the client
+	 * just gets the result of that. */
+	LOCK (c->mutex);
+	rc = request_add (c, file, tags_sel, client_id, REQUEST_PRIO_NORMAL, 1)
+		? (void *)1 : NULL;
+	UNLOCK (c->mutex);
+
+	if (!rc && c->max_items)
+		rc = with_db_lock (locked_add_request, c, -1, file, tags_sel,
+		                   client_id);
 
 	if (!rc) {
 		LOCK (c->mutex);
-		request_queue_add (&c->queues[client_id], file, tags_sel);
+		request_add (c, file, tags_sel, client_id, REQUEST_PRIO_NORMAL, 0);
 		pthread_cond_signal (&c->request_cond);
 		UNLOCK (c->mutex);
 	}
 }
 
+/* Read the tags of the file requested by the client before the others,
+ * as the client shows it on the screen. */
+void tags_cache_prioritize (struct tags_cache *c, const char *file,
+                                                 int client_id)
+{
+	struct tags_request *r;
+	struct request_waiter *w = NULL;
+
+	assert (c != NULL);
+	assert (file != NULL);
+	assert (client_id >= 0);
+
+	LOCK (c->mutex);
+	r = request_find (c->pending, file);
+	if (r)
+		w = request_waiter (r, client_id);
+	if (w && w->priority < REQUEST_PRIO_VISIBLE) {
+		struct request_queue *q = client_queue (c, client_id);
+		unsigned long seq = w->seq;
+
+		request_queue_unlink (q, w);
+		w->priority = REQUEST_PRIO_VISIBLE;
+		request_queue_append (q, w);
+		w->seq = seq;
+	}
+	UNLOCK (c->mutex);
+}
+
 void tags_cache_clear_queue (struct tags_cache *c, int client_id)
 {
 	assert (c != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (client_id >= 0);
 
 	LOCK (c->mutex);
-	request_queue_clear (&c->queues[client_id]);
+	request_queue_clear (c, client_id);
 	debug ("Cleared requests queue for client %d", client_id);
 	UNLOCK (c->mutex);
 }
@@ -880,13 +1952,13 @@ void tags_cache_clear_up_to (struct tags_cache *c, const char *file,
                                                       int client_id)
 {
 	assert (c != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (client_id >= 0);
 	assert (file != NULL);
 
 	LOCK (c->mutex);
 	debug ("Removing requests for client %d up to file %s", client_id,
 			file);
-	request_queue_clear_up_to (&c->queues[client_id], file);
+	request_queue_clear_up_to (c, client_id, file);
 	UNLOCK (c->mutex);
 }
 
@@ -929,7 +2001,6 @@ static void db_panic_cb (DB_ENV *unused ATTR_UNUSED, int errval)
 #endif
 
 /* Purge content of a directory. */
-#ifdef HAVE_DB_H
 static int purge_directory (const char *dir_path)
 {
 	DIR *dir;
@@ -994,19 +2065,20 @@ static int purge_directory (const char *dir_path)
 	closedir (dir);
 	return 1;
 }
-#endif
 
-/* Create a MOC/db version string.
+/* Create a MOC/db version string.  The DB version is 0.0 for the
+ * built-in store.
  *
  * @param buf Output buffer (at least VERSION_TAG_MAX chars long)
  */
-#ifdef HAVE_DB_H
 static const char *create_version_tag (char *buf)
 {
-	int db_major;
-	int db_minor;
+	int db_major = 0;
+	int db_minor = 0;
 
+#ifdef HAVE_DB_H
 	db_version (&db_major, &db_minor, NULL);
+#endif
 
 #ifdef PACKAGE_REVISION
 	snprintf (buf, VERSION_TAG_MAX, "%d %d %d r%s",
@@ -1018,11 +2090,9 @@ static const char *create_version_tag (char *buf)
 
 	return buf;
 }
-#endif
 
 /* Check version of the cache directory.  If it was created
  * using format not handled by this version of MOC, return 0. */
-#ifdef HAVE_DB_H
 static int cache_version_matches (const char *cache_dir)
 {
 	char *fname = NULL;
@@ -1072,9 +2142,7 @@ static int cache_version_matches (const char *cache_dir)
 
 	return compare_result;
 }
-#endif
 
-#ifdef HAVE_DB_H
 static void write_cache_version (const char *cache_dir)
 {
 	char cur_version_tag[VERSION_TAG_MAX];
@@ -1100,10 +2168,8 @@ static void write_cache_version (const char *cache_dir)
 	free (fname);
 	fclose (f);
 }
-#endif
 
 /* Make sure that the cache directory exists and clear it if necessary. */
-#ifdef HAVE_DB_H
 static int prepare_cache_dir (const char *cache_dir)
 {
 	if (mkdir (cache_dir, 0700) == 0) {
@@ -1127,17 +2193,18 @@ static int prepare_cache_dir (const char *cache_dir)
 
 	return 1;
 }
-#endif
 
-void tags_cache_load (struct tags_cache *c DB_ONLY,
-                      const char *cache_dir DB_ONLY)
+void tags_cache_load (struct tags_cache *c, const char *cache_dir)
 {
+#ifdef HAVE_DB_H
+	int i, ret;
+#else
+	char *fname;
+#endif
+
 	assert (c != NULL);
 	assert (cache_dir != NULL);
 
-#ifdef HAVE_DB_H
-	int ret;
-
 	if (!c->max_items)
 		return;
 
@@ -1146,6 +2213,7 @@ void tags_cache_load (struct tags_cache *c DB_ONLY,
 		goto err;
 	}
 
+#ifdef HAVE_DB_H
 	ret = db_env_create (&c->db_env, 0);
 	if (ret) {
 		error ("Can't create DB environment: %s", db_strerror (ret));
@@ -1160,6 +2228,12 @@ void tags_cache_load (struct tags_cache *c DB_ONLY,
 		logit ("Could not set DB panic callback");
 #endif
 
+	/* With several reader threads, break any deadlock between them. */
+	ret = c->db_env->set_lk_detect (c->db_env, DB_LOCK_DEFAULT);
+	if (ret)
+		logit ("Could not set DB deadlock detection: %s",
+		        db_strerror (ret));
+
 	ret = c->db_env->open (c->db_env, cache_dir,
 	                       DB_CREATE | DB_PRIVATE | DB_INIT_MPOOL |
 	                       DB_THREAD | DB_INIT_LOCK, 0);
@@ -1175,6 +2249,16 @@ void tags_cache_load (struct tags_cache *c DB_ONLY,
 		goto err;
 	}
 
+	c->reader_lockers = (u_int32_t *)xcalloc (c->nreaders,
+	                                          sizeof (u_int32_t));
+	for (i = 0; i < c->nreaders; i++) {
+		ret = c->db_env->lock_id (c->db_env, &c->reader_lockers[i]);
+		if (ret) {
+			error ("Failed to get DB locker: %s", db_strerror (ret));
+			goto err;
+		}
+	}
+
 	ret = db_create (&c->db, c->db_env, 0);
 	if (ret) {
 		error ("Failed to create cache db: %s", db_strerror (ret));
@@ -1196,10 +2280,22 @@ void tags_cache_load (struct tags_cache *c DB_ONLY,
 		        db_strerror (ret));
 		goto err;
 	}
+#else
+	fname = (char *)xmalloc (strlen (cache_dir) + sizeof (TAGS_DB) + 1);
+	sprintf (fname, "%s/%s", cache_dir, TAGS_DB);
+	c->store = tags_store_open (fname);
+	free (fname);
+
+	if (!c->store)
+		goto err;
+#endif
+
+	tags_cache_build_index (c);
 
 	return;
 
 err:
+#ifdef HAVE_DB_H
 	if (c->db) {
 #ifndef NDEBUG
 		c->db->set_errcall (c->db, NULL);
@@ -1218,9 +2314,9 @@ err:
 		c->db_env->close (c->db_env, 0);
 		c->db_env = NULL;
 	}
+#endif
 	c->max_items = 0;
 	error ("Failed to initialise tags cache: caching disabled");
-#endif
 }
 
 /* Immediately read tags for a file bypassing the request queue. */
@@ -1235,9 +2331,40 @@ struct file_tags *tags_cache_get_immediate (struct tags_cache *c,
 	debug ("Immediate tags read for %s", file);
 
 	if (!is_url (file))
-		tags = tags_cache_read_add (c, file, tags_sel, -1);
+		tags = tags_cache_read_add (c, -1, file, tags_sel);
 	else
 		tags = tags_new ();
 
 	return tags;
 }
+
+/* Return the tags of the file, taking them from the cache if they are
+ * there and reading the file otherwise, without adding anything to the
+ * cache.  This is for bulk reads such as indexing the library, which
+ * would otherwise push the files the user works with out of the cache.
+ * The DB is only read, so no DB locks are taken and it can be called
+ * from any thread. */
+struct file_tags *tags_cache_get_uncached (struct tags_cache *c,
+                                  const char *file, int tags_sel)
+{
+	struct file_tags *tags;
+	struct cache_record rec;
+	time_t mtime;
+
+	assert (c != NULL);
+	assert (file != NULL);
+
+	if (is_url (file))
+		return tags_new ();
+
+	mtime = get_mtime (file);
+	tags = hot_get (c, file, mtime, tags_sel);
+	if (tags)
+		return tags;
+
+	if (c->max_items && tags_cache_db_open (c)
+			&& cache_record_find (c, file, tags_sel, &rec))
+		return rec.tags;
+
+	return read_missing_tags (file, NULL, tags_sel);
+}
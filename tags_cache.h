@@ -9,7 +9,7 @@ struct file_tags;
 struct tags_cache;
 
 /* Administrative functions: */
-struct tags_cache *tags_cache_new (size_t max_size);
+struct tags_cache *tags_cache_new (size_t max_size, int readers);
 void tags_cache_free (struct tags_cache *c);
 
 /* Request queue manipulation functions: */
@@ -22,8 +22,12 @@ void tags_cache_load (struct tags_cache *c, const char *cache_dir);
 void tags_cache_save (struct tags_cache *c, const char *cache_dir);
 void tags_cache_add_request (struct tags_cache *c, const char *file,
                                         int tags_sel, int client_id);
+void tags_cache_prioritize (struct tags_cache *c, const char *file,
+                                                 int client_id);
 struct file_tags *tags_cache_get_immediate (struct tags_cache *c,
                                   const char *file, int tags_sel);
+struct file_tags *tags_cache_get_uncached (struct tags_cache *c,
+                                  const char *file, int tags_sel);
 
 #ifdef __cplusplus
 }
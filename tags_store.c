@@ -0,0 +1,674 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Persistent key/value store for the tags cache.
+ *
+ * The store is a single file to which records are only ever appended:
+ *
+ *   "MOCTAGS1"                     once, at the beginning
+ *   key length, data length,
+ *   checksum, key, data            for each put()
+ *   key length, STORE_DELETED,
+ *   checksum, key                  for each del()
+ *
+ * The numbers are 32 bit little endian and the checksum covers the
+ * lengths, the key and the data.  An index of the latest record for each
+ * key is kept in memory and built by reading the file when it's opened;
+ * a damaged or incomplete record at the end (e.g. after a crash) ends the
+ * file and is cut off.  When more than half of the file is taken by
+ * overwritten or deleted records, the live ones are copied to a new file
+ * which replaces the old one. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "rbtree.h"
+#include "log.h"
+#include "tags_store.h"
+
+#define STORE_MAGIC "MOCTAGS1"
+#define STORE_MAGIC_LEN (sizeof(STORE_MAGIC) - 1)
+
+/* Size of the record header. */
+#define RECORD_HEADER 12
+
+/* Data length marking a deletion. */
+#define STORE_DELETED 0xffffffffu
+
+/* Sanity limits for the lengths read from the file. */
+#define KEY_MAX (64 * 1024)
+#define DATA_MAX (1024 * 1024)
+
+/* Don't bother compacting a file with less garbage than this. */
+#define COMPACT_MIN (256 * 1024)
+
+struct store_entry
+{
+	off_t offset;			/* offset of the data in the file */
+	size_t size;			/* size of the data */
+	char key[FLEXIBLE_ARRAY_MEMBER];
+};
+
+struct tags_store
+{
+	char *file_name;
+	int fd;
+	off_t end;			/* size of the valid part of the file */
+	off_t live;			/* bytes of records in the index */
+	int nitems;
+	struct rb_tree *index;		/* store_entries by key */
+	pthread_mutex_t mutex;		/* protects all above */
+};
+
+static int entry_compare (const void *a, const void *b,
+                          const void *unused ATTR_UNUSED)
+{
+	const struct store_entry *ea = (const struct store_entry *)a;
+	const struct store_entry *eb = (const struct store_entry *)b;
+
+	return strcmp (ea->key, eb->key);
+}
+
+static int entry_compare_key (const void *key, const void *data,
+                              const void *unused ATTR_UNUSED)
+{
+	const struct store_entry *e = (const struct store_entry *)data;
+
+	return strcmp ((const char *)key, e->key);
+}
+
+static void put_u32 (char *p, uint32_t val)
+{
+	p[0] = (char)(val & 0xff);
+	p[1] = (char)((val >> 8) & 0xff);
+	p[2] = (char)((val >> 16) & 0xff);
+	p[3] = (char)((val >> 24) & 0xff);
+}
+
+static uint32_t get_u32 (const char *p)
+{
+	return (uint32_t)(unsigned char)p[0]
+		| (uint32_t)(unsigned char)p[1] << 8
+		| (uint32_t)(unsigned char)p[2] << 16
+		| (uint32_t)(unsigned char)p[3] << 24;
+}
+
+/* FNV-1a hash of the data. */
+static uint32_t checksum (uint32_t h, const char *data, size_t size)
+{
+	while (size--) {
+		h ^= (unsigned char)*data++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* Compute the checksum of a record whose header and key are in rec,
+ * followed by data. */
+static uint32_t record_checksum (const char *rec, const size_t key_len,
+                                 const char *data, const size_t size)
+{
+	uint32_t h = 2166136261u;
+
+	h = checksum (h, rec, 8);
+	h = checksum (h, rec + RECORD_HEADER, key_len);
+	h = checksum (h, data, size);
+
+	return h;
+}
+
+static size_t record_size (const size_t key_len, const size_t size)
+{
+	return RECORD_HEADER + key_len + size;
+}
+
+static int full_pread (int fd, char *buf, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t res = pread (fd, buf, size, offset);
+
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR)
+				continue;
+			return 0;
+		}
+
+		buf += res;
+		size -= res;
+		offset += res;
+	}
+
+	return 1;
+}
+
+static int full_pwrite (int fd, const char *buf, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t res = pwrite (fd, buf, size, offset);
+
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+
+		buf += res;
+		size -= res;
+		offset += res;
+	}
+
+	return 1;
+}
+
+/* Make the record the current one for its key in the index. */
+static void index_set (struct tags_store *s, const char *key,
+                       const off_t offset, const size_t size)
+{
+	struct rb_node *x;
+	struct store_entry *e;
+
+	x = rb_search (s->index, key);
+	if (!rb_is_null (x)) {
+		e = (struct store_entry *)rb_get_data (x);
+		s->live -= record_size (strlen (e->key), e->size);
+	}
+	else {
+		e = (struct store_entry *)xmalloc (offsetof (struct store_entry, key)
+		                                   + strlen (key) + 1);
+		strcpy (e->key, key);
+		rb_insert (s->index, e);
+		s->nitems += 1;
+	}
+
+	e->offset = offset;
+	e->size = size;
+	s->live += record_size (strlen (key), size);
+}
+
+/* Remove the key from the index, return 0 if it was not there. */
+static int index_remove (struct tags_store *s, const char *key)
+{
+	struct rb_node *x;
+	struct store_entry *e;
+
+	x = rb_search (s->index, key);
+	if (rb_is_null (x))
+		return 0;
+
+	e = (struct store_entry *)rb_get_data (x);
+	rb_delete (s->index, key);
+	s->live -= record_size (strlen (e->key), e->size);
+	s->nitems -= 1;
+	free (e);
+
+	return 1;
+}
+
+static void index_clear (struct tags_store *s)
+{
+	struct rb_node *x;
+
+	for (x = rb_min (s->index); !rb_is_null (x); x = rb_next (x))
+		free ((void *)rb_get_data (x));
+
+	rb_tree_clear (s->index);
+	s->live = 0;
+	s->nitems = 0;
+}
+
+/* Read the file and build the index.  Return the size of its valid
+ * part or -1 if it's not a store file. */
+static off_t store_scan (struct tags_store *s)
+{
+	FILE *f;
+	char *buf;
+	size_t buf_size = 4096;
+	char magic[STORE_MAGIC_LEN];
+	off_t pos;
+
+	f = fopen (s->file_name, "rb");
+	if (!f) {
+		logit ("Can't open %s: %s", s->file_name, strerror (errno));
+		return -1;
+	}
+
+	if (fread (magic, 1, STORE_MAGIC_LEN, f) != STORE_MAGIC_LEN
+			|| memcmp (magic, STORE_MAGIC, STORE_MAGIC_LEN)) {
+		fclose (f);
+		return -1;
+	}
+
+	buf = (char *)xmalloc (buf_size);
+	pos = STORE_MAGIC_LEN;
+
+	while (1) {
+		char header[RECORD_HEADER];
+		uint32_t key_len, size, sum;
+		size_t data_len;
+
+		if (fread (header, 1, RECORD_HEADER, f) != RECORD_HEADER)
+			break;
+
+		key_len = get_u32 (header);
+		size = get_u32 (header + 4);
+		sum = get_u32 (header + 8);
+		data_len = size == STORE_DELETED ? 0 : size;
+
+		if (key_len == 0 || key_len > KEY_MAX || data_len > DATA_MAX)
+			break;
+
+		if (buf_size < RECORD_HEADER + key_len + 1 + data_len) {
+			buf_size = RECORD_HEADER + key_len + 1 + data_len;
+			buf = (char *)xrealloc (buf, buf_size);
+		}
+
+		memcpy (buf, header, RECORD_HEADER);
+		if (fread (buf + RECORD_HEADER, 1, key_len + data_len, f)
+				!= key_len + data_len)
+			break;
+
+		if (record_checksum (buf, key_len, buf + RECORD_HEADER + key_len,
+		                     data_len) != sum
+				|| memchr (buf + RECORD_HEADER, 0, key_len))
+			break;
+
+		/* NUL-terminate the key, the data is not needed any more. */
+		buf[RECORD_HEADER + key_len] = '\0';
+
+		if (size == STORE_DELETED)
+			index_remove (s, buf + RECORD_HEADER);
+		else
+			index_set (s, buf + RECORD_HEADER,
+			           pos + RECORD_HEADER + key_len, size);
+
+		pos += record_size (key_len, data_len);
+	}
+
+	free (buf);
+	fclose (f);
+
+	return pos;
+}
+
+/* Write the live records to a new file and replace the old one with it.
+ * Called with the mutex held. */
+static void store_compact (struct tags_store *s)
+{
+	char *tmp_name;
+	FILE *f;
+	off_t *offsets;
+	char *buf = NULL;
+	size_t buf_size = 0;
+	off_t pos;
+	int i, fd;
+	struct rb_node *x;
+
+	debug ("Compacting %s: %lld of %lld bytes live", s->file_name,
+	       (long long)s->live, (long long)s->end);
+
+	tmp_name = (char *)xmalloc (strlen (s->file_name) + 5);
+	sprintf (tmp_name, "%s.tmp", s->file_name);
+
+	f = fopen (tmp_name, "wb");
+	if (!f) {
+		logit ("Can't create %s: %s", tmp_name, strerror (errno));
+		free (tmp_name);
+		return;
+	}
+
+	offsets = (off_t *)xmalloc ((s->nitems + 1) * sizeof (off_t));
+	pos = STORE_MAGIC_LEN;
+	fwrite (STORE_MAGIC, 1, STORE_MAGIC_LEN, f);
+
+	i = 0;
+	for (x = rb_min (s->index); !rb_is_null (x); x = rb_next (x)) {
+		const struct store_entry *e;
+		size_t key_len, rec_size;
+
+		e = (const struct store_entry *)rb_get_data (x);
+		key_len = strlen (e->key);
+		rec_size = record_size (key_len, e->size);
+
+		if (buf_size < rec_size) {
+			buf_size = rec_size;
+			buf = (char *)xrealloc (buf, buf_size);
+		}
+
+		if (!full_pread (s->fd, buf + RECORD_HEADER + key_len, e->size,
+		                 e->offset)) {
+			logit ("Can't read %s: %s", s->file_name, strerror (errno));
+			goto err;
+		}
+
+		put_u32 (buf, key_len);
+		put_u32 (buf + 4, e->size);
+		memcpy (buf + RECORD_HEADER, e->key, key_len);
+		put_u32 (buf + 8, record_checksum (buf, key_len,
+		                  buf + RECORD_HEADER + key_len, e->size));
+
+		if (fwrite (buf, 1, rec_size, f) != rec_size)
+			break;
+
+		offsets[i++] = pos + RECORD_HEADER + key_len;
+		pos += rec_size;
+	}
+
+	if (fflush (f) != 0 || fsync (fileno (f)) != 0 || ferror (f)) {
+		logit ("Can't write %s: %s", tmp_name, strerror (errno));
+		goto err;
+	}
+
+	fd = open (tmp_name, O_RDWR);
+	if (fd == -1 || rename (tmp_name, s->file_name) == -1) {
+		logit ("Can't replace %s: %s", s->file_name, strerror (errno));
+		if (fd != -1)
+			close (fd);
+		goto err;
+	}
+
+	close (s->fd);
+	s->fd = fd;
+	s->end = pos;
+
+	i = 0;
+	for (x = rb_min (s->index); !rb_is_null (x); x = rb_next (x))
+		((struct store_entry *)rb_get_data (x))->offset = offsets[i++];
+
+	fclose (f);
+	free (offsets);
+	free (buf);
+	free (tmp_name);
+
+	return;
+
+err:
+	fclose (f);
+	unlink (tmp_name);
+	free (offsets);
+	free (buf);
+	free (tmp_name);
+}
+
+static int store_needs_compaction (const struct tags_store *s)
+{
+	off_t garbage = s->end - STORE_MAGIC_LEN - s->live;
+
+	return garbage >= COMPACT_MIN && garbage > s->live;
+}
+
+/* Open the store in the file, creating it if it doesn't exist.  Return
+ * NULL on error. */
+struct tags_store *tags_store_open (const char *file_name)
+{
+	struct tags_store *s;
+	struct stat st;
+
+	assert (file_name != NULL);
+
+	s = (struct tags_store *)xmalloc (sizeof (struct tags_store));
+	s->file_name = xstrdup (file_name);
+	s->index = rb_tree_new (entry_compare, entry_compare_key, NULL);
+	s->live = 0;
+	s->nitems = 0;
+	pthread_mutex_init (&s->mutex, NULL);
+
+	s->fd = open (file_name, O_RDWR | O_CREAT, 0600);
+	if (s->fd == -1 || fstat (s->fd, &st) == -1) {
+		error ("Can't open %s: %s", file_name, strerror (errno));
+		tags_store_close (s);
+		return NULL;
+	}
+
+	s->end = st.st_size ? store_scan (s) : -1;
+
+	if (s->end == -1) {
+		if (st.st_size)
+			logit ("%s is not a tags store, recreating it", file_name);
+		index_clear (s);
+		if (ftruncate (s->fd, 0) == -1
+				|| !full_pwrite (s->fd, STORE_MAGIC, STORE_MAGIC_LEN, 0)) {
+			error ("Can't write %s: %s", file_name, strerror (errno));
+			tags_store_close (s);
+			return NULL;
+		}
+		s->end = STORE_MAGIC_LEN;
+	}
+	else if (s->end < st.st_size) {
+		logit ("Cutting off damaged end of %s at %lld", file_name,
+		       (long long)s->end);
+		if (ftruncate (s->fd, s->end) == -1)
+			logit ("Can't truncate %s: %s", file_name, strerror (errno));
+	}
+
+	if (store_needs_compaction (s))
+		store_compact (s);
+
+	logit ("Opened %s: %d items", file_name, s->nitems);
+
+	return s;
+}
+
+void tags_store_close (struct tags_store *s)
+{
+	int rc;
+
+	assert (s != NULL);
+
+	if (s->fd != -1) {
+		if (fsync (s->fd) == -1)
+			logit ("Can't sync %s: %s", s->file_name, strerror (errno));
+		close (s->fd);
+	}
+
+	index_clear (s);
+	rb_tree_free (s->index);
+
+	rc = pthread_mutex_destroy (&s->mutex);
+	if (rc != 0)
+		logit ("Can't destroy mutex: %s", strerror (rc));
+
+	free (s->file_name);
+	free (s);
+}
+
+/* Return the data stored for the key (malloc()ed) and put its size in
+ * *size, or return NULL if there is none. */
+char *tags_store_get (struct tags_store *s, const char *key, size_t *size)
+{
+	struct rb_node *x;
+	char *data = NULL;
+
+	assert (s != NULL);
+	assert (key != NULL);
+
+	LOCK (s->mutex);
+	x = rb_search (s->index, key);
+	if (!rb_is_null (x)) {
+		const struct store_entry *e;
+
+		e = (const struct store_entry *)rb_get_data (x);
+		data = (char *)xmalloc (e->size + 1);
+		if (full_pread (s->fd, data, e->size, e->offset))
+			*size = e->size;
+		else {
+			logit ("Can't read %s: %s", s->file_name, strerror (errno));
+			free (data);
+			data = NULL;
+		}
+	}
+	UNLOCK (s->mutex);
+
+	return data;
+}
+
+/* Append a record, data is NULL for a deletion.  Return 0 on error.
+ * Called with the mutex held. */
+static int store_append (struct tags_store *s, const char *key,
+                         const char *data, const size_t size)
+{
+	char *rec;
+	size_t key_len = strlen (key);
+	size_t rec_size = record_size (key_len, size);
+	int ok;
+
+	rec = (char *)xmalloc (rec_size);
+	put_u32 (rec, key_len);
+	put_u32 (rec + 4, data ? size : STORE_DELETED);
+	memcpy (rec + RECORD_HEADER, key, key_len);
+	if (data)
+		memcpy (rec + RECORD_HEADER + key_len, data, size);
+	put_u32 (rec + 8, record_checksum (rec, key_len,
+	                  rec + RECORD_HEADER + key_len, size));
+
+	ok = full_pwrite (s->fd, rec, rec_size, s->end);
+	if (ok)
+		s->end += rec_size;
+	else {
+		logit ("Can't write %s: %s", s->file_name, strerror (errno));
+		if (ftruncate (s->fd, s->end) == -1)
+			logit ("Can't truncate %s: %s", s->file_name,
+			       strerror (errno));
+	}
+
+	free (rec);
+
+	return ok;
+}
+
+/* Return != 0 if a record with this key and data size can be stored:
+ * store_scan() would take a larger one for garbage and truncate the log
+ * there. */
+static int record_fits (const char *key, const size_t size)
+{
+	size_t key_len = strlen (key);
+
+	if (key_len == 0 || key_len > KEY_MAX) {
+		logit ("Key of %zu bytes can't be stored", key_len);
+		return 0;
+	}
+
+	if (size > DATA_MAX) {
+		logit ("Record of %zu bytes for %s can't be stored", size, key);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Store the data for the key, replacing the old one.  Return 0 on
+ * error. */
+int tags_store_put (struct tags_store *s, const char *key, const char *data,
+                    const size_t size)
+{
+	off_t offset;
+	int ok;
+
+	assert (s != NULL);
+	assert (key != NULL);
+	assert (data != NULL);
+
+	if (!record_fits (key, size))
+		return 0;
+
+	LOCK (s->mutex);
+	offset = s->end + RECORD_HEADER + strlen (key);
+	ok = store_append (s, key, data, size);
+	if (ok)
+		index_set (s, key, offset, size);
+	UNLOCK (s->mutex);
+
+	return ok;
+}
+
+/* Remove the key.  Return 0 if it was not there or on error. */
+int tags_store_del (struct tags_store *s, const char *key)
+{
+	int ok = 0;
+
+	assert (s != NULL);
+	assert (key != NULL);
+
+	if (!record_fits (key, 0))
+		return 0;
+
+	/* The key stays in the index if the deletion can't be written, as
+	 * it would be back after reopening the store. */
+	LOCK (s->mutex);
+	if (!rb_is_null (rb_search (s->index, key))
+			&& store_append (s, key, NULL, 0))
+		ok = index_remove (s, key);
+	UNLOCK (s->mutex);
+
+	return ok;
+}
+
+/* Call fn for each key and its data.  The store is locked while this
+ * runs, so fn must not use it. */
+void tags_store_foreach (struct tags_store *s, t_tags_store_fn *fn,
+                         void *arg)
+{
+	struct rb_node *x;
+	char *buf = NULL;
+	size_t buf_size = 0;
+
+	assert (s != NULL);
+	assert (fn != NULL);
+
+	LOCK (s->mutex);
+	for (x = rb_min (s->index); !rb_is_null (x); x = rb_next (x)) {
+		const struct store_entry *e;
+
+		e = (const struct store_entry *)rb_get_data (x);
+		if (buf_size < e->size + 1) {
+			buf_size = e->size + 1;
+			buf = (char *)xrealloc (buf, buf_size);
+		}
+
+		if (full_pread (s->fd, buf, e->size, e->offset))
+			fn (arg, e->key, buf, e->size);
+		else
+			logit ("Can't read %s: %s", s->file_name, strerror (errno));
+	}
+	UNLOCK (s->mutex);
+
+	free (buf);
+}
+
+/* Flush the changes to disk and compact the file if it has too much
+ * garbage. */
+void tags_store_sync (struct tags_store *s)
+{
+	assert (s != NULL);
+
+	LOCK (s->mutex);
+	if (fsync (s->fd) == -1)
+		logit ("Can't sync %s: %s", s->file_name, strerror (errno));
+	if (store_needs_compaction (s))
+		store_compact (s);
+	UNLOCK (s->mutex);
+}
@@ -0,0 +1,32 @@
+#ifndef TAGS_STORE_H
+#define TAGS_STORE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A simple persistent key/value store used for the tags cache when MOC is
+ * built without BerkeleyDB.  All functions are thread-safe. */
+struct tags_store;
+
+typedef void t_tags_store_fn (void *arg, const char *key,
+                              const char *data, size_t size);
+
+struct tags_store *tags_store_open (const char *file_name);
+void tags_store_close (struct tags_store *s);
+
+char *tags_store_get (struct tags_store *s, const char *key, size_t *size);
+int tags_store_put (struct tags_store *s, const char *key, const char *data,
+                    const size_t size);
+int tags_store_del (struct tags_store *s, const char *key);
+void tags_store_foreach (struct tags_store *s, t_tags_store_fn *fn,
+                         void *arg);
+void tags_store_sync (struct tags_store *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif